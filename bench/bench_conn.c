@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * N clients connect to a running broker and send CONNECT, then stay
+ * idle. at most BENCH_WINDOW of them are connecting at a time, or with
+ * -s all of them at once, like a reconnect storm. reports the rate they
+ * were answered at, the connect-to-CONNECTED latency, and with the
+ * broker's pid, its resident memory per connection.
+ *
+ * usage: bench_conn [-s] [count] [pid]
+ */
+
+#define BENCH_PORT      61613
+#define BENCH_TIMEOUT   30   /* sec */
+#define BENCH_WINDOW    64
+
+#define CONN_CONNECTING   0
+#define CONN_SENT         1
+#define CONN_DONE         2
+#define CONN_FAILED       3
+
+typedef struct {
+    int        bc_fd;
+    int        bc_state;
+    double     bc_start;
+    double     bc_latency;
+} bench_conn_t;
+
+static int bench_connect(struct sockaddr_in *sin);
+static void bench_event(bench_conn_t *bc, int revents, double now);
+static void bench_input(bench_conn_t *bc, double now);
+static long bench_rss(int pid);
+static int bench_cmp(const void *a, const void *b);
+static double bench_now(void);
+
+int
+main(int argc, char *argv[])
+{
+    int i, j, n, c, count, pid, window = BENCH_WINDOW, nactive = 0, opened = 0, failed = 0;
+    int *active;
+    long rss0 = 0, rss1 = 0;
+    double t0, now, *lat;
+    struct pollfd *pfd;
+    struct rlimit rl;
+    struct sockaddr_in sin;
+    bench_conn_t *conns;
+
+    while ((c = getopt(argc, argv, "s")) != -1) {
+        switch (c) {
+        case 's':
+            window = INT_MAX;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s] [count] [pid]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    count = (optind < argc) ? atoi(argv[optind]) : 10000;
+    pid = (optind + 1 < argc) ? atoi(argv[optind + 1]) : 0;
+
+    /* the clients need a descriptor each too */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if ((conns = calloc(count, sizeof(*conns))) == NULL || (active = calloc(count, sizeof(*active))) == NULL ||
+        (pfd = calloc(count, sizeof(*pfd))) == NULL || (lat = calloc(count, sizeof(*lat))) == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(BENCH_PORT);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (pid > 0)
+        rss0 = bench_rss(pid);
+
+    t0 = bench_now();
+
+    while ((opened < count || nactive > 0) && bench_now() - t0 < BENCH_TIMEOUT) {
+        for (; opened < count && nactive < window; opened++) {
+            conns[opened].bc_start = bench_now();
+            if ((conns[opened].bc_fd = bench_connect(&sin)) < 0) {
+                fprintf(stderr, "%d connections opened: %s\n", opened, strerror(errno));
+                return EXIT_FAILURE;
+            }
+            active[nactive++] = opened;
+        }
+
+        /* only the connections still waiting are polled */
+        for (j = 0; j < nactive; j++) {
+            pfd[j].fd = conns[active[j]].bc_fd;
+            pfd[j].events = (conns[active[j]].bc_state == CONN_CONNECTING) ? POLLOUT : POLLIN;
+        }
+
+        if (poll(pfd, nactive, 100) < 0) {
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+
+        now = bench_now();
+
+        for (i = j = 0; j < nactive; j++) {
+            if (pfd[j].revents != 0)
+                bench_event(&conns[active[j]], pfd[j].revents, now);
+            if (conns[active[j]].bc_state < CONN_DONE)
+                active[i++] = active[j];
+        }
+
+        nactive = i;
+    }
+
+    now = bench_now();
+
+    if (pid > 0)
+        rss1 = bench_rss(pid);
+
+    for (i = n = 0; i < count; i++) {
+        if (conns[i].bc_state == CONN_DONE)
+            lat[n++] = conns[i].bc_latency;
+        else
+            failed++;
+    }
+
+    qsort(lat, n, sizeof(double), bench_cmp);
+
+    printf("%d connections in %.3f s: %.0f conn/s, %d failed or unanswered\n",
+           n, now - t0, n / (now - t0), failed);
+    if (n > 0) {
+        printf("latency ms: median %.2f, p99 %.2f, max %.2f\n",
+               lat[n / 2] * 1e3, lat[n * 99 / 100] * 1e3, lat[n - 1] * 1e3);
+    }
+    if (pid > 0 && rss1 == 0)
+        printf("broker %d is gone\n", pid);
+    else if (pid > 0 && n > 0)
+        printf("broker rss %ld -> %ld KB, %.0f bytes/connection\n", rss0, rss1, (rss1 - rss0) * 1024.0 / n);
+
+    for (i = 0; i < opened; i++)
+        close(conns[i].bc_fd);
+
+    return 0;
+}
+
+static int
+bench_connect(struct sockaddr_in *sin)
+{
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    if (connect(fd, (struct sockaddr *) sin, sizeof(*sin)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void
+bench_event(bench_conn_t *bc, int revents, double now)
+{
+    if (revents & (POLLERR | POLLHUP))
+        bc->bc_state = CONN_FAILED;
+    else if (bc->bc_state == CONN_SENT)
+        bench_input(bc, now);
+    else if (write(bc->bc_fd, "CONNECT\n\n", 10) != 10)   /* with the terminator */
+        bc->bc_state = CONN_FAILED;
+    else
+        bc->bc_state = CONN_SENT;
+}
+
+/* CONNECTED is the only frame expected */
+static void
+bench_input(bench_conn_t *bc, double now)
+{
+    int len;
+    char buf[512];
+
+    if ((len = read(bc->bc_fd, buf, sizeof(buf))) <= 0) {
+        if (len == 0 || errno != EAGAIN)
+            bc->bc_state = CONN_FAILED;
+        return;
+    }
+
+    if (len >= 9 && memcmp(buf, "CONNECTED", 9) == 0) {
+        bc->bc_state = CONN_DONE;
+        bc->bc_latency = now - bc->bc_start;
+    } else
+        bc->bc_state = CONN_FAILED;
+}
+
+static long
+bench_rss(int pid)
+{
+    long rss = 0;
+    char path[64], line[256];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "VmRSS:", 6) == 0)
+            rss = atol(line + 6);
+    }
+
+    fclose(fp);
+
+    return rss;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libsf/sf.h"
+#include "mqcore/binding.h"
+#include "mqcore/binding_hash.h"
+
+/*
+ * the binding table with N destinations: register them all, look up
+ * random ones that exist and ones that don't, and remove them again.
+ */
+
+#define BENCH_LOOKUPS   1000000
+
+static void bench_run(int count);
+static double bench_now(void);
+static uint32_t bench_random(void);
+
+static uint32_t BenchSeed = 2463534242U;
+
+int
+main(int argc, char *argv[])
+{
+    static int counts[] = { 1000, 100000, 1000000 };
+    int i;
+
+    printf("%12s %12s %12s %12s %12s\n", "destinations", "register ns", "hit ns", "miss ns", "remove ns");
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+        bench_run(counts[i]);
+
+    return 0;
+}
+
+static void
+bench_run(int count)
+{
+    int i, found = 0;
+    double t0, t1, t2, t3, t4;
+    char name[BINDING_NAME_MAX];
+    binding_t *bindings;
+    binding_hash_t *bh;
+
+    if ((bh = calloc(1, sizeof(*bh))) == NULL || (bindings = calloc(count, sizeof(*bindings))) == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < count; i++)
+        snprintf(bindings[i].bi_name, BINDING_NAME_MAX, "/queue/orders.%d", i);
+
+    t0 = bench_now();
+
+    for (i = 0; i < count; i++) {
+        if (binding_hash_register(bh, &bindings[i]) < 0)
+            exit(EXIT_FAILURE);
+    }
+
+    t1 = bench_now();
+
+    /* names are formatted in both loops, as a SEND carries its own copy */
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        snprintf(name, sizeof(name), "/queue/orders.%d", bench_random() % count);
+        found += (binding_hash_lookup(bh, name) != NULL);
+    }
+
+    t2 = bench_now();
+
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        snprintf(name, sizeof(name), "/queue/orders.%d", count + bench_random() % count);
+        found -= (binding_hash_lookup(bh, name) != NULL);
+    }
+
+    t3 = bench_now();
+
+    for (i = 0; i < count; i++)
+        binding_hash_unregister(bh, bindings[i].bi_name);
+
+    t4 = bench_now();
+
+    if (found != BENCH_LOOKUPS)
+        printf("%d found, expected %d\n", found, BENCH_LOOKUPS);
+
+    printf("%12d %12.1f %12.1f %12.1f %12.1f\n", count, (t1 - t0) * 1e9 / count,
+           (t2 - t1) * 1e9 / BENCH_LOOKUPS, (t3 - t2) * 1e9 / BENCH_LOOKUPS, (t4 - t3) * 1e9 / count);
+
+    free(bh->bh_tab);
+    free(bh->bh_old);
+    free(bindings);
+    free(bh);
+}
+
+static double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t
+bench_random(void)
+{
+    BenchSeed ^= BenchSeed << 13;
+    BenchSeed ^= BenchSeed >> 17;
+    BenchSeed ^= BenchSeed << 5;
+
+    return BenchSeed;
+}
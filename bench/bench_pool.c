@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libsf/sf.h"
+
+/*
+ * sf_socket_t objects from the pool and from calloc: a reconnect storm
+ * that opens and then drops BENCH_STORM connections at once, and
+ * BENCH_THREADS workers each churning a window of connections.
+ */
+
+#define BENCH_STORM     10000
+#define BENCH_ROUNDS    100
+#define BENCH_CHURN     4000000
+#define BENCH_WINDOW    256
+#define BENCH_THREADS   4
+
+static void bench_storm(int pool);
+static void bench_churn(int pool);
+static void *bench_churn_main(void *param);
+static void *bench_alloc(int pool);
+static void bench_free(int pool, void *obj);
+static double bench_now(void);
+
+static sf_pool_t BenchPool = SF_POOL_INITIALIZER("socket", sf_socket_t);
+
+int
+main(int argc, char *argv[])
+{
+    printf("%zu bytes per object\n", sizeof(sf_socket_t));
+    printf("%8s %24s %24s\n", "", "storm ns/(alloc+free)", "churn ns/(free+alloc)");
+
+    bench_storm(0);
+    bench_churn(0);
+    bench_storm(1);
+    bench_churn(1);
+
+    sf_pool_report();
+
+    return 0;
+}
+
+static void
+bench_storm(int pool)
+{
+    int i, j;
+    double t0;
+    void **objs;
+
+    if ((objs = calloc(BENCH_STORM, sizeof(void *))) == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    t0 = bench_now();
+
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        for (j = 0; j < BENCH_STORM; j++)
+            objs[j] = bench_alloc(pool);
+        for (j = 0; j < BENCH_STORM; j++)
+            bench_free(pool, objs[j]);
+    }
+
+    printf("%8s %24.1f", pool ? "pool" : "calloc", (bench_now() - t0) * 1e9 / BENCH_STORM / BENCH_ROUNDS);
+    free(objs);
+}
+
+/* all the threads' operations over the wall time, so it means the same on any number of cpus */
+static void
+bench_churn(int pool)
+{
+    int i;
+    double t0;
+    pthread_t tid[BENCH_THREADS];
+
+    t0 = bench_now();
+
+    for (i = 0; i < BENCH_THREADS; i++)
+        pthread_create(&tid[i], NULL, bench_churn_main, &pool);
+    for (i = 0; i < BENCH_THREADS; i++)
+        pthread_join(tid[i], NULL);
+
+    printf(" %24.1f\n", (bench_now() - t0) * 1e9 / BENCH_CHURN / BENCH_THREADS);
+}
+
+/* replaces a random one of a window of live objects */
+static void *
+bench_churn_main(void *param)
+{
+    int i, k;
+    int pool = *(int *) param;
+    uint32_t seed = 2463534242U;
+    void *objs[BENCH_WINDOW];
+
+    for (i = 0; i < BENCH_WINDOW; i++)
+        objs[i] = bench_alloc(pool);
+
+    for (i = 0; i < BENCH_CHURN; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        k = seed % BENCH_WINDOW;
+
+        bench_free(pool, objs[k]);
+        objs[k] = bench_alloc(pool);
+    }
+
+    for (i = 0; i < BENCH_WINDOW; i++)
+        bench_free(pool, objs[i]);
+
+    return NULL;
+}
+
+static void *
+bench_alloc(int pool)
+{
+    void *obj;
+
+    if ((obj = pool ? sf_pool_alloc(&BenchPool) : calloc(1, sizeof(sf_socket_t))) == NULL) {
+        perror("alloc");
+        exit(EXIT_FAILURE);
+    }
+
+    return obj;
+}
+
+static void
+bench_free(int pool, void *obj)
+{
+    if (pool)
+        sf_pool_free(&BenchPool, obj);
+    else
+        free(obj);
+}
+
+static double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
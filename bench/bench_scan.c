@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stomp/stomp_scan.c"
+
+/*
+ * the header scan of stomp_parse() over MESSAGE frames with 8 and 30
+ * headers, once with each eol kernel. the kernels are static, so the
+ * source is included here.
+ */
+
+#define BENCH_FRAMES    2000000
+#define BENCH_BUFSIZE   4096
+
+typedef struct {
+    char     *bk_name;
+    int     (*bk_func)(char *buf, int len);
+} bench_kernel_t;
+
+static int bench_frame(char *buf, int nhdr);
+static void bench_run(bench_kernel_t *k, char *buf, int len, int nhdr);
+static double bench_now(void);
+
+static bench_kernel_t BenchKernels[] = {
+    { "scalar", stomp_scan_eol_scalar },
+#ifdef __SSE2__
+    { "sse2", stomp_scan_eol_sse2 },
+    { "avx2", stomp_scan_eol_avx2 },
+#endif
+};
+
+int
+main(int argc, char *argv[])
+{
+    static int nhdrs[] = { 8, 30 };
+    int i, j, len;
+    char buf[BENCH_BUFSIZE];
+
+    printf("%8s %8s %8s %12s %10s\n", "kernel", "headers", "bytes", "ns/frame", "GB/s");
+
+    for (i = 0; i < sizeof(nhdrs) / sizeof(nhdrs[0]); i++) {
+        len = bench_frame(buf, nhdrs[i]);
+
+        for (j = 0; j < sizeof(BenchKernels) / sizeof(BenchKernels[0]); j++) {
+#ifdef __SSE2__
+            if (BenchKernels[j].bk_func == stomp_scan_eol_avx2 && !__builtin_cpu_supports("avx2"))
+                continue;
+#endif
+            bench_run(&BenchKernels[j], buf, len, nhdrs[i]);
+        }
+    }
+
+    return 0;
+}
+
+/* headers of the lengths seen from JMS-style clients */
+static int
+bench_frame(char *buf, int nhdr)
+{
+    int i, len;
+    static char *headers[] = {
+        "destination:/queue/orders.europe.fr.paris",
+        "message-id:ID:host-48213-1700000000000-3:1:1:1:42",
+        "subscription:sub-0",
+        "content-type:application/json;charset=utf-8",
+        "content-length:128",
+        "priority:4",
+        "persistent:true",
+        "timestamp:1700000000123",
+        "expires:0",
+        "correlation-id:7f3c2a9e-4b1d-4c8e-9f2a-1b3c5d7e9f11",
+        "reply-to:/temp-queue/replies.client-7",
+        "JMSXGroupID:account-000123",
+    };
+
+    len = sprintf(buf, "MESSAGE\n");
+
+    for (i = 0; i < nhdr; i++)
+        len += sprintf(buf + len, "%s\n", headers[i % (sizeof(headers) / sizeof(headers[0]))]);
+
+    len += sprintf(buf + len, "\n{\"order\":42}");
+
+    return len + 1;   /* the terminator */
+}
+
+static void
+bench_run(bench_kernel_t *k, char *buf, int len, int nhdr)
+{
+    int i, off, lines = 0;
+    double t0, t1;
+
+    t0 = bench_now();
+
+    for (i = 0; i < BENCH_FRAMES; i++) {
+        /* the command and header lines, up to the blank one */
+        for (off = 0;; off++) {
+            off += k->bk_func(buf + off, len - off);
+            lines++;
+            if (buf[off + 1] == '\n')
+                break;
+        }
+    }
+
+    t1 = bench_now();
+
+    if (lines != BENCH_FRAMES * (nhdr + 1))
+        printf("%s: %d lines, expected %d\n", k->bk_name, lines, BENCH_FRAMES * (nhdr + 1));
+
+    printf("%8s %8d %8d %12.1f %10.2f\n", k->bk_name, nhdr, off,
+           (t1 - t0) * 1e9 / BENCH_FRAMES, (double) off * BENCH_FRAMES / (t1 - t0) / 1e9);
+}
+
+static double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
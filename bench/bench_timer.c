@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libsf/sf.h"
+
+/*
+ * timer operations against a wheel already holding N timers, spread
+ * over an hour like session timeouts. the cost per operation should
+ * not grow with N.
+ */
+
+#define BENCH_OPS       1000000
+#define BENCH_SPREAD    (3600 * 1000)   /* msec */
+
+static void bench_run(int count);
+static void bench_func(void *param1, void *param2);
+static double bench_now(void);
+static uint32_t bench_random(void);
+
+static uint32_t BenchSeed = 2463534242U;
+
+int
+main(int argc, char *argv[])
+{
+    static int counts[] = { 1000, 10000, 100000, 1000000 };
+    int i;
+
+    printf("%10s %12s %12s %12s\n", "timers", "request ns", "re-arm ns", "cancel ns");
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+        bench_run(counts[i]);
+
+    return 0;
+}
+
+static void
+bench_run(int count)
+{
+    int i;
+    double t0, t1, t2, t3;
+    sf_timer_t *timers;
+    sf_instance_t *inst;
+
+    if ((inst = calloc(1, sizeof(*inst))) == NULL || (timers = calloc(count, sizeof(*timers))) == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    t0 = bench_now();
+
+    for (i = 0; i < count; i++)
+        sf_timer_request(inst, &timers[i], bench_random() % BENCH_SPREAD + 1, bench_func, NULL, NULL);
+
+    t1 = bench_now();
+
+    /* a session that sees traffic pushes its timeout back */
+    for (i = 0; i < BENCH_OPS; i++)
+        sf_timer_request(inst, &timers[bench_random() % count], bench_random() % BENCH_SPREAD + 1, bench_func, NULL, NULL);
+
+    t2 = bench_now();
+
+    for (i = 0; i < count; i++)
+        sf_timer_cancel(inst, &timers[i]);
+
+    t3 = bench_now();
+
+    printf("%10d %12.1f %12.1f %12.1f\n", count,
+           (t1 - t0) * 1e9 / count, (t2 - t1) * 1e9 / BENCH_OPS, (t3 - t2) * 1e9 / count);
+
+    free(timers);
+    free(inst);
+}
+
+static void
+bench_func(void *param1, void *param2)
+{
+}
+
+static double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift, so every run places the timers the same way */
+static uint32_t
+bench_random(void)
+{
+    BenchSeed ^= BenchSeed << 13;
+    BenchSeed ^= BenchSeed >> 17;
+    BenchSeed ^= BenchSeed << 5;
+
+    return BenchSeed;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libsf/sf.h"
+#include "mqcore/binding.h"
+#include "mqcore/binding_trie.h"
+
+/*
+ * wildcard matching with N patterns "/topic/prices.<symbol>.*" in the
+ * trie. destinations are drawn from more names than the match cache
+ * holds, so most lookups walk the trie; the hit column repeats one.
+ */
+
+#define BENCH_LOOKUPS   1000000
+#define BENCH_NAMES     8192
+
+static void bench_run(int count);
+static double bench_now(void);
+static uint32_t bench_random(void);
+
+static uint32_t BenchSeed = 2463534242U;
+
+int
+main(int argc, char *argv[])
+{
+    static int counts[] = { 1000, 10000, 100000 };
+    int i;
+
+    printf("%10s %12s %12s\n", "patterns", "miss ns", "hit ns");
+
+    for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+        bench_run(counts[i]);
+
+    return 0;
+}
+
+static void
+bench_run(int count)
+{
+    int i, n = 0;
+    double t0, t1, t2;
+    char (*names)[BINDING_NAME_MAX];
+    binding_t *bindings, **result;
+    binding_trie_t *bt;
+
+    if ((bt = calloc(1, sizeof(*bt))) == NULL ||
+        (bindings = calloc(count, sizeof(*bindings))) == NULL ||
+        (names = calloc(BENCH_NAMES, sizeof(*names))) == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < count; i++) {
+        snprintf(bindings[i].bi_name, BINDING_NAME_MAX, "/topic/prices.S%d.*", i);
+        if (binding_trie_register(bt, &bindings[i]) < 0)
+            exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < BENCH_NAMES; i++)
+        snprintf(names[i], BINDING_NAME_MAX, "/topic/prices.S%u.EUR", bench_random() % count);
+
+    t0 = bench_now();
+
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        n += binding_trie_match(bt, names[bench_random() % BENCH_NAMES], &result);
+
+    t1 = bench_now();
+
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        n += binding_trie_match(bt, names[0], &result);
+
+    t2 = bench_now();
+
+    if (n != BENCH_LOOKUPS * 2)
+        printf("%d matches, expected %d\n", n, BENCH_LOOKUPS * 2);
+
+    printf("%10d %12.1f %12.1f\n", count, (t1 - t0) * 1e9 / BENCH_LOOKUPS, (t2 - t1) * 1e9 / BENCH_LOOKUPS);
+
+    for (i = 0; i < count; i++)
+        binding_trie_unregister(bt, &bindings[i]);
+
+    free(names);
+    free(bindings);
+    free(bt);
+}
+
+static double
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t
+bench_random(void)
+{
+    BenchSeed ^= BenchSeed << 13;
+    BenchSeed ^= BenchSeed >> 17;
+    BenchSeed ^= BenchSeed << 5;
+
+    return BenchSeed;
+}
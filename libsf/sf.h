@@ -33,6 +33,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include "sf_util.h"
 #include "sf_plog.h"
 
@@ -55,6 +56,7 @@ typedef struct {
     int (*pc_timeout)(sf_t *sf, void *udata);
 } sf_protocb_t;
 
+#include "sf_pool.h"
 #include "sf_timer.h"
 #include "sf_pbuf.h"
 #include "sf_socket.h"
@@ -64,9 +66,12 @@ typedef struct {
 
 struct sf_instance {
     int                  inst_fd_poll;
+    pthread_t            inst_thread;
     sf_socket_inst_t     inst_sock;
     sf_session_inst_t    inst_sess;
     sf_timer_inst_t      inst_timer;
+    sf_loop_hook_t      *inst_loop_hook;
+    void                *inst_loop_param;
 };
 
 #endif
@@ -37,33 +37,68 @@
 #include <sys/epoll.h>
 #include "sf.h"
 
+static int socket_epoll_create(sf_instance_t *inst);
+static int socket_epoll_add(sf_instance_t *inst, int fd, void *sock);
+static int socket_epoll_mod(sf_instance_t *inst, int fd, void *sock, int events);
+static int socket_epoll_wait(sf_instance_t *inst, struct timeval *timeout);
 static int socket_epoll(int poll_fd, int fd, int events, void *sock, int epcmd);
-static int socket_epoll_add(int poll_fd, int fd, int events, void *sock);
 
-int
-sf_socket_poll_create(void)
+sf_poll_ops_t SocketPollEpoll = {
+    "epoll",
+    socket_epoll_create,
+    socket_epoll_add,
+    NULL,  /* del */
+    socket_epoll_mod,
+    socket_epoll_wait,
+};
+
+static int
+socket_epoll_create(sf_instance_t *inst)
 {
+    struct epoll_event *eev;
+    sf_socket_inst_t *soi = &inst->inst_sock;
+
+    if ((eev = calloc(soi->soi_poll_events, sizeof(*eev))) == NULL) {
+        plog_error(LOG_ERR, "%s: calloc() failed", __func__);
+        return -1;
+    }
+
+    soi->soi_poll_data = eev;
     return epoll_create(1);
 }
 
-int
-sf_socket_poll_add(int poll_fd, int fd, void *sock)
+static int
+socket_epoll_add(sf_instance_t *inst, int fd, void *sock)
+{
+    return socket_epoll(inst->inst_fd_poll, fd, EPOLLIN | EPOLLOUT | EPOLLET, sock, EPOLL_CTL_ADD);
+}
+
+/* epoll_ctl() checks readiness again, so restored input is reported even with EPOLLET */
+static int
+socket_epoll_mod(sf_instance_t *inst, int fd, void *sock, int events)
 {
-    return socket_epoll_add(poll_fd, fd, EPOLLIN | EPOLLOUT | EPOLLET, sock);
+    int eev = EPOLLET;
+
+    if (events & SF_POLL_IN)
+        eev |= EPOLLIN;
+    if (events & SF_POLL_OUT)
+        eev |= EPOLLOUT;
+
+    return socket_epoll(inst->inst_fd_poll, fd, eev, sock, EPOLL_CTL_MOD);
 }
 
-int
-sf_socket_poll_wait(sf_instance_t *inst, int poll_fd, struct timeval *timeout)
+static int
+socket_epoll_wait(sf_instance_t *inst, struct timeval *timeout)
 {
     int i, count, millisec = -1;
-    struct epoll_event eev[8];
+    struct epoll_event *eev = inst->inst_sock.soi_poll_data;
 
     if (timeout != NULL) {
         millisec = timeout->tv_sec * 1000;
         millisec += (timeout->tv_usec + 999) / 1000;
     }
 
-    if ((count = epoll_wait(poll_fd, eev, NELEMS(eev), millisec)) < 0) {
+    if ((count = epoll_wait(inst->inst_fd_poll, eev, inst->inst_sock.soi_poll_events, millisec)) < 0) {
         plog_error(LOG_ERR, __func__, "epoll_wait() failed");
         return -1;
     }
@@ -98,10 +133,4 @@ socket_epoll(int poll_fd, int fd, int events, void *sock, int epcmd)
     return 0;
 }
 
-static int
-socket_epoll_add(int poll_fd, int fd, int events, void *sock)
-{
-    return socket_epoll(poll_fd, fd, events, sock, EPOLL_CTL_ADD);
-}
-
 #endif  /* HAVE_EPOLL */
@@ -39,30 +39,50 @@
 #include <sys/time.h>
 #include "sf.h"
 
-static int socket_kqueue_write_event(sf_instance_t *inst, struct kevent *kev, int count);
-static int socket_kqueue_read_event(sf_instance_t *inst, struct kevent *kev, int count);
+static int socket_kqueue_create(sf_instance_t *inst);
+static int socket_kqueue_add(sf_instance_t *inst, int fd, void *sock);
+static int socket_kqueue_mod(sf_instance_t *inst, int fd, void *sock, int events);
+static int socket_kqueue_wait(sf_instance_t *inst, struct timeval *timeout);
 
-int
-sf_socket_poll_create(void)
+sf_poll_ops_t SocketPollKqueue = {
+    "kqueue",
+    socket_kqueue_create,
+    socket_kqueue_add,
+    NULL,  /* del */
+    socket_kqueue_mod,
+    socket_kqueue_wait,
+};
+
+static int
+socket_kqueue_create(sf_instance_t *inst)
 {
+    struct kevent *kev;
+    sf_socket_inst_t *soi = &inst->inst_sock;
+
+    if ((kev = calloc(soi->soi_poll_events, sizeof(*kev))) == NULL) {
+        plog_error(LOG_ERR, "%s: calloc() failed", __func__);
+        return -1;
+    }
+
+    soi->soi_poll_data = kev;
     return kqueue();
 }
 
-int
-sf_socket_poll_add(int poll_fd, int fd, void *sock)
+static int
+socket_kqueue_add(sf_instance_t *inst, int fd, void *sock)
 {
     struct kevent kev;
 
     plog(LOG_DEBUG, "%s: fd = %d", __func__, fd);
 
     EV_SET(&kev, fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, sock);
-    if (kevent(poll_fd, &kev, 1, NULL, 0, NULL) < 0) {
+    if (kevent(inst->inst_fd_poll, &kev, 1, NULL, 0, NULL) < 0) {
         plog(LOG_DEBUG, "%s: kevent() failed", __func__);
         return -1;
     }
 
     EV_SET(&kev, fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, sock);
-    if (kevent(poll_fd, &kev, 1, NULL, 0, NULL) < 0) {
+    if (kevent(inst->inst_fd_poll, &kev, 1, NULL, 0, NULL) < 0) {
         plog(LOG_DEBUG, "%s: kevent() failed", __func__);
         return -1;
     }
@@ -70,11 +90,27 @@ sf_socket_poll_add(int poll_fd, int fd, void *sock)
     return 0;
 }
 
-int
-sf_socket_poll_wait(sf_instance_t *inst, int poll_fd, struct timeval *timeout)
+static int
+socket_kqueue_mod(sf_instance_t *inst, int fd, void *sock, int events)
+{
+    struct kevent kev[2];
+
+    EV_SET(&kev[0], fd, EVFILT_READ, (events & SF_POLL_IN) ? EV_ENABLE : EV_DISABLE, 0, 0, sock);
+    EV_SET(&kev[1], fd, EVFILT_WRITE, (events & SF_POLL_OUT) ? EV_ENABLE : EV_DISABLE, 0, 0, sock);
+
+    if (kevent(inst->inst_fd_poll, kev, NELEMS(kev), NULL, 0, NULL) < 0) {
+        plog_error(LOG_ERR, "%s: kevent() failed", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+socket_kqueue_wait(sf_instance_t *inst, struct timeval *timeout)
 {
     int i, count;
-    struct kevent kev[8];
+    struct kevent *kev = inst->inst_sock.soi_poll_data;
     struct timespec ts0, *ts = NULL;
 
     if (timeout != NULL) {
@@ -83,7 +119,7 @@ sf_socket_poll_wait(sf_instance_t *inst, int poll_fd, struct timeval *timeout)
         ts = &ts0;
     }
 
-    if ((count = kevent(poll_fd, NULL, 0, kev, NELEMS(kev), ts)) < 0) {
+    if ((count = kevent(inst->inst_fd_poll, NULL, 0, kev, inst->inst_sock.soi_poll_events, ts)) < 0) {
         plog_error(LOG_ERR, "%s: kevent() failed", __func__);
         return -1;
     }
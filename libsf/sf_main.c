@@ -44,14 +44,72 @@ sf_init(sf_instance_t *inst)
     if (sf_init_session(inst) < 0)
         return -1;
 
-    if ((inst->inst_fd_poll = sf_socket_poll_create()) < 0) {
+    if ((inst->inst_fd_poll = sf_socket_poll_create(inst)) < 0) {
         plog_error(LOG_ERR, "%s: socket_poll_create() failed", __func__);
         return -1;
     }
 
+    if (sf_socket_wakeup_init(inst) < 0) {
+        plog(LOG_ERR, "%s: sf_socket_wakeup_init() failed", __func__);
+        return -1;
+    }
+
+    inst->inst_thread = pthread_self();
+
     return 0;
 }
 
+int
+sf_set_poll_method(char *name)
+{
+    return sf_socket_poll_select(name);
+}
+
+/* these apply to instances initialized later */
+void
+sf_set_poll_events(int count)
+{
+    sf_socket_set_poll_events(count);
+}
+
+void
+sf_set_read_budget(int count)
+{
+    sf_socket_set_read_budget(count);
+}
+
+void
+sf_set_accept_budget(int count)
+{
+    sf_socket_set_accept_budget(count);
+}
+
+void
+sf_set_listen_backlog(int count)
+{
+    sf_socket_set_listen_backlog(count);
+}
+
+/* per instance; 0 splits what RLIMIT_NOFILE allows, raised to the hard limit, over the instances */
+void
+sf_set_max_connections(int count)
+{
+    sf_socket_set_max_sockets(count);
+}
+
+/* the number of instances the process will run, for their share of the descriptor limit */
+void
+sf_set_instances(int count)
+{
+    sf_socket_set_instances(count);
+}
+
+void
+sf_set_reuseport(sf_instance_t *inst, int on)
+{
+    inst->inst_sock.soi_reuseport = on;
+}
+
 int
 sf_tcp_listen(sf_instance_t *inst, struct sockaddr *addr, sf_protocb_t *pcb)
 {
@@ -88,18 +146,54 @@ sf_udp_mcast_sendif(sf_instance_t *inst, void *sock, char *ifname)
     return sf_socket_udp_mcast_sendif(inst, (sf_socket_t *) sock, ifname);
 }
 
+void
+sf_set_loop_hook(sf_instance_t *inst, sf_loop_hook_t *func, void *param)
+{
+    inst->inst_loop_hook = func;
+    inst->inst_loop_param = param;
+}
+
 void
 sf_main(sf_instance_t *inst)
 {
+    int usec = -1, wait, dirty = 0;
     struct timeval tv, *t;
 
+    inst->inst_thread = pthread_self();
+
     for (;;) {
         t = (sf_timer_timetonext(inst, &tv) < 0) ? NULL : &tv;
-        sf_socket_poll_wait(inst, inst->inst_fd_poll, t);
+
+        /* the hook may want to run before the next timer; pending output can't wait at all */
+        wait = dirty ? 0 : usec;
+
+        if (wait >= 0 && (t == NULL || tv.tv_sec * 1000000LL + tv.tv_usec > wait)) {
+            tv.tv_sec = wait / 1000000;
+            tv.tv_usec = wait % 1000000;
+            t = &tv;
+        }
+
+        sf_socket_poll_wait(inst, t);
         sf_timer_execute(inst);
+
+        /* everything queued during the iteration goes out with one write per session */
+        sf_session_flush(inst);
+
+        /* the hook sees what the output has done; what it queues goes out right away */
+        if (inst->inst_loop_hook != NULL)
+            usec = inst->inst_loop_hook(inst, inst->inst_loop_param);
+
+        dirty = sf_session_flush(inst);
     }
 }
 
+/* may be called from any thread */
+void
+sf_wakeup(sf_instance_t *inst)
+{
+    sf_socket_wakeup(inst);
+}
+
 int
 sf_send(sf_t *sf, char *buf, int len)
 {
@@ -110,6 +204,46 @@ sf_send(sf_t *sf, char *buf, int len)
                           (struct sockaddr *) &session->se_peer, buf, len);
 }
 
+int
+sf_sendv(sf_t *sf, struct iovec *iov, int iovcnt)
+{
+    sf_session_t *session;
+
+    session = sf->sf_sess;
+    return sf_socket_sendv(sf->sf_inst, session->se_sock,
+                           (struct sockaddr *) &session->se_peer, iov, iovcnt);
+}
+
+int
+sf_notify_output(sf_t *sf)
+{
+    sf_instance_t *inst = sf->sf_inst;
+
+    /* sent at the end of the loop iteration, together with whatever follows */
+    if (pthread_equal(pthread_self(), inst->inst_thread)) {
+        sf_session_mark_dirty(inst, sf->sf_sess);
+        return 0;
+    }
+
+    /* the session belongs to another worker thread */
+    sf_session_notify(inst, sf->sf_sess);
+    return 0;
+}
+
+/* must be called by the owner thread */
+int
+sf_pause_input(sf_t *sf)
+{
+    return sf_socket_pause_input(sf->sf_inst, sf->sf_sess->se_sock);
+}
+
+/* may be called from any thread; input resumes on the next loop iteration */
+void
+sf_resume_input(sf_t *sf)
+{
+    sf_session_notify_resume(sf->sf_inst, sf->sf_sess);
+}
+
 int
 sf_set_timeout(sf_t *sf, int msec)
 {
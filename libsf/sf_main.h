@@ -30,16 +30,33 @@
 #ifndef __SF_MAIN_H__
 #define __SF_MAIN_H__
 
+/* runs after every loop iteration; returns usec until it wants to run again, or -1 */
+typedef int (sf_loop_hook_t)(sf_instance_t *inst, void *param);
+
+int sf_set_poll_method(char *name);
+void sf_set_poll_events(int count);
+void sf_set_read_budget(int count);
+void sf_set_accept_budget(int count);
+void sf_set_listen_backlog(int count);
+void sf_set_max_connections(int count);
+void sf_set_instances(int count);
 int sf_init(sf_instance_t *inst);
+void sf_set_reuseport(sf_instance_t *inst, int on);
 int sf_tcp_listen(sf_instance_t *inst, struct sockaddr *addr, sf_protocb_t *pcb);
 int sf_tcp_connect(sf_instance_t *inst, struct sockaddr *addr, sf_protocb_t *pcb, void *udata);
 void *sf_udp_listen(sf_instance_t *inst, struct sockaddr *addr, sf_protocb_t *pcb);
 void *sf_udp_connect(sf_instance_t *inst, struct sockaddr *addr, sf_protocb_t *pcb, void *udata);
 int sf_udp_mcast_join(sf_instance_t *inst, void *sock, struct sockaddr *addr, char *ifname);
 int sf_udp_mcast_sendif(sf_instance_t *inst, void *sock, char *ifname);
+void sf_set_loop_hook(sf_instance_t *inst, sf_loop_hook_t *func, void *param);
 void sf_main(sf_instance_t *inst);
+void sf_wakeup(sf_instance_t *inst);
 
 int sf_send(sf_t *sf, char *buf, int len);
+int sf_sendv(sf_t *sf, struct iovec *iov, int iovcnt);
+int sf_notify_output(sf_t *sf);
+int sf_pause_input(sf_t *sf);
+void sf_resume_input(sf_t *sf);
 int sf_set_timeout(sf_t *sf, int msec);
 void *sf_get_udata(sf_t *sf);
 void sf_set_udata(sf_t *sf, void *udata);
@@ -38,6 +38,9 @@ static void pbuf_release(sf_pbuf_t *pbuf);
 static void pbuf_release_buf(sf_pbuf_t *pbuf);
 static int pbuf_writable_len(sf_pbuf_t *pbuf);
 static void pbuf_relocate(sf_pbuf_t *pbuf);
+static void pbuf_release_small(sf_pbuf_t *pbuf);
+
+static sf_pool_t PbufSmallPool = SF_POOL_INITIALIZER("pbuf", char[PBUF_SMALL_BUFSIZE]);
 
 int
 sf_init_pbuf(void)
@@ -58,7 +61,7 @@ sf_pbuf_resize(sf_pbuf_t *pbuf, int len)
     int data_len;
     sf_pbuf_t new_pbuf;
 
-    data = pbuf->pb_buf;
+    data = pbuf->pb_head;
     data_len = sf_pbuf_data_len(pbuf);
 
     if (pbuf_init_with_data(&new_pbuf, len, data, data_len) < 0)
@@ -70,10 +73,29 @@ sf_pbuf_resize(sf_pbuf_t *pbuf, int len)
     return 0;
 }
 
+/* a PBUF_SMALL_BUFSIZE buffer from the pool; sf_pbuf_resize() moves it to malloc() */
+int
+sf_pbuf_init_small(sf_pbuf_t *pbuf)
+{
+    char *p;
+
+    if ((p = sf_pool_alloc(&PbufSmallPool)) == NULL) {
+        plog(LOG_ERR, "%s: sf_pool_alloc() failed", __func__);
+        return -1;
+    }
+
+    pbuf_sethdr(pbuf, p, PBUF_SMALL_BUFSIZE);
+    pbuf->pb_release_func = (void (*)(void *)) pbuf_release_small;
+
+    return 0;
+}
+
+/* wraps data the caller owns; releasing the pbuf leaves it alone */
 void
-sf_pbuf_init_small(sf_pbuf_small_t *pbuf)
+sf_pbuf_init_data(sf_pbuf_t *pbuf, char *data, int len)
 {
-    pbuf_sethdr(&pbuf->pbs_hdr, pbuf->pbs_small_buf, sizeof(pbuf->pbs_small_buf));
+    pbuf_sethdr(pbuf, data, len);
+    pbuf->pb_tail += len;
 }
 
 void
@@ -197,6 +219,13 @@ pbuf_release_buf(sf_pbuf_t *pbuf)
         free(pbuf->pb_buf);
 }
 
+static void
+pbuf_release_small(sf_pbuf_t *pbuf)
+{
+    if (pbuf->pb_buf != NULL)
+        sf_pool_free(&PbufSmallPool, pbuf->pb_buf);
+}
+
 static int
 pbuf_writable_len(sf_pbuf_t *pbuf)
 {
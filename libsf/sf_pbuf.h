@@ -40,15 +40,11 @@ typedef struct {
     void      (*pb_release_func)(void *self);
 } sf_pbuf_t;
 
-typedef struct {
-    sf_pbuf_t   pbs_hdr;
-    char        pbs_small_buf[PBUF_SMALL_BUFSIZE];
-} sf_pbuf_small_t;
-
 int sf_init_pbuf(void);
 int sf_pbuf_init(sf_pbuf_t *pbuf, int len);
 int sf_pbuf_resize(sf_pbuf_t *pbuf, int len);
-void sf_pbuf_init_small(sf_pbuf_small_t *pbuf);
+int sf_pbuf_init_small(sf_pbuf_t *pbuf);
+void sf_pbuf_init_data(sf_pbuf_t *pbuf, char *data, int len);
 void sf_pbuf_release(sf_pbuf_t *pbuf);
 int sf_pbuf_buffer_len(sf_pbuf_t *pbuf);
 int sf_pbuf_data_len(sf_pbuf_t *pbuf);
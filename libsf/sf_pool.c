@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sf.h"
+
+/*
+ * typed object pools. objects are carved from slabs that are never
+ * returned to the system. each thread keeps a small free list per pool,
+ * and moves objects from and to the shared free list in batches.
+ */
+
+#define POOL_SLAB_SIZE       (64 * 1024)
+#define POOL_HUGE_SLAB_SIZE  (2 * 1024 * 1024)
+#define POOL_BATCH           (SF_POOL_CACHE_MAX / 2)
+#define POOL_ALIGN(n)        (((n) + 15) & ~15)
+
+typedef struct {
+    void       *pc_free;
+    int         pc_count;
+} pool_cache_t;
+
+static int pool_register(sf_pool_t *pool);
+static int pool_refill(sf_pool_t *pool, pool_cache_t *pc);
+static void pool_drain(sf_pool_t *pool, pool_cache_t *pc, int count);
+static int pool_grow(sf_pool_t *pool);
+static void *pool_slab_alloc(size_t *len);
+
+static __thread pool_cache_t PoolCache[SF_POOL_MAX + 1];
+static pthread_mutex_t PoolRegistryLock = PTHREAD_MUTEX_INITIALIZER;
+static sf_pool_t *PoolRegistry;
+static int PoolCount;
+static int PoolHugepage;
+
+#define POOL_NEXT(obj)   (*(void **) (obj))
+
+void
+sf_pool_set_hugepage(int on)
+{
+    PoolHugepage = on;
+}
+
+void *
+sf_pool_alloc(sf_pool_t *pool)
+{
+    void *obj;
+    pool_cache_t *pc;
+
+    if (pool->pl_id == 0 && pool_register(pool) < 0)
+        return NULL;
+
+    pc = &PoolCache[pool->pl_id];
+
+    if (pc->pc_free == NULL && pool_refill(pool, pc) < 0)
+        return NULL;
+
+    obj = pc->pc_free;
+    pc->pc_free = POOL_NEXT(obj);
+    pc->pc_count--;
+
+    __sync_add_and_fetch(&pool->pl_used, 1);
+    memset(obj, 0, pool->pl_size);
+
+    return obj;
+}
+
+void
+sf_pool_free(sf_pool_t *pool, void *obj)
+{
+    pool_cache_t *pc;
+
+    if (obj == NULL)
+        return;
+
+    pc = &PoolCache[pool->pl_id];
+    POOL_NEXT(obj) = pc->pc_free;
+    pc->pc_free = obj;
+    pc->pc_count++;
+
+    __sync_sub_and_fetch(&pool->pl_used, 1);
+
+    if (pc->pc_count > SF_POOL_CACHE_MAX)
+        pool_drain(pool, pc, POOL_BATCH);
+}
+
+void
+sf_pool_report(void)
+{
+    sf_pool_t *pool;
+
+    pthread_mutex_lock(&PoolRegistryLock);
+
+    for (pool = PoolRegistry; pool != NULL; pool = pool->pl_next) {
+        plog(LOG_INFO, "pool %s: %d/%d objects in use, %zu bytes each, %d slabs",
+             pool->pl_name, pool->pl_used, pool->pl_total, pool->pl_size, pool->pl_slabs);
+    }
+
+    pthread_mutex_unlock(&PoolRegistryLock);
+}
+
+static int
+pool_register(sf_pool_t *pool)
+{
+    int r = 0;
+
+    pthread_mutex_lock(&PoolRegistryLock);
+
+    if (pool->pl_id == 0) {
+        if (PoolCount == SF_POOL_MAX) {
+            plog(LOG_ERR, "%s: too many pools", __func__);
+            r = -1;
+        } else {
+            if (pool->pl_size < sizeof(void *))
+                pool->pl_size = sizeof(void *);
+
+            pool->pl_next = PoolRegistry;
+            PoolRegistry = pool;
+            __sync_synchronize();
+            pool->pl_id = ++PoolCount;
+        }
+    }
+
+    pthread_mutex_unlock(&PoolRegistryLock);
+
+    return r;
+}
+
+static int
+pool_refill(sf_pool_t *pool, pool_cache_t *pc)
+{
+    void *obj;
+    int r = 0;
+
+    pthread_mutex_lock(&pool->pl_lock);
+
+    if (pool->pl_free == NULL && pool_grow(pool) < 0)
+        r = -1;
+
+    while (pool->pl_free != NULL && pc->pc_count < POOL_BATCH) {
+        obj = pool->pl_free;
+        pool->pl_free = POOL_NEXT(obj);
+        pool->pl_free_count--;
+
+        POOL_NEXT(obj) = pc->pc_free;
+        pc->pc_free = obj;
+        pc->pc_count++;
+    }
+
+    pthread_mutex_unlock(&pool->pl_lock);
+
+    return r;
+}
+
+static void
+pool_drain(sf_pool_t *pool, pool_cache_t *pc, int count)
+{
+    void *obj;
+
+    pthread_mutex_lock(&pool->pl_lock);
+
+    while (count-- > 0 && (obj = pc->pc_free) != NULL) {
+        pc->pc_free = POOL_NEXT(obj);
+        pc->pc_count--;
+
+        POOL_NEXT(obj) = pool->pl_free;
+        pool->pl_free = obj;
+        pool->pl_free_count++;
+    }
+
+    pthread_mutex_unlock(&pool->pl_lock);
+}
+
+/* called with pl_lock held */
+static int
+pool_grow(sf_pool_t *pool)
+{
+    int i, count;
+    char *slab;
+    size_t len, size;
+
+    size = POOL_ALIGN(pool->pl_size);
+    len = (size * 16 > POOL_SLAB_SIZE) ? size * 16 : POOL_SLAB_SIZE;
+
+    if ((slab = pool_slab_alloc(&len)) == NULL)
+        return -1;
+
+    count = len / size;
+
+    for (i = count - 1; i >= 0; i--) {
+        POOL_NEXT(slab + i * size) = pool->pl_free;
+        pool->pl_free = slab + i * size;
+    }
+
+    pool->pl_free_count += count;
+    pool->pl_total += count;
+    pool->pl_slabs++;
+
+    plog(LOG_DEBUG, "%s: pool %s grows to %d objects", __func__, pool->pl_name, pool->pl_total);
+
+    return 0;
+}
+
+static void *
+pool_slab_alloc(size_t *len)
+{
+    void *p;
+
+#ifdef MAP_HUGETLB
+    if (PoolHugepage) {
+        p = mmap(NULL, POOL_HUGE_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *len = POOL_HUGE_SLAB_SIZE;
+            return p;
+        }
+
+        plog_error(LOG_WARNING, "%s: huge page is not available", __func__);
+        PoolHugepage = 0;
+    }
+#endif
+
+    if ((p = malloc(*len)) == NULL)
+        plog_error(LOG_ERR, "%s: malloc() failed", __func__);
+
+    return p;
+}
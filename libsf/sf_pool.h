@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __SF_POOL_H__
+#define __SF_POOL_H__
+
+#define SF_POOL_MAX         16    /* pools per process */
+#define SF_POOL_CACHE_MAX   64    /* objects kept by each thread */
+
+typedef struct sf_pool sf_pool_t;
+
+struct sf_pool {
+    char              *pl_name;
+    size_t             pl_size;
+    int                pl_id;        /* per-thread cache index, assigned at first use */
+    pthread_mutex_t    pl_lock;
+    void              *pl_free;
+    int                pl_free_count;
+    int                pl_total;
+    int                pl_used;
+    int                pl_slabs;
+    sf_pool_t         *pl_next;
+};
+
+#define SF_POOL_INITIALIZER(name, type) \
+    { (name), sizeof(type), 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, NULL }
+
+void sf_pool_set_hugepage(int on);
+void *sf_pool_alloc(sf_pool_t *pool);
+void sf_pool_free(sf_pool_t *pool, void *obj);
+void sf_pool_report(void);
+
+#endif
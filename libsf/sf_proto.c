@@ -46,7 +46,7 @@ sf_proto_sid(sf_instance_t *inst, uint64_t *sid, sf_socket_t *sock)
     if ((pcb = sock->so_base.sb_pcb) == NULL || pcb->pc_session_id == NULL)
         return -1;
 
-    pbuf = (sf_pbuf_t *) &sock->so_rbuf;
+    pbuf = sf_socket_rbuf(inst, sock);
     len = sf_pbuf_data_len(pbuf);
 
     if (len <= 0)
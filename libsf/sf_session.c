@@ -36,6 +36,7 @@
 #include <netinet/in.h>
 #include "sf.h"
 
+#define SESSION_HASH_INITIAL   256
 #define HASH_INITIAL_BASIS   2166136261U   /* 32bit FNV-1 hash */
 
 static sf_session_t *session_find(sf_instance_t *inst, struct sockaddr *addr, uint64_t sid);
@@ -51,22 +52,27 @@ static unsigned session_calc_hash_buf(void *buf, int len, unsigned basis);
 static int session_compare_sockaddr(struct sockaddr *a, struct sockaddr *b);
 static int session_compare_sockaddr_in(struct sockaddr_in *a, struct sockaddr_in *b);
 static int session_compare_sockaddr_in6(struct sockaddr_in6 *a, struct sockaddr_in6 *b);
-static int session_euler_prime(int n);
+static int session_hash_resize(sf_session_hash_t *seh, int size);
+static void session_notify(sf_instance_t *inst, sf_session_t *session, unsigned flags);
+static void session_notify_unlink(sf_session_inst_t *sei, sf_session_t *session);
+static void session_dirty_unlink(sf_session_inst_t *sei, sf_session_t *session);
+
+static sf_pool_t SessionPool = SF_POOL_INITIALIZER("session", sf_session_t);
 
 int
 sf_init_session(sf_instance_t *inst)
 {
-    int size;
-
-    /* XXX */
-    inst->inst_sess.sei_max_sessions = 1024;
-    size = session_euler_prime(inst->inst_sess.sei_max_sessions);
+    /* one session per connection */
+    inst->inst_sess.sei_max_sessions = inst->inst_sock.soi_max_sockets;
 
-    if (session_hash_create(&inst->inst_sess.sei_session_hash, size) < 0) {
+    if (session_hash_create(&inst->inst_sess.sei_session_hash, SESSION_HASH_INITIAL) < 0) {
         plog(LOG_ERR, "%s: session_hash_create() failed", __func__);
         return -1;
     }
 
+    pthread_mutex_init(&inst->inst_sess.sei_notify_lock, NULL);
+    inst->inst_sess.sei_notify_head = NULL;
+
     return 0;
 }
 
@@ -123,8 +129,14 @@ sf_session_destroy(sf_instance_t *inst, sf_session_t *session)
     sf_timer_cancel(inst, &session->se_timer);
     sf_proto_end(inst, session);
 
+    /* must be after sf_proto_end() so that no other thread can post it again */
+    pthread_mutex_lock(&sei->sei_notify_lock);
+    session_notify_unlink(sei, session);
+    pthread_mutex_unlock(&sei->sei_notify_lock);
+
+    session_dirty_unlink(sei, session);
     session_hash_unregister(&inst->inst_sess.sei_session_hash, session);
-    free(session);
+    sf_pool_free(&SessionPool, session);
 
     sei->sei_session_count--;
 }
@@ -145,6 +157,10 @@ sf_session_input(sf_instance_t *inst, sf_session_t *session, sf_pbuf_t *pbuf)
             plog(LOG_ERR, "%s: sf_proto_input() failed", __func__);
 
         sf_pbuf_adjust(pbuf, msglen);
+
+        /* paused by this message; the rest waits in the buffer until input resumes */
+        if (session->se_sock != NULL && (session->se_sock->so_flags & SOCK_NOINPUT))
+            break;
     }
 
     return 0;
@@ -185,6 +201,118 @@ sf_session_timeout(sf_instance_t *inst, sf_session_t *session)
     return sf_proto_timeout(inst, session);
 }
 
+void
+sf_session_notify(sf_instance_t *inst, sf_session_t *session)
+{
+    session_notify(inst, session, 0);
+}
+
+/* always deferred, so that it is safe to call with any lock held */
+void
+sf_session_notify_resume(sf_instance_t *inst, sf_session_t *session)
+{
+    session_notify(inst, session, SESSION_RESUME);
+}
+
+void
+sf_session_notify_execute(sf_instance_t *inst)
+{
+    unsigned flags = 0;
+    sf_session_t *session;
+    sf_session_inst_t *sei = &inst->inst_sess;
+
+    for (;;) {
+        pthread_mutex_lock(&sei->sei_notify_lock);
+        if ((session = sei->sei_notify_head) != NULL) {
+            flags = session->se_flags;
+            session->se_flags &= ~SESSION_RESUME;
+            session_notify_unlink(sei, session);
+        }
+        pthread_mutex_unlock(&sei->sei_notify_lock);
+
+        if (session == NULL)
+            break;
+
+        /* sessions are destroyed only by the owner thread, so it is still alive here */
+        if ((flags & SESSION_RESUME) && sf_socket_resume_input(inst, session->se_sock) < 0)
+            plog(LOG_ERR, "%s: sf_socket_resume_input() failed", __func__);
+        if (sf_session_output(inst, session) < 0)
+            plog(LOG_ERR, "%s: sf_session_output() failed", __func__);
+    }
+}
+
+/* the output is done once by sf_session_flush(), however many times it is marked */
+void
+sf_session_mark_dirty(sf_instance_t *inst, sf_session_t *session)
+{
+    sf_session_inst_t *sei = &inst->inst_sess;
+
+    if (session->se_flags & SESSION_DIRTY)
+        return;
+
+    session->se_dirty_next = NULL;
+    if ((session->se_dirty_prev = sei->sei_dirty_tail) != NULL)
+        sei->sei_dirty_tail->se_dirty_next = session;
+    else
+        sei->sei_dirty_head = session;
+
+    sei->sei_dirty_tail = session;
+    session->se_flags |= SESSION_DIRTY;
+}
+
+/* returns 1 if sessions dirtied again by the flush are left for the next round */
+int
+sf_session_flush(sf_instance_t *inst)
+{
+    sf_session_t *session;
+    sf_session_inst_t *sei = &inst->inst_sess;
+
+    if (sei->sei_dirty_head == NULL)
+        return 0;
+
+    /* the pass takes the list; output dirties sessions on a new one, and may destroy any of them */
+    sei->sei_flush_head = sei->sei_dirty_head;
+    sei->sei_flush_tail = sei->sei_dirty_tail;
+    sei->sei_dirty_head = sei->sei_dirty_tail = NULL;
+
+    while ((session = sei->sei_flush_head) != NULL) {
+        session_dirty_unlink(sei, session);
+
+        if (sf_session_output(inst, session) < 0)
+            plog(LOG_ERR, "%s: sf_session_output() failed", __func__);
+    }
+
+    return (sei->sei_dirty_head != NULL) ? 1 : 0;
+}
+
+static void
+session_notify(sf_instance_t *inst, sf_session_t *session, unsigned flags)
+{
+    int wakeup = 0;
+    sf_session_inst_t *sei = &inst->inst_sess;
+
+    pthread_mutex_lock(&sei->sei_notify_lock);
+
+    session->se_flags |= flags;
+
+    if ((session->se_flags & SESSION_NOTIFY) == 0) {
+        if (sei->sei_notify_head == NULL)
+            wakeup = 1;
+        else
+            sei->sei_notify_head->se_notify_prev = session;
+
+        session->se_notify_prev = NULL;
+        session->se_notify_next = sei->sei_notify_head;
+        session->se_flags |= SESSION_NOTIFY;
+        sei->sei_notify_head = session;
+    }
+
+    pthread_mutex_unlock(&sei->sei_notify_lock);
+
+    if (wakeup)
+        sf_socket_wakeup(inst);
+}
+
 static sf_session_t *
 session_find(sf_instance_t *inst, struct sockaddr *addr, uint64_t sid)
 {
@@ -202,8 +330,8 @@ session_create(sf_instance_t *inst, struct sockaddr *addr, sf_socket_t *sock, ui
         return NULL;
     }
 
-    if ((session = (sf_session_t *) calloc(1, sizeof(sf_session_t))) == NULL) {
-        plog_error(LOG_ERR, "%s: calloc() failed", __func__);
+    if ((session = (sf_session_t *) sf_pool_alloc(&SessionPool)) == NULL) {
+        plog(LOG_ERR, "%s: sf_pool_alloc() failed", __func__);
         return NULL;
     }
 
@@ -213,10 +341,18 @@ session_create(sf_instance_t *inst, struct sockaddr *addr, sf_socket_t *sock, ui
     session->se_sock = sock;
     session->se_sid = sid;
     session->se_udata = udata;
+    session->se_hash = session_calc_hash(addr, sid);
+
+    /* a connection accepted without its address is only found through its socket */
+    if (addr->sa_family != AF_UNSPEC)
+        session_hash_register(&sei->sei_session_hash, session);
 
-    session_hash_register(&sei->sei_session_hash, session);
     sei->sei_session_count++;
 
+    /* keep chains short; the old table still works if this fails */
+    if (sei->sei_session_count > sei->sei_session_hash.seh_size)
+        session_hash_resize(&sei->sei_session_hash, sei->sei_session_hash.seh_size * 2);
+
     plog(LOG_DEBUG, "%s: create new session %p (%d)", __func__, session, sei->sei_session_count);
 
     return session;
@@ -237,14 +373,37 @@ session_hash_create(sf_session_hash_t *seh, int size)
     return 0;
 }
 
+/* rehashes everything at once; the stored hash makes that cheap */
+static int
+session_hash_resize(sf_session_hash_t *seh, int size)
+{
+    int i;
+    sf_session_hash_t newh;
+    sf_session_t *session, *next;
+
+    if (session_hash_create(&newh, size) < 0)
+        return -1;
+
+    for (i = 0; i < seh->seh_size; i++) {
+        for (session = seh->seh_table[i]; session != NULL; session = next) {
+            next = session->se_hash_next;
+            session_hash_register(&newh, session);
+        }
+    }
+
+    free(seh->seh_table);
+    *seh = newh;
+
+    return 0;
+}
+
 static void
 session_hash_register(sf_session_hash_t *seh, sf_session_t *session)
 {
     sf_session_t *next;
-    unsigned hash, index;
+    unsigned index;
 
-    hash = session_calc_hash((struct sockaddr *) &session->se_peer, session->se_sid);
-    index = hash % seh->seh_size;
+    index = session->se_hash & (seh->seh_size - 1);
 
     if ((next = seh->seh_table[index]) != NULL)
         next->se_hash_prev = session;
@@ -259,10 +418,9 @@ session_hash_register(sf_session_hash_t *seh, sf_session_t *session)
 static void
 session_hash_unregister(sf_session_hash_t *seh, sf_session_t *session)
 {
-    unsigned hash, index;
+    unsigned index;
 
-    hash = session_calc_hash((struct sockaddr *) &session->se_peer, session->se_sid);
-    index = hash % seh->seh_size;
+    index = session->se_hash & (seh->seh_size - 1);
 
     if (session->se_hash_prev != NULL)
         session->se_hash_prev->se_hash_next = session->se_hash_next;
@@ -282,10 +440,10 @@ session_hash_lookup(sf_session_hash_t *seh, struct sockaddr *sa, uint64_t sid)
     unsigned hash, index;
 
     hash = session_calc_hash(sa, sid);
-    index = hash % seh->seh_size;
+    index = hash & (seh->seh_size - 1);
 
     for (s = seh->seh_table[index]; s != NULL; s = s->se_hash_next) {
-        if (s->se_sid == sid) {
+        if (s->se_hash == hash && s->se_sid == sid) {
             if (session_compare_sockaddr((struct sockaddr *) &s->se_peer, sa) == 0)
                 return s;
         }
@@ -396,16 +554,48 @@ session_compare_sockaddr_in6(struct sockaddr_in6 *a, struct sockaddr_in6 *b)
     return 0;
 }
 
-static int
-session_euler_prime(int n)
+static void
+session_notify_unlink(sf_session_inst_t *sei, sf_session_t *session)
 {
-    int i, value;
+    if ((session->se_flags & SESSION_NOTIFY) == 0)
+        return;
 
-    for (i = 0; i < 1000; i++) {
-        value = (i * i) + i + 41;
-        if (value > n)
-            return value;
-    }
+    if (session->se_notify_prev != NULL)
+        session->se_notify_prev->se_notify_next = session->se_notify_next;
+    if (session->se_notify_next != NULL)
+        session->se_notify_next->se_notify_prev = session->se_notify_prev;
+    if (sei->sei_notify_head == session)
+        sei->sei_notify_head = session->se_notify_next;
 
-    return n;
+    session->se_notify_prev = NULL;
+    session->se_notify_next = NULL;
+    session->se_flags &= ~SESSION_NOTIFY;
 }
+
+/* from the dirty list, or the one sf_session_flush() is working through */
+static void
+session_dirty_unlink(sf_session_inst_t *sei, sf_session_t *session)
+{
+    if ((session->se_flags & SESSION_DIRTY) == 0)
+        return;
+
+    if (session->se_dirty_prev != NULL)
+        session->se_dirty_prev->se_dirty_next = session->se_dirty_next;
+    else if (sei->sei_dirty_head == session)
+        sei->sei_dirty_head = session->se_dirty_next;
+    else
+        sei->sei_flush_head = session->se_dirty_next;
+
+    if (session->se_dirty_next != NULL)
+        session->se_dirty_next->se_dirty_prev = session->se_dirty_prev;
+    else if (sei->sei_dirty_tail == session)
+        sei->sei_dirty_tail = session->se_dirty_prev;
+    else
+        sei->sei_flush_tail = session->se_dirty_prev;
+
+    session->se_dirty_prev = NULL;
+    session->se_dirty_next = NULL;
+    session->se_flags &= ~SESSION_DIRTY;
+}
+
+
@@ -30,6 +30,7 @@
 #ifndef __SF_SESSION_H__
 #define __SF_SESSION_H__
 
+/* chained; the size is a power of two and doubles as sessions are added */
 typedef struct {
     int                 seh_size;
     sf_session_t      **seh_table;
@@ -39,10 +40,21 @@ typedef struct {
     int                 sei_max_sessions;
     int                 sei_session_count;
     sf_session_hash_t   sei_session_hash;
+    pthread_mutex_t     sei_notify_lock;
+    sf_session_t       *sei_notify_head;
+    sf_session_t       *sei_dirty_head;   /* output to flush at the end of the iteration */
+    sf_session_t       *sei_dirty_tail;
+    sf_session_t       *sei_flush_head;   /* the dirty list taken by sf_session_flush() */
+    sf_session_t       *sei_flush_tail;
 } sf_session_inst_t;
 
+#define SESSION_NOTIFY   0x0001
+#define SESSION_RESUME   0x0002   /* resume input when the notification runs */
+#define SESSION_DIRTY    0x0004   /* on the dirty list, owner thread only */
+
 struct sf_session {
     uint64_t            se_sid;
+    unsigned            se_hash;
     sf_sockaddr_t       se_peer;
     sf_socket_t        *se_sock;
     sf_timer_t          se_timer;
@@ -50,6 +62,11 @@ struct sf_session {
     void               *se_udata;
     sf_session_t       *se_hash_prev;
     sf_session_t       *se_hash_next;
+    sf_session_t       *se_notify_prev;
+    sf_session_t       *se_notify_next;
+    sf_session_t       *se_dirty_prev;
+    sf_session_t       *se_dirty_next;
+    unsigned            se_flags;
 };
 
 int sf_init_session(sf_instance_t *inst);
@@ -61,5 +78,10 @@ int sf_session_input(sf_instance_t *inst, sf_session_t *session, sf_pbuf_t *pbuf
 int sf_session_output(sf_instance_t *inst, sf_session_t *session);
 int sf_session_output_bcast(sf_instance_t *inst, void *sock);
 int sf_session_timeout(sf_instance_t *inst, sf_session_t *session);
+void sf_session_notify(sf_instance_t *inst, sf_session_t *session);
+void sf_session_notify_resume(sf_instance_t *inst, sf_session_t *session);
+void sf_session_notify_execute(sf_instance_t *inst);
+void sf_session_mark_dirty(sf_instance_t *inst, sf_session_t *session);
+int sf_session_flush(sf_instance_t *inst);
 
 #endif
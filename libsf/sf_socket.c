@@ -27,6 +27,7 @@
  * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#define _GNU_SOURCE   /* accept4() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,42 +36,167 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "sf.h"
 
+#define SOCKET_RBUF_SIZE    (16 * 1024)
+#define SOCKET_FD_RESERVE   64
+#define SOCKET_FD_MAX       (1024 * 1024)
+
 static sf_socket_base_t *socket_tcp(sf_instance_t *inst, sf_protocb_t *pcb);
 static int socket_tcp_accept(sf_instance_t *inst, int fd, sf_protocb_t *pcb);
 static int socket_tcp_session(sf_instance_t *inst, int new_fd, struct sockaddr *addr, sf_protocb_t *pcb, void *udata);
 static sf_socket_t *socket_udp(sf_instance_t *inst, sf_protocb_t *pcb);
 static sf_socket_t *socket_create(sf_instance_t *inst, int fd, sf_protocb_t *pcb);
 static sf_socket_base_t *socket_create_base(sf_instance_t *inst, int fd, sf_protocb_t *pcb);
+static void socket_destroy_base(sf_instance_t *inst, sf_socket_base_t *sb);
+static int socket_register(sf_instance_t *inst, sf_socket_base_t *sb);
+static void socket_unregister(sf_instance_t *inst, sf_socket_base_t *sb);
+static int socket_limit(void);
 static int socket_bind(int fd, struct sockaddr *addr);
-static int socket_listen(int fd, struct sockaddr *addr);
+static int socket_listen(int fd, struct sockaddr *addr, int reuseport);
 static int socket_nonblock(int fd);
 static int socket_keepalive(int fd);
 static int socket_read_event_accept(sf_instance_t *inst, void *sock);
+static int socket_read_event_wakeup(sf_instance_t *inst, void *sock);
 static int socket_read_event_receive(sf_instance_t *inst, void *sock);
 static int socket_write_event(sf_instance_t *inst, void *sock);
 static int socket_receive(sf_instance_t *inst, sf_socket_t *sock);
+static int socket_input(sf_instance_t *inst, sf_socket_t *sock, sf_session_t *session, sf_pbuf_t *pbuf);
 static int socket_do_receive(sf_instance_t *inst, sf_socket_t *sock, struct sockaddr *from, socklen_t from_len, int flags);
 static int socket_do_receive2(sf_instance_t *inst, sf_socket_t *sock, struct sockaddr *from, socklen_t from_len, char *buf, int bufmax, int flags);
 static sf_session_t *socket_get_session(sf_instance_t *inst, sf_socket_t *sock, struct sockaddr *from);
+static int socket_prepare_rbuf(sf_instance_t *inst, sf_socket_t *sock, sf_session_t *session);
 static int socket_extend_rbuf(sf_instance_t *inst, sf_socket_t *sock, int new_len);
+static int socket_attach_rbuf(sf_socket_t *sock, sf_pbuf_t *pbuf);
 static void socket_shrink_rbuf(sf_socket_t *sock);
+static int socket_hold_rbuf(sf_socket_t *sock, char *buf, int len);
+static void socket_ready_link(sf_socket_inst_t *soi, sf_socket_base_t *sb);
+static void socket_ready_unlink(sf_socket_inst_t *soi, sf_socket_base_t *sb);
+static void socket_ready_execute(sf_instance_t *inst);
+
+static sf_poll_ops_t *SocketPollMethods[] = {
+#ifdef HAVE_KQUEUE
+    &SocketPollKqueue,
+#endif
+#ifdef HAVE_EPOLL
+    &SocketPollEpoll,
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+    &SocketPollUring,
+#endif
+};
+
+/* the first entry is the default and the fallback when another method can't be used */
+static sf_poll_ops_t *SocketPollSelected;
+static sf_pool_t SocketPool = SF_POOL_INITIALIZER("socket", sf_socket_t);
+static int SocketPollEvents = 256;
+static int SocketReadBudget = 16;
+static int SocketAcceptBudget = 64;
+static int SocketListenBacklog = 4096;   /* the kernel caps it at somaxconn */
+static int SocketMaxSockets;   /* per instance; 0: its share of RLIMIT_NOFILE */
+static int SocketInstances = 1;   /* the instances sharing the process descriptor limit */
+
+void
+sf_socket_set_poll_events(int count)
+{
+    SocketPollEvents = count;
+}
+
+void
+sf_socket_set_read_budget(int count)
+{
+    SocketReadBudget = count;
+}
+
+void
+sf_socket_set_accept_budget(int count)
+{
+    SocketAcceptBudget = count;
+}
+
+void
+sf_socket_set_listen_backlog(int count)
+{
+    SocketListenBacklog = count;
+}
+
+void
+sf_socket_set_max_sockets(int count)
+{
+    SocketMaxSockets = count;
+}
+
+void
+sf_socket_set_instances(int count)
+{
+    SocketInstances = (count > 0) ? count : 1;
+}
 
 int
 sf_init_socket(sf_instance_t *inst)
 {
     sf_socket_inst_t *soi = &inst->inst_sock;
 
-    /* XXX configure */
     memset(soi, 0, sizeof(*soi));
-    soi->soi_max_sockets = 64;
+    soi->soi_max_sockets = socket_limit();
     soi->soi_max_msgsize = 1024 * 1024;
+    soi->soi_poll_events = SocketPollEvents;
+    soi->soi_read_budget = SocketReadBudget;
+    soi->soi_accept_budget = SocketAcceptBudget;
+    soi->soi_fd_wakeup = -1;
+
+    if (sf_pbuf_init(&soi->soi_rbuf, SOCKET_RBUF_SIZE) < 0)
+        return -1;
+
+    return 0;
+}
+
+int
+sf_socket_wakeup_init(sf_instance_t *inst)
+{
+    int fds[2];
+    sf_socket_base_t *sb;
+
+    if (pipe(fds) < 0) {
+        plog_error(LOG_ERR, "%s: pipe() failed", __func__);
+        return -1;
+    }
+
+    if (socket_nonblock(fds[0]) < 0 || socket_nonblock(fds[1]) < 0)
+        goto error;
+    if ((sb = socket_create_base(inst, fds[0], NULL)) == NULL)
+        goto error;
+
+    sb->sb_func_read = socket_read_event_wakeup;
+
+    if (sf_socket_poll_add(inst, fds[0], sb) < 0) {
+        socket_destroy_base(inst, sb);
+        goto error;
+    }
 
+    inst->inst_sock.soi_fd_wakeup = fds[1];
     return 0;
+
+error:
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+}
+
+void
+sf_socket_wakeup(sf_instance_t *inst)
+{
+    char c = 0;
+
+    if (write(inst->inst_sock.soi_fd_wakeup, &c, sizeof(c)) < 0) {
+        if (errno != EAGAIN)
+            plog_error(LOG_ERR, "%s: write() failed", __func__);
+    }
 }
 
 int
@@ -81,9 +207,10 @@ sf_socket_tcp_listen(sf_instance_t *inst, struct sockaddr *addr, sf_protocb_t *p
     if ((sb = socket_tcp(inst, pcb)) == NULL)
         return -1;
 
-    if (socket_listen(sb->sb_fd, addr) < 0) {
+    if (socket_listen(sb->sb_fd, addr, inst->inst_sock.soi_reuseport) < 0) {
+        sf_socket_poll_del(inst, sb->sb_fd, sb);
         close(sb->sb_fd);
-        free(sb);
+        socket_destroy_base(inst, sb);
         return -1;
     }
 
@@ -210,6 +337,48 @@ sf_socket_send(sf_instance_t *inst, sf_socket_t *sock, struct sockaddr *to, char
     return sent_len;
 }
 
+int
+sf_socket_sendv(sf_instance_t *inst, sf_socket_t *sock, struct sockaddr *to, struct iovec *iov, int iovcnt)
+{
+    int sent_len;
+    struct msghdr msg;
+
+    if (iovcnt == 0)
+        return 0;
+
+    if (sock->so_flags & SOCK_CONNECTED)
+        sent_len = writev(sock->so_base.sb_fd, iov, iovcnt);
+    else {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = to;
+        msg.msg_namelen = SALEN(to);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        sent_len = sendmsg(sock->so_base.sb_fd, &msg, 0);
+    }
+
+    if (sent_len < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        else {
+            plog_error(LOG_ERR, "%s: writev() failed", __func__);
+            return -1;
+        }
+    }
+
+    return sent_len;
+}
+
+/* the buffer the next read of sock goes to, and where its last read went */
+sf_pbuf_t *
+sf_socket_rbuf(sf_instance_t *inst, sf_socket_t *sock)
+{
+    if (sf_pbuf_buffer_len(&sock->so_rbuf) > 0)
+        return &sock->so_rbuf;
+
+    return &inst->inst_sock.soi_rbuf;
+}
+
 void
 sf_socket_destroy(sf_instance_t *inst, sf_socket_t *sock)
 {
@@ -220,24 +389,185 @@ sf_socket_destroy(sf_instance_t *inst, sf_socket_t *sock)
 
     plog(LOG_DEBUG, "%s: destroy socket %p (fd %d)", __func__, sock, sock->so_base.sb_fd);
 
-    sf_pbuf_release((sf_pbuf_t *) &sock->so_rbuf);
-    sf_pbuf_init_small(&sock->so_rbuf);
+    sf_pbuf_release(&sock->so_rbuf);
 
+    socket_ready_unlink(&inst->inst_sock, &sock->so_base);
+    sf_socket_poll_del(inst, sock->so_base.sb_fd, sock);
+    socket_unregister(inst, &sock->so_base);
     close(sock->so_base.sb_fd);
-    free(sock);
+    sf_pool_free(&SocketPool, sock);
+}
+
+void *
+sf_socket_lookup(sf_instance_t *inst, int fd)
+{
+    sf_socket_inst_t *soi = &inst->inst_sock;
+
+    if (fd < 0 || fd >= soi->soi_table_size)
+        return NULL;
+
+    return soi->soi_table[fd];
+}
+
+/* stop reading a connection; queued output still goes out */
+int
+sf_socket_pause_input(sf_instance_t *inst, sf_socket_t *sock)
+{
+    if (sock->so_flags & SOCK_NOINPUT)
+        return 0;
+
+    plog(LOG_DEBUG, "%s: pause input on socket %p (fd %d)", __func__, sock, sock->so_base.sb_fd);
+
+    if (sf_socket_poll_mod(inst, sock->so_base.sb_fd, sock, SF_POLL_OUT) < 0)
+        return -1;
+
+    sock->so_flags |= SOCK_NOINPUT;
+    return 0;
+}
+
+int
+sf_socket_resume_input(sf_instance_t *inst, sf_socket_t *sock)
+{
+    if ((sock->so_flags & SOCK_NOINPUT) == 0)
+        return 0;
+
+    plog(LOG_DEBUG, "%s: resume input on socket %p (fd %d)", __func__, sock, sock->so_base.sb_fd);
+
+    sock->so_flags &= ~SOCK_NOINPUT;
+
+    /*
+     * what was taken before the pause is read from the ready list, in front
+     * of anything newer; reading starts again once it is gone, see socket_input()
+     */
+    if (sock->so_flags & SOCK_HELD) {
+        socket_ready_link(&inst->inst_sock, &sock->so_base);
+        return 0;
+    }
+
+    return sf_socket_poll_mod(inst, sock->so_base.sb_fd, sock, SF_POLL_IN | SF_POLL_OUT);
+}
+
+int
+sf_socket_poll_select(char *name)
+{
+    int i;
+
+    for (i = 0; i < NELEMS(SocketPollMethods); i++) {
+        if (strcmp(SocketPollMethods[i]->po_name, name) == 0) {
+            SocketPollSelected = SocketPollMethods[i];
+            return 0;
+        }
+    }
+
+    plog(LOG_ERR, "%s: unsupported poll method \"%s\"", __func__, name);
+    return -1;
+}
+
+int
+sf_socket_poll_create(sf_instance_t *inst)
+{
+    int fd;
+    sf_poll_ops_t *ops;
+    sf_socket_inst_t *soi = &inst->inst_sock;
+
+    if ((ops = SocketPollSelected) == NULL)
+        ops = SocketPollMethods[0];
+
+    if ((fd = ops->po_create(inst)) < 0 && ops != SocketPollMethods[0]) {
+        plog(LOG_WARNING, "%s: %s is not available, fall back to %s",
+             __func__, ops->po_name, SocketPollMethods[0]->po_name);
+        ops = SocketPollMethods[0];
+        fd = ops->po_create(inst);
+    }
+
+    if (fd < 0)
+        return -1;
+
+    plog(LOG_DEBUG, "%s: poll method %s (fd %d)", __func__, ops->po_name, fd);
+    soi->soi_poll_ops = ops;
+
+    return fd;
+}
+
+int
+sf_socket_poll_add(sf_instance_t *inst, int fd, void *sock)
+{
+    return inst->inst_sock.soi_poll_ops->po_add(inst, fd, sock);
+}
+
+int
+sf_socket_poll_del(sf_instance_t *inst, int fd, void *sock)
+{
+    sf_poll_ops_t *ops = inst->inst_sock.soi_poll_ops;
+
+    /* closing the descriptor is enough for most methods */
+    if (ops->po_del == NULL)
+        return 0;
+
+    return ops->po_del(inst, fd, sock);
+}
+
+int
+sf_socket_poll_mod(sf_instance_t *inst, int fd, void *sock, int events)
+{
+    sf_poll_ops_t *ops = inst->inst_sock.soi_poll_ops;
+
+    if (ops->po_mod == NULL) {
+        plog(LOG_ERR, "%s: %s can't modify events", __func__, ops->po_name);
+        return -1;
+    }
+
+    return ops->po_mod(inst, fd, sock, events);
+}
+
+/* sockets left on the ready list get their next turn after the new events */
+int
+sf_socket_poll_wait(sf_instance_t *inst, struct timeval *timeout)
+{
+    int r;
+    struct timeval zero;
+    sf_socket_inst_t *soi = &inst->inst_sock;
+
+    /* the turn is taken before the wait; events for these sockets wait for it */
+    if (soi->soi_ready_head != NULL) {
+        soi->soi_turn_head = soi->soi_ready_head;
+        soi->soi_turn_tail = soi->soi_ready_tail;
+        soi->soi_ready_head = soi->soi_ready_tail = NULL;
+
+        zero.tv_sec = zero.tv_usec = 0;
+        timeout = &zero;
+    }
 
-    inst->inst_sock.soi_sock_count--;
+    r = soi->soi_poll_ops->po_wait(inst, timeout);
+
+    socket_ready_execute(inst);
+
+    return r;
 }
 
+/* edge triggered, so a socket that used up its budget is kept on the ready list */
 void
 sf_socket_read_event(sf_instance_t *inst, void *sock)
 {
+    int i, budget;
     sf_socket_base_t *sb = (sf_socket_base_t *) sock;
+    sf_socket_inst_t *soi = &inst->inst_sock;
+
+    /* it waits for its turn there */
+    if (sb->sb_ready)
+        return;
+
+    if (sb->sb_flags & SB_LISTEN)
+        budget = soi->soi_accept_budget;
+    else
+        budget = soi->soi_read_budget;
 
-    for (;;) {
+    for (i = 0; i < budget; i++) {
         if (sb->sb_func_read(inst, sock) < 0)
-            break;
+            return;
     }
+
+    socket_ready_link(soi, sb);
 }
 
 void
@@ -249,6 +579,76 @@ sf_socket_write_event(sf_instance_t *inst, void *sock)
         sb->sb_func_write(inst, sock);
 }
 
+/* a connection the poll method accepted on sock itself */
+void
+sf_socket_accepted(sf_instance_t *inst, void *sock, int fd)
+{
+    sf_sockaddr_t addr;
+    sf_socket_base_t *sb = (sf_socket_base_t *) sock;
+
+    plog(LOG_DEBUG, "%s: tcp accept on fd %d", __func__, sb->sb_fd);
+
+    /* the address is not asked for */
+    memset(&addr, 0, sizeof(addr));
+
+    if (socket_tcp_session(inst, fd, (struct sockaddr *) &addr, sb->sb_pcb, NULL) < 0)
+        plog(LOG_ERR, "%s: socket_tcp_session() failed", __func__);
+}
+
+/* input the poll method read itself; len is 0 at end of stream and negative on error */
+void
+sf_socket_received(sf_instance_t *inst, void *sock, char *buf, int len)
+{
+    int n;
+    sf_pbuf_t data;
+    sf_socket_t *so = (sf_socket_t *) sock;
+
+    plog(LOG_DEBUG, "%s: %d bytes on socket %p (fd %d)", __func__, len, sock, so->so_base.sb_fd);
+
+    if (len <= 0)
+        goto error;
+
+    /* already out of the kernel, so it is held until input resumes */
+    if (so->so_flags & SOCK_NOINPUT) {
+        if (socket_hold_rbuf(so, buf, len) < 0)
+            goto error;
+        return;
+    }
+
+    if (sf_pbuf_buffer_len(&so->so_rbuf) == 0) {
+        /* taken in place; only a partial message at the end is copied */
+        sf_pbuf_init_data(&data, buf, len);
+        if (socket_input(inst, so, so->so_session, &data) < 0)
+            goto error;
+    } else {
+        /* the rest of a partial message the socket holds */
+        while (len > 0) {
+            if ((n = sf_pbuf_free_len(&so->so_rbuf)) > len)
+                n = len;
+
+            sf_pbuf_write(&so->so_rbuf, buf, n);
+            buf += n;
+            len -= n;
+
+            if (socket_input(inst, so, so->so_session, &so->so_rbuf) < 0)
+                goto error;
+
+            if ((so->so_flags & SOCK_NOINPUT) && len > 0) {
+                if (socket_hold_rbuf(so, buf, len) < 0)
+                    goto error;
+                return;
+            }
+        }
+    }
+
+    socket_shrink_rbuf(so);
+    return;
+
+error:
+    sf_session_destroy(inst, so->so_session);
+    sf_socket_destroy(inst, so);
+}
+
 static sf_socket_base_t *
 socket_tcp(sf_instance_t *inst, sf_protocb_t *pcb)
 {
@@ -265,8 +665,10 @@ socket_tcp(sf_instance_t *inst, sf_protocb_t *pcb)
     if ((sb = socket_create_base(inst, fd, pcb)) == NULL)
         goto error;
 
-    if (sf_socket_poll_add(inst->inst_fd_poll, fd, sb) < 0) {
-        free(sb);
+    sb->sb_flags |= SB_LISTEN;
+
+    if (sf_socket_poll_add(inst, fd, sb) < 0) {
+        socket_destroy_base(inst, sb);
         goto error;
     }
 
@@ -287,12 +689,24 @@ socket_tcp_accept(sf_instance_t *inst, int fd, sf_protocb_t *pcb)
     plog(LOG_DEBUG, "%s: tcp accept on fd %d", __func__, fd);
 
     addrlen = sizeof(addr);
-    if ((new_fd = accept(fd, (struct sockaddr *) &addr, &addrlen)) < 0) {
+#ifdef SOCK_NONBLOCK
+    new_fd = accept4(fd, (struct sockaddr *) &addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    new_fd = accept(fd, (struct sockaddr *) &addr, &addrlen);
+#endif
+    if (new_fd < 0) {
         if (errno != EAGAIN)
             plog_error(LOG_ERR, "%s: accept() failed", __func__);
         return -1;
     }
 
+#ifndef SOCK_NONBLOCK
+    if (socket_nonblock(new_fd) < 0) {
+        close(new_fd);
+        return 0;
+    }
+#endif
+
     if (socket_tcp_session(inst, new_fd, (struct sockaddr *) &addr, pcb, NULL) < 0) {
         plog(LOG_ERR, "%s: socket_tcp_sessoin() failed");
         return 0;   /* return 0 even if creating new session is failed */
@@ -312,12 +726,10 @@ socket_tcp_session(sf_instance_t *inst, int new_fd, struct sockaddr *addr, sf_pr
         return -1;
     }
 
-    if (socket_nonblock(new_fd) < 0)
-        goto error;
-    if (socket_keepalive(new_fd) < 0)
-        goto error;
+    sock->so_base.sb_flags |= SB_STREAM;
 
-    if (sf_socket_poll_add(inst->inst_fd_poll, new_fd, sock) < 0)
+    /* SO_KEEPALIVE comes from the listening socket */
+    if (sf_socket_poll_add(inst, new_fd, sock) < 0)
         goto error;
     if ((session = sf_session_create_start(inst, addr, sock, udata)) == NULL)
         goto error;
@@ -347,7 +759,7 @@ socket_udp(sf_instance_t *inst, sf_protocb_t *pcb)
     if ((sock = socket_create(inst, fd, pcb)) == NULL)
         goto error;
 
-    if (sf_socket_poll_add(inst->inst_fd_poll, fd, sock) < 0) {
+    if (sf_socket_poll_add(inst, fd, sock) < 0) {
         sf_socket_destroy(inst, sock);
         return NULL;
     }
@@ -372,8 +784,8 @@ socket_create(sf_instance_t *inst, int fd, sf_protocb_t *pcb)
         return NULL;
     }
 
-    if ((sock = (sf_socket_t *) calloc(1, sizeof(*sock))) == NULL) {
-        plog_error(LOG_ERR, "%s: calloc() failed", __func__);
+    if ((sock = (sf_socket_t *) sf_pool_alloc(&SocketPool)) == NULL) {
+        plog(LOG_ERR, "%s: sf_pool_alloc() failed", __func__);
         return NULL;
     }
 
@@ -382,8 +794,12 @@ socket_create(sf_instance_t *inst, int fd, sf_protocb_t *pcb)
     sock->so_base.sb_func_read = socket_read_event_receive;
     sock->so_base.sb_func_write = socket_write_event;
 
-    sf_pbuf_init_small(&sock->so_rbuf);
-    inst->inst_sock.soi_sock_count++;
+    if (socket_register(inst, &sock->so_base) < 0) {
+        sf_pool_free(&SocketPool, sock);
+        return NULL;
+    }
+
+    sf_pbuf_init(&sock->so_rbuf, 0);
 
     plog(LOG_DEBUG, "%s: new socket %p (fd %d)", __func__, sock, fd);
 
@@ -410,13 +826,105 @@ socket_create_base(sf_instance_t *inst, int fd, sf_protocb_t *pcb)
     sb->sb_func_read = socket_read_event_accept;
     sb->sb_func_write = NULL;
 
-    inst->inst_sock.soi_sock_count++;
+    if (socket_register(inst, sb) < 0) {
+        free(sb);
+        return NULL;
+    }
 
     plog(LOG_DEBUG, "%s: new socket_base %p (fd %d)", __func__, sb, fd);
 
     return sb;
 }
 
+/* the descriptor is closed by the caller */
+static void
+socket_destroy_base(sf_instance_t *inst, sf_socket_base_t *sb)
+{
+    socket_unregister(inst, sb);
+    free(sb);
+}
+
+static int
+socket_register(sf_instance_t *inst, sf_socket_base_t *sb)
+{
+    int size;
+    sf_socket_base_t **newp;
+    sf_socket_inst_t *soi = &inst->inst_sock;
+
+    if (sb->sb_fd >= soi->soi_table_size) {
+        for (size = (soi->soi_table_size == 0) ? 64 : soi->soi_table_size; size <= sb->sb_fd; size *= 2)
+            ;
+
+        if ((newp = realloc(soi->soi_table, sizeof(*newp) * size)) == NULL) {
+            plog_error(LOG_ERR, "%s: realloc() failed", __func__);
+            return -1;
+        }
+
+        memset(&newp[soi->soi_table_size], 0, sizeof(*newp) * (size - soi->soi_table_size));
+        soi->soi_table = newp;
+        soi->soi_table_size = size;
+    }
+
+    soi->soi_table[sb->sb_fd] = sb;
+    soi->soi_sock_count++;
+
+    return 0;
+}
+
+static void
+socket_unregister(sf_instance_t *inst, sf_socket_base_t *sb)
+{
+    sf_socket_inst_t *soi = &inst->inst_sock;
+
+    if (sb->sb_fd < soi->soi_table_size && soi->soi_table[sb->sb_fd] == sb) {
+        soi->soi_table[sb->sb_fd] = NULL;
+        soi->soi_sock_count--;
+    }
+}
+
+/* raises the descriptor limit as far as allowed; a few are kept for files and pipes */
+static int
+socket_limit(void)
+{
+    rlim_t want, share;
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        plog_error(LOG_ERR, "%s: getrlimit() failed", __func__);
+        return 64;
+    }
+
+    /* the limit is the process's, so every instance gets an equal share of it */
+    if (SocketMaxSockets > 0)
+        want = (rlim_t) SocketMaxSockets * SocketInstances + SOCKET_FD_RESERVE;
+    else
+        want = rl.rlim_max;
+    if (want > rl.rlim_max)
+        want = rl.rlim_max;
+    if (want > SOCKET_FD_MAX)
+        want = SOCKET_FD_MAX;   /* RLIM_INFINITY */
+
+    if (want > rl.rlim_cur) {
+        rl.rlim_cur = want;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+            plog_error(LOG_WARNING, "%s: setrlimit() failed", __func__);
+
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if (rl.rlim_cur <= SOCKET_FD_RESERVE * 2)
+        share = rl.rlim_cur / 2 / SocketInstances;
+    else
+        share = (rl.rlim_cur - SOCKET_FD_RESERVE) / SocketInstances;
+
+    if (share == 0)
+        share = 1;
+    if (SocketMaxSockets > 0 && SocketMaxSockets < share)
+        return SocketMaxSockets;
+
+    return share;
+}
+
 static int
 socket_bind(int fd, struct sockaddr *addr)
 {
@@ -429,7 +937,7 @@ socket_bind(int fd, struct sockaddr *addr)
 }
 
 static int
-socket_listen(int fd, struct sockaddr *addr)
+socket_listen(int fd, struct sockaddr *addr, int reuseport)
 {
     int on = 1;
 
@@ -438,10 +946,23 @@ socket_listen(int fd, struct sockaddr *addr)
         return -1;
     }
 
+#ifdef SO_REUSEPORT
+    if (reuseport) {
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            plog_error(LOG_ERR, "%s: setsockopt(SO_REUSEPORT) failed", __func__);
+            return -1;
+        }
+    }
+#endif
+
+    /* accepted sockets inherit it */
+    if (socket_keepalive(fd) < 0)
+        return -1;
+
     if (socket_bind(fd, addr) < 0)
         return -1;
 
-    if (listen(fd, 8) < 0) {
+    if (listen(fd, SocketListenBacklog) < 0) {
         plog_error(LOG_ERR, "%s: listen() failed", __func__);
         return -1;
     }
@@ -488,6 +1009,20 @@ socket_read_event_accept(sf_instance_t *inst, void *sock)
     return socket_tcp_accept(inst, sb->sb_fd, sb->sb_pcb);
 }
 
+static int
+socket_read_event_wakeup(sf_instance_t *inst, void *sock)
+{
+    char buf[64];
+    sf_socket_base_t *sb = (sf_socket_base_t *) sock;
+
+    while (read(sb->sb_fd, buf, sizeof(buf)) > 0)
+        ;
+
+    sf_session_notify_execute(inst);
+
+    return -1;
+}
+
 static int
 socket_read_event_receive(sf_instance_t *inst, void *sock)
 {
@@ -496,6 +1031,28 @@ socket_read_event_receive(sf_instance_t *inst, void *sock)
 
     plog(LOG_DEBUG, "%s: input event on socket %p (fd %d)", __func__, sock, so->so_base.sb_fd);
 
+    /* paused by a message of the same read; the rest stays in the kernel */
+    if (so->so_flags & SOCK_NOINPUT)
+        return -1;
+
+    /* messages taken before a pause go first, and may pause input again */
+    if (so->so_flags & SOCK_HELD) {
+        if (socket_input(inst, so, so->so_session, &so->so_rbuf) < 0) {
+            sf_session_destroy(inst, so->so_session);
+            sf_socket_destroy(inst, so);
+            return -1;
+        }
+
+        if (so->so_flags & SOCK_NOINPUT)
+            return -1;
+
+        socket_shrink_rbuf(so);
+    }
+
+    /* new input comes to sf_socket_received() */
+    if (so->so_base.sb_flags & SB_RECEIVED)
+        return -1;
+
     if ((len = socket_receive(inst, so)) < 0) {
         sf_session_destroy(inst, so->so_session);
         sf_socket_destroy(inst, so);
@@ -534,53 +1091,81 @@ socket_write_event(sf_instance_t *inst, void *sock)
 static int
 socket_receive(sf_instance_t *inst, sf_socket_t *sock)
 {
-    int len, msg_len;
+    int len;
     sf_pbuf_t *pbuf;
     sf_session_t *session;
     sf_sockaddr_t from;
 
-    if ((len = socket_do_receive(inst, sock, (struct sockaddr *) &from, sizeof(from), MSG_PEEK)) < 0)
+    if ((len = socket_do_receive(inst, sock, (struct sockaddr *) &from, sizeof(from), 0)) < 0)
         return -1;
     if (len == 0)
         return 0;
 
+    pbuf = sf_socket_rbuf(inst, sock);
+
     if ((session = socket_get_session(inst, sock, (struct sockaddr *) &from)) == NULL) {
         plog(LOG_ERR, "%s: socket_get_session() failed", __func__);
+        sf_pbuf_adjust(pbuf, sf_pbuf_data_len(pbuf));
         return -1;
     }
 
-    pbuf = (sf_pbuf_t *) &sock->so_rbuf;
     memcpy(&sock->so_last_from, &from, sizeof(sock->so_last_from));
 
-    msg_len = sf_session_estlen(inst, session, pbuf);
-    sf_pbuf_adjust_tail(pbuf, -len);
-
-    if (msg_len > len) {
-        plog(LOG_DEBUG, "%s: estimated message size %d", __func__, msg_len);
-        if (socket_extend_rbuf(inst, sock, msg_len) < 0) {
-            plog(LOG_ERR, "%s: receive failed due to message too big", __func__);
-            return -1;
-        }
-    }
-
-    if ((len = socket_do_receive(inst, sock, (struct sockaddr *) &from, sizeof(from), 0)) <= 0)
+    if (socket_input(inst, sock, session, pbuf) < 0)
         return -1;
 
+    return len;
+}
+
+/* a partial message left over stays with the socket */
+static int
+socket_input(sf_instance_t *inst, sf_socket_t *sock, sf_session_t *session, sf_pbuf_t *pbuf)
+{
     if (sf_session_input(inst, session, pbuf) < 0) {
         plog(LOG_ERR, "%s: sf_session_input() failed", __func__);
+        goto error;
+    }
+
+    /* stopped at a pause, whole messages may be left besides a partial one */
+    if (sock->so_flags & SOCK_NOINPUT) {
+        if (sf_pbuf_data_len(pbuf) > 0)
+            sock->so_flags |= SOCK_HELD;
+    } else if (sock->so_flags & SOCK_HELD) {
+        /* all taken; read again */
+        sock->so_flags &= ~SOCK_HELD;
+        if (sf_socket_poll_mod(inst, sock->so_base.sb_fd, sock, SF_POLL_IN | SF_POLL_OUT) < 0)
+            goto error;
+    }
+
+    if (sf_pbuf_data_len(pbuf) == 0)
+        return 0;
+
+    /* the socket keeps what is left, and room for the rest of a partial message */
+    if (pbuf != &sock->so_rbuf && socket_attach_rbuf(sock, pbuf) < 0)
+        goto error;
+    if (socket_prepare_rbuf(inst, sock, session) < 0) {
+        plog(LOG_ERR, "%s: receive failed due to message too big", __func__);
         return -1;
     }
 
-    return len;
+    return 0;
+
+error:
+    /* nothing may be left behind in a buffer that is not the socket's */
+    sf_pbuf_adjust(pbuf, sf_pbuf_data_len(pbuf));
+    return -1;
 }
 
 static int
 socket_do_receive(sf_instance_t *inst, sf_socket_t *sock, struct sockaddr *from, socklen_t from_len, int flags)
 {
     int len, free_len;
-    sf_pbuf_t *pbuf = (sf_pbuf_t *) &sock->so_rbuf;
+    sf_pbuf_t *pbuf = sf_socket_rbuf(inst, sock);
 
+    /* a partial message may sit past the front of the buffer */
     free_len = sf_pbuf_free_len(pbuf);
+    sf_pbuf_write_prepare(pbuf, free_len);
+
     if ((len = socket_do_receive2(inst, sock, from, from_len, sf_pbuf_tail(pbuf), free_len, flags)) < 0)
         return -1;
 
@@ -633,10 +1218,36 @@ socket_get_session(sf_instance_t *inst, sf_socket_t *sock, struct sockaddr *from
     return session;
 }
 
+static int
+socket_prepare_rbuf(sf_instance_t *inst, sf_socket_t *sock, sf_session_t *session)
+{
+    int msg_len, buf_len;
+    sf_pbuf_t *pbuf = &sock->so_rbuf;
+
+    buf_len = sf_pbuf_buffer_len(pbuf);
+
+    if ((msg_len = sf_session_estlen(inst, session, pbuf)) > buf_len) {
+        plog(LOG_DEBUG, "%s: estimated message size %d", __func__, msg_len);
+        return socket_extend_rbuf(inst, sock, msg_len);
+    }
+
+    /* the length is not known yet and the buffer is full */
+    if (msg_len < 0 && sf_pbuf_free_len(pbuf) == 0) {
+        if (buf_len >= inst->inst_sock.soi_max_msgsize)
+            return -1;
+        if ((msg_len = buf_len * 2) > inst->inst_sock.soi_max_msgsize)
+            msg_len = inst->inst_sock.soi_max_msgsize;
+
+        return socket_extend_rbuf(inst, sock, msg_len);
+    }
+
+    return 0;
+}
+
 static int
 socket_extend_rbuf(sf_instance_t *inst, sf_socket_t *sock, int new_len)
 {
-    sf_pbuf_t *pbuf = (sf_pbuf_t *) &sock->so_rbuf;
+    sf_pbuf_t *pbuf = &sock->so_rbuf;
 
     if (new_len > inst->inst_sock.soi_max_msgsize) {
         plog(LOG_DEBUG, "%s: too large message size", __func__);
@@ -649,13 +1260,112 @@ socket_extend_rbuf(sf_instance_t *inst, sf_socket_t *sock, int new_len)
     return 0;
 }
 
+/* moves what is left in the shared buffer to a buffer of the socket's own */
+static int
+socket_attach_rbuf(sf_socket_t *sock, sf_pbuf_t *pbuf)
+{
+    int len, r;
+
+    len = sf_pbuf_data_len(pbuf);
+    if (len <= PBUF_SMALL_BUFSIZE)
+        r = sf_pbuf_init_small(&sock->so_rbuf);
+    else
+        r = sf_pbuf_init(&sock->so_rbuf, len);
+
+    if (r < 0)
+        return -1;
+
+    sf_pbuf_write(&sock->so_rbuf, sf_pbuf_head(pbuf), len);
+    sf_pbuf_adjust(pbuf, len);
+
+    return 0;
+}
+
+/*
+ * keeps input that arrived after a pause; the recv request is cancelled
+ * at once and not armed again before this is taken, so it is no more
+ * than the provided buffers the kernel had filled
+ */
+static int
+socket_hold_rbuf(sf_socket_t *sock, char *buf, int len)
+{
+    int r = 0;
+    sf_pbuf_t *pbuf = &sock->so_rbuf;
+
+    if (sf_pbuf_buffer_len(pbuf) == 0)
+        r = sf_pbuf_init(pbuf, len);
+    else if (sf_pbuf_free_len(pbuf) < len)
+        r = sf_pbuf_resize(pbuf, sf_pbuf_data_len(pbuf) + len);
+
+    if (r < 0)
+        return -1;
+
+    sock->so_flags |= SOCK_HELD;
+
+    return sf_pbuf_write(pbuf, buf, len);
+}
+
 static void
 socket_shrink_rbuf(sf_socket_t *sock)
 {
-    sf_pbuf_t *pbuf = (sf_pbuf_t *) &sock->so_rbuf;
+    sf_pbuf_t *pbuf = &sock->so_rbuf;
 
-    if (sf_pbuf_data_len(pbuf) == 0) {
+    if (sf_pbuf_buffer_len(pbuf) > 0 && sf_pbuf_data_len(pbuf) == 0)
         sf_pbuf_release(pbuf);
-        sf_pbuf_init_small(&sock->so_rbuf);
+}
+
+static void
+socket_ready_link(sf_socket_inst_t *soi, sf_socket_base_t *sb)
+{
+    if (sb->sb_ready)
+        return;
+
+    sb->sb_ready_next = NULL;
+    if ((sb->sb_ready_prev = soi->soi_ready_tail) != NULL)
+        soi->soi_ready_tail->sb_ready_next = sb;
+    else
+        soi->soi_ready_head = sb;
+
+    soi->soi_ready_tail = sb;
+    sb->sb_ready = 1;
+}
+
+/* from the ready list, or the turn sf_socket_poll_wait() took from it */
+static void
+socket_ready_unlink(sf_socket_inst_t *soi, sf_socket_base_t *sb)
+{
+    if (!sb->sb_ready)
+        return;
+
+    if (sb->sb_ready_prev != NULL)
+        sb->sb_ready_prev->sb_ready_next = sb->sb_ready_next;
+    else if (soi->soi_ready_head == sb)
+        soi->soi_ready_head = sb->sb_ready_next;
+    else
+        soi->soi_turn_head = sb->sb_ready_next;
+
+    if (sb->sb_ready_next != NULL)
+        sb->sb_ready_next->sb_ready_prev = sb->sb_ready_prev;
+    else if (soi->soi_ready_tail == sb)
+        soi->soi_ready_tail = sb->sb_ready_prev;
+    else
+        soi->soi_turn_tail = sb->sb_ready_prev;
+
+    sb->sb_ready_next = sb->sb_ready_prev = NULL;
+    sb->sb_ready = 0;
+}
+
+/* one more budget for each socket on the turn; those still readable go on the ready list again */
+static void
+socket_ready_execute(sf_instance_t *inst)
+{
+    sf_socket_base_t *sb;
+    sf_socket_inst_t *soi = &inst->inst_sock;
+
+    /* a read may destroy any socket, which then leaves the turn too */
+    while ((sb = soi->soi_turn_head) != NULL) {
+        socket_ready_unlink(soi, sb);
+        sf_socket_read_event(inst, sb);
     }
 }
+
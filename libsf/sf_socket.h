@@ -32,29 +32,77 @@
 
 #define SOCK_DONTCLOSE   0x0001
 #define SOCK_CONNECTED   0x0002
+#define SOCK_NOINPUT     0x0004   /* input is paused, see sf_socket_pause_input() */
+#define SOCK_HELD        0x0008   /* so_rbuf holds input taken before a pause; reading waits for it */
 
-typedef struct {
+/* sb_flags; they tell the poll method what a socket is for */
+#define SB_LISTEN        0x0001   /* see sf_socket_accepted() */
+#define SB_STREAM        0x0002   /* see sf_socket_received() */
+#define SB_RECEIVED      0x0004   /* set by the poll method: input comes to sf_socket_received() */
+
+/* events of po_mod() */
+#define SF_POLL_IN       0x0001
+#define SF_POLL_OUT      0x0002
+
+typedef struct sf_socket_base sf_socket_base_t;
+
+struct sf_socket_base {
     int               sb_fd;
     sf_protocb_t     *sb_pcb;
     int             (*sb_func_read)(sf_instance_t *inst, void *sock);
     int             (*sb_func_write)(sf_instance_t *inst, void *sock);
-} sf_socket_base_t;
+    sf_socket_base_t *sb_ready_next;   /* on the ready list: read budget used up, may have more */
+    sf_socket_base_t *sb_ready_prev;
+    int               sb_ready;
+    unsigned          sb_flags;
+};
 
 typedef struct {
     sf_socket_base_t  so_base;
-    sf_pbuf_small_t   so_rbuf;
+    sf_pbuf_t         so_rbuf;   /* holds a partial message only; empty while idle */
     sf_sockaddr_t     so_last_from;
     void             *so_session;   /* sf_session_t */
     unsigned          so_flags;
 } sf_socket_t;
 
 typedef struct {
+    char             *po_name;
+    int             (*po_create)(sf_instance_t *inst);
+    int             (*po_add)(sf_instance_t *inst, int fd, void *sock);
+    int             (*po_del)(sf_instance_t *inst, int fd, void *sock);
+    int             (*po_mod)(sf_instance_t *inst, int fd, void *sock, int events);
+    int             (*po_wait)(sf_instance_t *inst, struct timeval *timeout);
+} sf_poll_ops_t;
+
+typedef struct {
+    sf_poll_ops_t    *soi_poll_ops;
+    void             *soi_poll_data;
     int               soi_sock_count;
     int               soi_max_sockets;
+    int               soi_table_size;
+    sf_socket_base_t **soi_table;   /* indexed by fd */
+    int               soi_poll_events;   /* events fetched by one wait */
+    int               soi_read_budget;   /* reads per socket before the others get a turn */
+    int               soi_accept_budget;   /* the same for accepts on a listening socket */
+    sf_socket_base_t *soi_ready_head;
+    sf_socket_base_t *soi_ready_tail;
+    sf_socket_base_t *soi_turn_head;   /* the ready list taken by sf_socket_poll_wait() */
+    sf_socket_base_t *soi_turn_tail;
+    sf_pbuf_t         soi_rbuf;   /* reads land here unless the socket holds a partial message */
     size_t            soi_max_msgsize;
+    int               soi_reuseport;
+    int               soi_fd_wakeup;
 } sf_socket_inst_t;
 
+void sf_socket_set_poll_events(int count);
+void sf_socket_set_read_budget(int count);
+void sf_socket_set_accept_budget(int count);
+void sf_socket_set_listen_backlog(int count);
+void sf_socket_set_max_sockets(int count);
+void sf_socket_set_instances(int count);
 int sf_init_socket(sf_instance_t *inst);
+int sf_socket_wakeup_init(sf_instance_t *inst);
+void sf_socket_wakeup(sf_instance_t *inst);
 int sf_socket_tcp_listen(sf_instance_t *inst, struct sockaddr *addr, sf_protocb_t *pcb);
 int sf_socket_tcp_connect(sf_instance_t *inst, struct sockaddr *addr, sf_protocb_t *pcb, void *udata);
 sf_socket_t *sf_socket_udp_listen(sf_instance_t *inst, struct sockaddr *addr, sf_protocb_t *pcb);
@@ -62,13 +110,27 @@ sf_socket_t *sf_socket_udp_connect(sf_instance_t *inst, struct sockaddr *addr, s
 int sf_socket_udp_mcast_join(sf_instance_t *inst, sf_socket_t *sock, struct sockaddr *addr, char *ifname);
 int sf_socket_udp_mcast_sendif(sf_instance_t *inst, sf_socket_t *sock, char *ifname);
 int sf_socket_send(sf_instance_t *inst, sf_socket_t *sock, struct sockaddr *to, char *buf, int len);
+int sf_socket_sendv(sf_instance_t *inst, sf_socket_t *sock, struct sockaddr *to, struct iovec *iov, int iovcnt);
 void sf_socket_destroy(sf_instance_t *inst, sf_socket_t *sock);
+sf_pbuf_t *sf_socket_rbuf(sf_instance_t *inst, sf_socket_t *sock);
+void *sf_socket_lookup(sf_instance_t *inst, int fd);
+int sf_socket_pause_input(sf_instance_t *inst, sf_socket_t *sock);
+int sf_socket_resume_input(sf_instance_t *inst, sf_socket_t *sock);
 
 void sf_socket_read_event(sf_instance_t *inst, void *sock);
 void sf_socket_write_event(sf_instance_t *inst, void *sock);
+void sf_socket_accepted(sf_instance_t *inst, void *sock, int fd);
+void sf_socket_received(sf_instance_t *inst, void *sock, char *buf, int len);
+
+int sf_socket_poll_select(char *name);
+int sf_socket_poll_create(sf_instance_t *inst);
+int sf_socket_poll_add(sf_instance_t *inst, int fd, void *sock);
+int sf_socket_poll_del(sf_instance_t *inst, int fd, void *sock);
+int sf_socket_poll_mod(sf_instance_t *inst, int fd, void *sock, int events);
+int sf_socket_poll_wait(sf_instance_t *inst, struct timeval *timeout);
 
-int sf_socket_poll_create(void);
-int sf_socket_poll_add(int poll_fd, int fd, void *sock);
-int sf_socket_poll_wait(sf_instance_t *inst, int poll_fd, struct timeval *timeout);
+extern sf_poll_ops_t SocketPollEpoll;
+extern sf_poll_ops_t SocketPollKqueue;
+extern sf_poll_ops_t SocketPollUring;
 
 #endif
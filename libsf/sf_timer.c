@@ -33,18 +33,31 @@
 #include <sys/time.h>
 #include "sf.h"
 
-#define TIMER_SEC2USEC(s)   ((s) * 1000 * 1000)
+/*
+ * hierarchical timing wheel with 1 msec ticks. level n slot covers
+ * 64^n ticks and is cascaded down to the lower levels when the
+ * current tick reaches it. the bitmaps tell which slots are in use.
+ */
+#define TIMER_MASK              (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_LEVEL_SHIFT(l)    ((l) * TIMER_WHEEL_BITS)
+#define TIMER_RANGE             ((uint64_t) 1 << TIMER_LEVEL_SHIFT(TIMER_WHEEL_LEVELS))
+#define TIMER_NONE              ((uint64_t) -1)
 
 static void timer_register(sf_instance_t *inst, sf_timer_t *timer);
 static void timer_unregister(sf_instance_t *inst, sf_timer_t *timer);
-static void timer_chain_next(sf_timer_t *parent, sf_timer_t *timer);
-static void timer_tv_after(struct timeval *tv, int msec);
-static int timer_tv_compare(struct timeval *a, struct timeval *b);
+static void timer_link(sf_timer_t **head, sf_timer_t *timer);
+static void timer_unlink(sf_timer_inst_t *ti, sf_timer_t *timer);
+static void timer_move(sf_timer_inst_t *ti, sf_timer_t **from, sf_timer_t **to);
+static void timer_cascade(sf_instance_t *inst, int level);
+static uint64_t timer_next_tick(sf_timer_inst_t *ti);
+static uint64_t timer_now(void);
 
 int
 sf_timer_request(sf_instance_t *inst, sf_timer_t *timer, int msec,
                  void (*func)(void *, void *), void *param1, void *param2)
 {
+    uint64_t now;
+
     plog(LOG_DEBUG, "%s: timeout request after %d ms", __func__, msec);
 
     if (sf_timer_isregd(inst, timer)) {
@@ -52,8 +65,13 @@ sf_timer_request(sf_instance_t *inst, sf_timer_t *timer, int msec,
         timer_unregister(inst, timer);
     }
 
-    gettimeofday(&timer->t_time, NULL);
-    timer_tv_after(&timer->t_time, msec);
+    now = timer_now();
+
+    /* the wheel is empty; bring it up to date without walking the ticks */
+    if (inst->inst_timer.ti_count == 0 && now > inst->inst_timer.ti_current)
+        inst->inst_timer.ti_current = now;
+
+    timer->t_expire = now + msec;
     timer->t_func = func;
     timer->t_param1 = param1;
     timer->t_param2 = param2;
@@ -76,144 +94,197 @@ sf_timer_cancel(sf_instance_t *inst, sf_timer_t *timer)
 int
 sf_timer_isregd(sf_instance_t *inst, sf_timer_t *timer)
 {
-    sf_timer_t *t;
-    sf_timer_inst_t *ti = &inst->inst_timer;
-
-    for (t = ti->ti_head; t != NULL; t = t->t_next) {
-        if (t == timer)
-            return 1;
-    }
-
-    return 0;
+    return timer->t_slot != NULL;
 }
 
 int
 sf_timer_timetonext(sf_instance_t *inst, struct timeval *tv_ttn)
 {
-    int s, u;
-    sf_timer_t *next;
-    struct timeval now;
+    uint64_t next, now;
 
-    if ((next = inst->inst_timer.ti_head) == NULL)
+    if ((next = timer_next_tick(&inst->inst_timer)) == TIMER_NONE)
         return -1;
 
-    gettimeofday(&now, NULL);
-    s = next->t_time.tv_sec - now.tv_sec;
-    u = next->t_time.tv_usec - now.tv_usec;
-
-    if (u < 0) {
-        s--;
-        u += TIMER_SEC2USEC(1);
-    }
-
-    if (s < 0) {
-        s = 0;
-        u = 1;
+    if ((now = timer_now()) >= next) {
+        tv_ttn->tv_sec = 0;
+        tv_ttn->tv_usec = 1;
+    } else {
+        tv_ttn->tv_sec = (next - now) / 1000;
+        tv_ttn->tv_usec = ((next - now) % 1000) * 1000;
     }
 
-    tv_ttn->tv_sec = s;
-    tv_ttn->tv_usec = u;
-
     return 0;
 }
 
 void
 sf_timer_execute(sf_instance_t *inst)
 {
-    sf_timer_t *t;
+    int level;
+    uint64_t now, tick;
+    sf_timer_t *t, *expired = NULL;
     sf_timer_inst_t *ti = &inst->inst_timer;
-    struct timeval now;
 
-    gettimeofday(&now, NULL);
+    now = timer_now();
 
-    for (t = ti->ti_head; t != NULL; t = t->t_next) {
-        if (timer_tv_compare(&now, &t->t_time) < 0)
-            break;
+    /* jump over the ticks where nothing happens */
+    while ((tick = timer_next_tick(ti)) <= now) {
+        ti->ti_current = tick;
 
-        timer_unregister(inst, t);
+        for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((tick >> TIMER_LEVEL_SHIFT(level - 1)) & TIMER_MASK)
+                break;
+            timer_cascade(inst, level);
+        }
+
+        /* callbacks may cancel or request timers, so run them from a local list */
+        timer_move(ti, &ti->ti_wheel[0][tick & TIMER_MASK], &expired);
+
+        ti->ti_current = tick + 1;
 
-        if (t->t_func != NULL)
-            t->t_func(t->t_param1, t->t_param2);
+        while ((t = expired) != NULL) {
+            timer_unregister(inst, t);
+
+            if (t->t_func != NULL)
+                t->t_func(t->t_param1, t->t_param2);
+        }
     }
+
+    if (ti->ti_current <= now)
+        ti->ti_current = now + 1;
 }
 
 static void
 timer_register(sf_instance_t *inst, sf_timer_t *timer)
 {
-    sf_timer_t *t;
+    int level;
+    uint64_t delta, expire;
     sf_timer_inst_t *ti = &inst->inst_timer;
 
-    if (ti->ti_head == NULL) {
-        timer->t_prev = NULL;
-        timer->t_next = NULL;
-        ti->ti_head = timer;
-        ti->ti_tail = timer;
-    } else if (timer_tv_compare(&timer->t_time, &ti->ti_head->t_time) < 0) {
-        timer->t_prev = NULL;
-        timer->t_next = ti->ti_head;
-        ti->ti_head->t_prev = timer;
-        ti->ti_head = timer;
-    } else if (timer_tv_compare(&timer->t_time, &ti->ti_tail->t_time) > 0) {
-        timer_chain_next(ti->ti_tail, timer);
-        ti->ti_tail = timer;
-    } else {
-        for (t = ti->ti_head; t != NULL; t = t->t_next) {
-            if (timer_tv_compare(&timer->t_time, &t->t_time) > 0) {
-                timer_chain_next(t, timer);
-                break;
-            }
-        }
+    expire = (timer->t_expire < ti->ti_current) ? ti->ti_current : timer->t_expire;
+    delta = expire - ti->ti_current;
+
+    if (delta >= TIMER_RANGE) {
+        /* cascaded and registered again when the top level slot comes */
+        expire = ti->ti_current + TIMER_RANGE - 1;
+        delta = TIMER_RANGE - 1;
     }
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < ((uint64_t) 1 << TIMER_LEVEL_SHIFT(level + 1)))
+            break;
+    }
+
+    timer_link(&ti->ti_wheel[level][(expire >> TIMER_LEVEL_SHIFT(level)) & TIMER_MASK], timer);
+    ti->ti_bitmap[level] |= (uint64_t) 1 << ((expire >> TIMER_LEVEL_SHIFT(level)) & TIMER_MASK);
+    ti->ti_count++;
 }
 
 static void
 timer_unregister(sf_instance_t *inst, sf_timer_t *timer)
 {
-    sf_timer_inst_t *ti = &inst->inst_timer;
+    timer_unlink(&inst->inst_timer, timer);
+    inst->inst_timer.ti_count--;
+}
+
+static void
+timer_link(sf_timer_t **head, sf_timer_t *timer)
+{
+    timer->t_prev = NULL;
+    timer->t_next = *head;
+    timer->t_slot = head;
+
+    if (*head != NULL)
+        (*head)->t_prev = timer;
+
+    *head = timer;
+}
+
+static void
+timer_unlink(sf_timer_inst_t *ti, sf_timer_t *timer)
+{
+    int n;
 
     if (timer->t_prev != NULL)
         timer->t_prev->t_next = timer->t_next;
+    else
+        *timer->t_slot = timer->t_next;
+
     if (timer->t_next != NULL)
         timer->t_next->t_prev = timer->t_prev;
 
-    if (ti->ti_head == timer)
-        ti->ti_head = timer->t_next;
-    if (ti->ti_tail == timer)
-        ti->ti_tail = timer->t_prev;
+    /* the last timer left a wheel slot */
+    if (*timer->t_slot == NULL) {
+        n = timer->t_slot - &ti->ti_wheel[0][0];
+        if (n >= 0 && n < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+            ti->ti_bitmap[n / TIMER_WHEEL_SLOTS] &= ~((uint64_t) 1 << (n % TIMER_WHEEL_SLOTS));
+    }
+
+    timer->t_prev = NULL;
+    timer->t_next = NULL;
+    timer->t_slot = NULL;
 }
 
 static void
-timer_chain_next(sf_timer_t *parent, sf_timer_t *timer)
+timer_move(sf_timer_inst_t *ti, sf_timer_t **from, sf_timer_t **to)
 {
-    timer->t_prev = parent;
-    timer->t_next = parent->t_next;
-
-    if (parent->t_next != NULL)
-        parent->t_next->t_prev = timer;
+    sf_timer_t *t;
 
-    parent->t_next = timer;
+    while ((t = *from) != NULL) {
+        timer_unlink(ti, t);
+        timer_link(to, t);
+    }
 }
 
 static void
-timer_tv_after(struct timeval *tv, int msec)
+timer_cascade(sf_instance_t *inst, int level)
 {
-    tv->tv_usec += msec * 1000;
+    sf_timer_t *t, *list = NULL;
+    sf_timer_inst_t *ti = &inst->inst_timer;
+    int slot = (ti->ti_current >> TIMER_LEVEL_SHIFT(level)) & TIMER_MASK;
 
-    if (tv->tv_usec > TIMER_SEC2USEC(1)) {
-        tv->tv_usec -= TIMER_SEC2USEC(1);
-        tv->tv_sec++;
+    timer_move(ti, &ti->ti_wheel[level][slot], &list);
+
+    while ((t = list) != NULL) {
+        timer_unregister(inst, t);
+        timer_register(inst, t);
     }
 }
 
-static int
-timer_tv_compare(struct timeval *a, struct timeval *b)
+static uint64_t
+timer_next_tick(sf_timer_inst_t *ti)
 {
-    int r;
+    int level, shift;
+    uint64_t bits, k, tick, next = TIMER_NONE;
 
-    if ((r = a->tv_sec - b->tv_sec) != 0)
-        return r;
-    if ((r = a->tv_usec - b->tv_usec) != 0)
-        return r;
+    if (ti->ti_count == 0)
+        return TIMER_NONE;
 
-    return 0;
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if ((bits = ti->ti_bitmap[level]) == 0)
+            continue;
+
+        /* first level tick not yet passed, and the slot used after it */
+        shift = TIMER_LEVEL_SHIFT(level);
+        k = ti->ti_current >> shift;
+        if (ti->ti_current & (((uint64_t) 1 << shift) - 1))
+            k++;
+
+        if ((k & TIMER_MASK) != 0)
+            bits = (bits >> (k & TIMER_MASK)) | (bits << (TIMER_WHEEL_SLOTS - (k & TIMER_MASK)));
+
+        tick = (k + __builtin_ctzll(bits)) << shift;
+        if (tick < next)
+            next = tick;
+    }
+
+    return next;
+}
+
+static uint64_t
+timer_now(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
 }
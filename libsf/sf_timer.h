@@ -33,18 +33,25 @@
 typedef struct sf_timer sf_timer_t;
 typedef void (sf_timer_func_t)(void *, void*);
 
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  5
+
 struct sf_timer {
-    struct timeval     t_time;
+    uint64_t           t_expire;   /* msec */
     sf_timer_t        *t_prev;
     sf_timer_t        *t_next;
+    sf_timer_t       **t_slot;     /* list head the timer is linked on, NULL if not registered */
     sf_timer_func_t   *t_func;
     void              *t_param1;
     void              *t_param2;
 };
 
 typedef struct {
-    sf_timer_t        *ti_head;
-    sf_timer_t        *ti_tail;
+    uint64_t           ti_current;  /* next tick to be processed */
+    int                ti_count;
+    uint64_t           ti_bitmap[TIMER_WHEEL_LEVELS];
+    sf_timer_t        *ti_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
 } sf_timer_inst_t;
 
 int sf_timer_request(sf_instance_t *inst, sf_timer_t *timer, int msec, sf_timer_func_t *func, void *param1, void *param2);
@@ -0,0 +1,769 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "sf.h"
+
+/*
+ * io_uring poll method.  Requests are submitted together with the next
+ * wait, so registration costs no syscall of its own.  A listening
+ * socket has one multishot accept request, and a connection a
+ * multishot recv request that reads into buffers of a ring shared with
+ * the kernel, plus a multishot poll for POLLOUT; accepting and reading
+ * take no syscall either.  Other sockets, and all of them on kernels
+ * without multishot accept and recv, have a multishot poll request
+ * only.  Completions carry fd and generation instead of the socket
+ * pointer, so that completions of a socket already destroyed in the
+ * same batch are simply dropped.
+ */
+
+#define URING_ENTRIES       256
+#define URING_CQ_ENTRIES    4096
+/* the ring is all input read ahead of the workers; a bigger one queues a
+   new connection behind seconds of busy producers' data */
+#define URING_BUF_COUNT     64    /* power of 2 */
+#define URING_BUF_SIZE      (8 * 1024)
+#define URING_BUF_GROUP     0
+
+#define URING_OP_POLL       0
+#define URING_OP_RECV       1
+#define URING_OP_ACCEPT     2
+
+#define URING_GEN_MASK      0x3fffffff
+
+#define URING_DATA(fd, gen, op) (((uint64_t) (gen) << 34) | ((uint64_t) (op) << 32) | (uint32_t) (fd))
+#define URING_DATA_FD(data)     ((int) ((data) & 0xffffffff))
+#define URING_DATA_OP(data)     ((int) (((data) >> 32) & 3))
+#define URING_DATA_GEN(data)    ((unsigned) ((data) >> 34))
+
+/* the socket itself is found with sf_socket_lookup() */
+typedef struct {
+    unsigned               ue_gen;        /* of the socket; its recv and accept requests carry it */
+    unsigned               ue_poll_gen;   /* of its current poll request */
+    unsigned               ue_events;     /* POLLIN and/or POLLOUT, 0 without a poll request */
+    int                    ue_op;         /* URING_OP_POLL, or the request that takes input */
+    int                    ue_input;      /* recv or accept requests not terminated yet */
+    int                    ue_paused;
+} uring_entry_t;
+
+typedef struct {
+    int                    uv_fd;
+    unsigned               uv_gen;
+    int                    uv_op;
+    int                    uv_res;
+    unsigned               uv_flags;
+    unsigned               uv_events;
+} uring_event_t;
+
+typedef struct {
+    int                    ur_fd;
+    unsigned              *ur_sq_head;
+    unsigned              *ur_sq_tail;
+    unsigned              *ur_sq_mask;
+    unsigned              *ur_sq_array;
+    unsigned               ur_sq_entries;
+    struct io_uring_sqe   *ur_sqes;
+    unsigned              *ur_cq_head;
+    unsigned              *ur_cq_tail;
+    unsigned              *ur_cq_mask;
+    struct io_uring_cqe   *ur_cqes;
+    unsigned               ur_to_submit;
+    unsigned               ur_gen;
+    int                    ur_multishot;   /* accept and recv requests are used */
+    struct io_uring_buf_ring *ur_bufs;
+    char                  *ur_buf_base;
+    char                  *ur_buf_spare;   /* for reads of our own when the ring runs dry */
+    int                    ur_table_size;
+    uring_entry_t         *ur_table;   /* indexed by fd */
+    int                    ur_events_max;
+    uring_event_t         *ur_events;
+} uring_t;
+
+static int socket_uring_create(sf_instance_t *inst);
+static int socket_uring_add(sf_instance_t *inst, int fd, void *sock);
+static int socket_uring_del(sf_instance_t *inst, int fd, void *sock);
+static int socket_uring_mod(sf_instance_t *inst, int fd, void *sock, int events);
+static int socket_uring_wait(sf_instance_t *inst, struct timeval *timeout);
+static int uring_setup(uring_t *ur);
+static int uring_setup_bufs(uring_t *ur);
+static int uring_enter(uring_t *ur, unsigned min_complete, unsigned flags, void *arg, size_t argsz);
+static struct io_uring_sqe *uring_get_sqe(uring_t *ur);
+static unsigned uring_next_gen(uring_t *ur);
+static int uring_arm(uring_t *ur, int fd, unsigned gen, unsigned events);
+static int uring_arm_input(uring_t *ur, int fd);
+static int uring_poll(uring_t *ur, int fd, unsigned events);
+static int uring_remove(uring_t *ur, int fd);
+static int uring_cancel_input(uring_t *ur, int fd);
+static int uring_table_extend(uring_t *ur, int fd);
+static int uring_reap(sf_instance_t *inst, uring_t *ur, uring_event_t *events, int max);
+static void uring_input(sf_instance_t *inst, uring_t *ur, uring_event_t *ev);
+static void uring_read(sf_instance_t *inst, uring_t *ur, int fd, void *sock);
+static void uring_recycle(uring_t *ur, unsigned bid);
+static void *uring_lookup(sf_instance_t *inst, uring_t *ur, uring_event_t *ev);
+
+sf_poll_ops_t SocketPollUring = {
+    "io_uring",
+    socket_uring_create,
+    socket_uring_add,
+    socket_uring_del,
+    socket_uring_mod,
+    socket_uring_wait,
+};
+
+static int
+socket_uring_create(sf_instance_t *inst)
+{
+    uring_t *ur;
+
+    if ((ur = calloc(1, sizeof(*ur))) == NULL) {
+        plog_error(LOG_ERR, "%s: calloc() failed", __func__);
+        return -1;
+    }
+
+    ur->ur_events_max = inst->inst_sock.soi_poll_events;
+    if ((ur->ur_events = calloc(ur->ur_events_max, sizeof(uring_event_t))) == NULL) {
+        plog_error(LOG_ERR, "%s: calloc() failed", __func__);
+        free(ur);
+        return -1;
+    }
+
+    if (uring_setup(ur) < 0) {
+        free(ur->ur_events);
+        free(ur);
+        return -1;
+    }
+
+    /* without a buffer ring, connections are polled */
+    if (uring_setup_bufs(ur) == 0)
+        ur->ur_multishot = 1;
+
+    inst->inst_sock.soi_poll_data = ur;
+    return ur->ur_fd;
+}
+
+static int
+socket_uring_add(sf_instance_t *inst, int fd, void *sock)
+{
+    uring_entry_t *ue;
+    sf_socket_base_t *sb = (sf_socket_base_t *) sock;
+    uring_t *ur = inst->inst_sock.soi_poll_data;
+
+    if (fd >= ur->ur_table_size && uring_table_extend(ur, fd) < 0)
+        return -1;
+
+    ue = &ur->ur_table[fd];
+    ue->ue_gen = uring_next_gen(ur);
+    ue->ue_poll_gen = ue->ue_gen;
+    ue->ue_events = 0;
+    ue->ue_op = URING_OP_POLL;
+    ue->ue_input = 0;
+    ue->ue_paused = 0;
+
+    if (ur->ur_multishot && (sb->sb_flags & SB_LISTEN)) {
+        ue->ue_op = URING_OP_ACCEPT;
+        return uring_arm_input(ur, fd);
+    }
+
+    if (ur->ur_multishot && (sb->sb_flags & SB_STREAM)) {
+        ue->ue_op = URING_OP_RECV;
+        sb->sb_flags |= SB_RECEIVED;
+        if (uring_arm_input(ur, fd) < 0)
+            return -1;
+
+        return uring_poll(ur, fd, POLLOUT);
+    }
+
+    return uring_poll(ur, fd, POLLIN | POLLOUT);
+}
+
+static int
+socket_uring_del(sf_instance_t *inst, int fd, void *sock)
+{
+    uring_entry_t *ue;
+    uring_t *ur = inst->inst_sock.soi_poll_data;
+
+    if (fd >= ur->ur_table_size || ur->ur_table[fd].ue_gen == 0 || sf_socket_lookup(inst, fd) != sock)
+        return 0;
+
+    ue = &ur->ur_table[fd];
+
+    /* the requests hold a file reference, so they must be removed explicitly */
+    if (ue->ue_events != 0 && uring_remove(ur, fd) < 0)
+        return -1;
+    if (ue->ue_input > 0 && uring_cancel_input(ur, fd) < 0)
+        return -1;
+
+    ue->ue_gen = 0;
+    ue->ue_poll_gen = 0;
+
+    return 0;
+}
+
+/* replaces the poll request; completions of the old one are dropped by generation */
+static int
+socket_uring_mod(sf_instance_t *inst, int fd, void *sock, int events)
+{
+    uring_entry_t *ue;
+    unsigned poll_events = 0;
+    uring_t *ur = inst->inst_sock.soi_poll_data;
+
+    if (fd >= ur->ur_table_size || ur->ur_table[fd].ue_gen == 0 || sf_socket_lookup(inst, fd) != sock)
+        return -1;
+
+    ue = &ur->ur_table[fd];
+    ue->ue_paused = (events & SF_POLL_IN) == 0;
+
+    if ((events & SF_POLL_IN) && ue->ue_op == URING_OP_POLL)
+        poll_events |= POLLIN;
+    if (events & SF_POLL_OUT)
+        poll_events |= POLLOUT;
+
+    if (ue->ue_op != URING_OP_POLL) {
+        /*
+         * data already read when the recv request is cancelled is still
+         * delivered; the cancel is submitted now so the kernel reads no more
+         */
+        if (ue->ue_paused && ue->ue_input > 0) {
+            if (uring_cancel_input(ur, fd) < 0)
+                return -1;
+            if (uring_enter(ur, 0, 0, NULL, 0) < 0) {
+                plog_error(LOG_ERR, "%s: io_uring_enter() failed", __func__);
+                return -1;
+            }
+        }
+        if (!ue->ue_paused && ue->ue_input == 0 && uring_arm_input(ur, fd) < 0)
+            return -1;
+        if (poll_events == ue->ue_events)
+            return 0;
+    }
+
+    if (ue->ue_events != 0 && uring_remove(ur, fd) < 0)
+        return -1;
+
+    return uring_poll(ur, fd, poll_events);
+}
+
+static int
+socket_uring_wait(sf_instance_t *inst, struct timeval *timeout)
+{
+    int i, count;
+    void *sock;
+    uring_event_t *ev;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    uring_t *ur = inst->inst_sock.soi_poll_data;
+    uring_event_t *events = ur->ur_events;
+
+    memset(&arg, 0, sizeof(arg));
+
+    if (timeout != NULL) {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_usec * 1000;
+        arg.ts = (uint64_t) (unsigned long) &ts;
+    }
+
+    if (uring_enter(ur, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0) {
+        if (errno != ETIME && errno != EINTR && errno != EBUSY) {
+            plog_error(LOG_ERR, "%s: io_uring_enter() failed", __func__);
+            return -1;
+        }
+    }
+
+    count = uring_reap(inst, ur, events, ur->ur_events_max);
+
+    for (i = 0; i < count; i++) {
+        ev = &events[i];
+        if (ev->uv_op == URING_OP_POLL && (ev->uv_events & POLLOUT)) {
+            if ((sock = uring_lookup(inst, ur, ev)) != NULL)
+                sf_socket_write_event(inst, sock);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        ev = &events[i];
+        if (ev->uv_op != URING_OP_POLL)
+            uring_input(inst, ur, ev);
+        else if (ev->uv_events & (POLLIN | POLLERR | POLLHUP)) {
+            /* errors of a connection with a recv request come with the recv completion */
+            if ((sock = uring_lookup(inst, ur, ev)) != NULL && ur->ur_table[ev->uv_fd].ue_op == URING_OP_POLL)
+                sf_socket_read_event(inst, sock);
+        }
+    }
+
+    return 0;
+}
+
+static int
+uring_setup(uring_t *ur)
+{
+    size_t sq_len, cq_len;
+    char *sq_ring, *cq_ring;
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_CQ_ENTRIES;
+
+    if ((ur->ur_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+        plog_error(LOG_DEBUG, "%s: io_uring_setup() failed", __func__);
+        return -1;
+    }
+
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) == 0 || (p.features & IORING_FEAT_EXT_ARG) == 0) {
+        plog(LOG_DEBUG, "%s: kernel is too old", __func__);
+        goto error;
+    }
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_len > sq_len)
+        sq_len = cq_len;
+
+    if ((sq_ring = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ur->ur_fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+        plog_error(LOG_ERR, "%s: mmap() failed", __func__);
+        goto error;
+    }
+
+    if ((ur->ur_sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        plog_error(LOG_ERR, "%s: mmap() failed", __func__);
+        munmap(sq_ring, sq_len);
+        goto error;
+    }
+
+    cq_ring = sq_ring;   /* IORING_FEAT_SINGLE_MMAP */
+
+    ur->ur_sq_head = (unsigned *) (sq_ring + p.sq_off.head);
+    ur->ur_sq_tail = (unsigned *) (sq_ring + p.sq_off.tail);
+    ur->ur_sq_mask = (unsigned *) (sq_ring + p.sq_off.ring_mask);
+    ur->ur_sq_array = (unsigned *) (sq_ring + p.sq_off.array);
+    ur->ur_sq_entries = p.sq_entries;
+    ur->ur_cq_head = (unsigned *) (cq_ring + p.cq_off.head);
+    ur->ur_cq_tail = (unsigned *) (cq_ring + p.cq_off.tail);
+    ur->ur_cq_mask = (unsigned *) (cq_ring + p.cq_off.ring_mask);
+    ur->ur_cqes = (struct io_uring_cqe *) (cq_ring + p.cq_off.cqes);
+
+    plog(LOG_DEBUG, "%s: io_uring fd %d, %u/%u entries", __func__, ur->ur_fd, p.sq_entries, p.cq_entries);
+
+    return 0;
+
+error:
+    close(ur->ur_fd);
+    return -1;
+}
+
+/* buffers for recv requests; the kernel picks one per completion */
+static int
+uring_setup_bufs(uring_t *ur)
+{
+    int i;
+    size_t ring_len;
+    struct io_uring_buf_reg reg;
+
+    ring_len = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+
+    if ((ur->ur_bufs = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        plog_error(LOG_ERR, "%s: mmap() failed", __func__);
+        return -1;
+    }
+
+    if ((ur->ur_buf_base = malloc((URING_BUF_COUNT + 1) * URING_BUF_SIZE)) == NULL) {
+        plog_error(LOG_ERR, "%s: malloc() failed", __func__);
+        goto error;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (unsigned long) ur->ur_bufs;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+
+    if (syscall(__NR_io_uring_register, ur->ur_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        plog_error(LOG_DEBUG, "%s: io_uring_register() failed", __func__);
+        free(ur->ur_buf_base);
+        goto error;
+    }
+
+    for (i = 0; i < URING_BUF_COUNT; i++)
+        uring_recycle(ur, i);
+
+    ur->ur_buf_spare = ur->ur_buf_base + URING_BUF_COUNT * URING_BUF_SIZE;
+
+    return 0;
+
+error:
+    munmap(ur->ur_bufs, ring_len);
+    ur->ur_bufs = NULL;
+    ur->ur_buf_base = NULL;
+    return -1;
+}
+
+static int
+uring_enter(uring_t *ur, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    int r;
+
+    r = syscall(__NR_io_uring_enter, ur->ur_fd, ur->ur_to_submit, min_complete, flags, arg, argsz);
+
+    /* submission is done before waiting, so a positive count means all were taken */
+    if (r >= 0)
+        ur->ur_to_submit = 0;
+
+    return r;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(uring_t *ur)
+{
+    unsigned head, tail, index;
+    struct io_uring_sqe *sqe;
+
+    tail = *ur->ur_sq_tail;
+    head = __atomic_load_n(ur->ur_sq_head, __ATOMIC_ACQUIRE);
+
+    if (tail - head >= ur->ur_sq_entries) {
+        /* submission queue is full; flush it without waiting */
+        if (uring_enter(ur, 0, 0, NULL, 0) < 0) {
+            plog_error(LOG_ERR, "%s: io_uring_enter() failed", __func__);
+            return NULL;
+        }
+    }
+
+    index = tail & *ur->ur_sq_mask;
+    sqe = &ur->ur_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    ur->ur_sq_array[index] = index;
+    __atomic_store_n(ur->ur_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ur->ur_to_submit++;
+
+    return sqe;
+}
+
+static unsigned
+uring_next_gen(uring_t *ur)
+{
+    /* generation 0 is reserved for internal requests */
+    if ((ur->ur_gen = (ur->ur_gen + 1) & URING_GEN_MASK) == 0)
+        ur->ur_gen = 1;
+
+    return ur->ur_gen;
+}
+
+static int
+uring_arm(uring_t *ur, int fd, unsigned gen, unsigned events)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_get_sqe(ur)) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_DATA(fd, gen, URING_OP_POLL);
+
+    return 0;
+}
+
+static int
+uring_arm_input(uring_t *ur, int fd)
+{
+    struct io_uring_sqe *sqe;
+    uring_entry_t *ue = &ur->ur_table[fd];
+
+    if ((sqe = uring_get_sqe(ur)) == NULL)
+        return -1;
+
+    if (ue->ue_op == URING_OP_ACCEPT) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUF_GROUP;
+    }
+
+    sqe->fd = fd;
+    sqe->user_data = URING_DATA(fd, ue->ue_gen, ue->ue_op);
+    ue->ue_input++;
+
+    return 0;
+}
+
+/* a new poll request, or none for no events */
+static int
+uring_poll(uring_t *ur, int fd, unsigned events)
+{
+    uring_entry_t *ue = &ur->ur_table[fd];
+
+    ue->ue_poll_gen = uring_next_gen(ur);
+    ue->ue_events = events;
+
+    if (events == 0)
+        return 0;
+
+    return uring_arm(ur, fd, ue->ue_poll_gen, events);
+}
+
+static int
+uring_remove(uring_t *ur, int fd)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_get_sqe(ur)) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = URING_DATA(fd, ur->ur_table[fd].ue_poll_gen, URING_OP_POLL);
+    sqe->user_data = URING_DATA(fd, 0, 0);
+
+    return 0;
+}
+
+/* its final completion, -ECANCELED or not, is what ends it */
+static int
+uring_cancel_input(uring_t *ur, int fd)
+{
+    struct io_uring_sqe *sqe;
+    uring_entry_t *ue = &ur->ur_table[fd];
+
+    if ((sqe = uring_get_sqe(ur)) == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = URING_DATA(fd, ue->ue_gen, ue->ue_op);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = URING_DATA(fd, 0, 0);
+
+    return 0;
+}
+
+static int
+uring_table_extend(uring_t *ur, int fd)
+{
+    int size;
+    uring_entry_t *newp;
+
+    for (size = (ur->ur_table_size == 0) ? 64 : ur->ur_table_size; size <= fd; size *= 2)
+        ;
+
+    if ((newp = realloc(ur->ur_table, sizeof(uring_entry_t) * size)) == NULL) {
+        plog_error(LOG_ERR, "%s: realloc() failed", __func__);
+        return -1;
+    }
+
+    memset(&newp[ur->ur_table_size], 0, sizeof(uring_entry_t) * (size - ur->ur_table_size));
+    ur->ur_table = newp;
+    ur->ur_table_size = size;
+
+    return 0;
+}
+
+static int
+uring_reap(sf_instance_t *inst, uring_t *ur, uring_event_t *events, int max)
+{
+    int count = 0;
+    unsigned head, tail;
+    struct io_uring_cqe *cqe;
+    uring_event_t *ev;
+
+    head = *ur->ur_cq_head;
+    tail = __atomic_load_n(ur->ur_cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail && count < max; head++) {
+        cqe = &ur->ur_cqes[head & *ur->ur_cq_mask];
+
+        if (URING_DATA_GEN(cqe->user_data) == 0)
+            continue;   /* completion of removal or cancel */
+
+        /* accept and recv completions are all kept: they may hold an fd or a buffer */
+        if (URING_DATA_OP(cqe->user_data) == URING_OP_POLL && cqe->res == -ECANCELED)
+            continue;
+
+        ev = &events[count++];
+        ev->uv_fd = URING_DATA_FD(cqe->user_data);
+        ev->uv_gen = URING_DATA_GEN(cqe->user_data);
+        ev->uv_op = URING_DATA_OP(cqe->user_data);
+        ev->uv_res = cqe->res;
+        ev->uv_flags = cqe->flags;
+        ev->uv_events = (cqe->res < 0) ? POLLERR : cqe->res;
+
+        if (ev->uv_op != URING_OP_POLL)
+            continue;
+
+        /* the kernel may terminate a multishot request, e.g. on overflow */
+        if ((cqe->flags & IORING_CQE_F_MORE) == 0 && uring_lookup(inst, ur, ev) != NULL)
+            uring_arm(ur, ev->uv_fd, ev->uv_gen, ur->ur_table[ev->uv_fd].ue_events);
+    }
+
+    __atomic_store_n(ur->ur_cq_head, head, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+/* completion of an accept or recv request */
+static void
+uring_input(sf_instance_t *inst, uring_t *ur, uring_event_t *ev)
+{
+    void *sock;
+    char *buf = NULL;
+    unsigned bid = 0;
+    uring_entry_t *ue;
+
+    if (ev->uv_flags & IORING_CQE_F_BUFFER) {
+        bid = ev->uv_flags >> IORING_CQE_BUFFER_SHIFT;
+        buf = ur->ur_buf_base + bid * URING_BUF_SIZE;
+    }
+
+    if ((sock = uring_lookup(inst, ur, ev)) == NULL) {
+        if (ev->uv_op == URING_OP_ACCEPT && ev->uv_res >= 0)
+            close(ev->uv_res);
+        goto done;
+    }
+
+    ue = &ur->ur_table[ev->uv_fd];
+    if ((ev->uv_flags & IORING_CQE_F_MORE) == 0)
+        ue->ue_input--;
+
+    switch (ev->uv_res) {
+    case -ENOBUFS:
+        /*
+         * the ring ran dry.  busy connections take buffers as soon as
+         * they are back, so one read here keeps the others from starving
+         */
+        if (!ue->ue_paused)
+            uring_read(inst, ur, ev->uv_fd, sock);
+        break;
+    case -ECANCELED:
+        break;
+    case -EINVAL:
+        /* multishot accept and recv are not supported; back to polling */
+        plog(LOG_INFO, "%s: falling back to poll requests", __func__);
+        ur->ur_multishot = 0;
+        ue->ue_op = URING_OP_POLL;
+        ((sf_socket_base_t *) sock)->sb_flags &= ~SB_RECEIVED;
+        if (ue->ue_events != 0)
+            uring_remove(ur, ev->uv_fd);
+        uring_poll(ur, ev->uv_fd, ue->ue_paused ? POLLOUT : (POLLIN | POLLOUT));
+        goto done;
+    default:
+        if (ev->uv_op == URING_OP_ACCEPT) {
+            if (ev->uv_res >= 0)
+                sf_socket_accepted(inst, sock, ev->uv_res);
+            else {
+                errno = -ev->uv_res;
+                plog_error(LOG_ERR, "%s: accept() failed", __func__);
+            }
+        } else {
+            if (ev->uv_res < 0)
+                plog(LOG_DEBUG, "%s: recv() failed: %s", __func__, strerror(-ev->uv_res));
+            sf_socket_received(inst, sock, buf, ev->uv_res);
+        }
+    }
+
+    /* a request the kernel terminated is armed again unless the socket went away */
+    if (uring_lookup(inst, ur, ev) != NULL) {
+        ue = &ur->ur_table[ev->uv_fd];   /* accepting may have extended the table */
+        if (ue->ue_input == 0 && !ue->ue_paused)
+            uring_arm_input(ur, ev->uv_fd);
+    }
+
+done:
+    if (buf != NULL)
+        uring_recycle(ur, bid);
+}
+
+/* the recv request has terminated, so nothing can be read ahead of this */
+static void
+uring_read(sf_instance_t *inst, uring_t *ur, int fd, void *sock)
+{
+    int len;
+
+    if ((len = recv(fd, ur->ur_buf_spare, URING_BUF_SIZE, 0)) < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+
+        plog(LOG_DEBUG, "%s: recv() failed: %s", __func__, strerror(errno));
+        len = -errno;
+    }
+
+    sf_socket_received(inst, sock, ur->ur_buf_spare, len);
+}
+
+static void
+uring_recycle(uring_t *ur, unsigned bid)
+{
+    unsigned short tail;
+    struct io_uring_buf *buf;
+
+    tail = ur->ur_bufs->tail;
+    buf = &ur->ur_bufs->bufs[tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (uint64_t) (unsigned long) (ur->ur_buf_base + bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+
+    __atomic_store_n(&ur->ur_bufs->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *
+uring_lookup(sf_instance_t *inst, uring_t *ur, uring_event_t *ev)
+{
+    uring_entry_t *ue;
+
+    if (ev->uv_fd >= ur->ur_table_size)
+        return NULL;
+
+    ue = &ur->ur_table[ev->uv_fd];
+    if (ev->uv_gen != ((ev->uv_op == URING_OP_POLL) ? ue->ue_poll_gen : ue->ue_gen))
+        return NULL;
+
+    return sf_socket_lookup(inst, ev->uv_fd);
+}
+
+#endif  /* HAVE_LINUX_IO_URING_H */
@@ -33,19 +33,32 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
 #include "libsf/sf.h"
+#include "mqcore/mqcore.h"
 #include "stomp/stomp_proto.h"
+#include "stomp/stomp_subr.h"
 
 #define PROG_NAME  "leanmqd"
 
 static void parse_args(int argc, char *argv[]);
 static void usage(void);
 static int init(void);
+static int init_instance(sf_instance_t *inst, struct sockaddr *addr);
+static int start_workers(void);
+static void *worker_main(void *param);
 static void init_signal(void);
 static void signal_handler(int signum);
+static void report_timer(void *param1, void *param2);
+static int loop_hook(sf_instance_t *inst, void *param);
 
 static int Debug;
-static sf_instance_t SFInstance;
+static int Workers = 1;
+static sf_instance_t *SFInstances;
+static sf_timer_t ReportTimer;
+static char *PersistDir;
+static int CommitThread;
+static volatile sig_atomic_t ReportRequested;
 
 int
 main(int argc, char *argv[])
@@ -63,8 +76,10 @@ main(int argc, char *argv[])
 
     if (init() < 0)
         return EXIT_FAILURE;
+    if (start_workers() < 0)
+        return EXIT_FAILURE;
 
-    sf_main(&SFInstance);
+    sf_main(&SFInstances[0]);
 
     return EXIT_SUCCESS;
 }
@@ -77,13 +92,87 @@ parse_args(int argc, char *argv[])
     for (i = 1; i < argc; i++) {
         if (*argv[i] == '-') {
             switch (*++argv[i]) {
+            case 'a':
+                if (i + 1 >= argc || atoi(argv[i + 1]) <= 0)
+                    usage();
+                sf_set_accept_budget(atoi(argv[++i]));
+                break;
+            case 'b':
+                if (i + 1 >= argc || atoi(argv[i + 1]) <= 0)
+                    usage();
+                binding_set_backlog_size((size_t) atoi(argv[++i]) * 1024);
+                break;
             case 'd':
                 plog_setmask(LOG_DEBUG);
                 Debug = 1;
                 break;
+            case 'e':
+                if (i + 1 >= argc)
+                    usage();
+                if (sf_set_poll_method(argv[++i]) < 0)
+                    usage();
+                break;
+            case 'E':
+                if (i + 1 >= argc || atoi(argv[i + 1]) <= 0)
+                    usage();
+                sf_set_poll_events(atoi(argv[++i]));
+                break;
             case 'h':
                 usage();
                 break;
+            case 'H':
+                sf_pool_set_hugepage(1);
+                break;
+            case 'l':
+                if (i + 1 >= argc || atoi(argv[i + 1]) <= 0)
+                    usage();
+                sf_set_listen_backlog(atoi(argv[++i]));
+                break;
+            case 'm':
+                if (i + 1 >= argc || atoi(argv[i + 1]) < 0)
+                    usage();
+                msgqueue_set_budget((size_t) atoi(argv[++i]) * 1024 * 1024);
+                break;
+            case 'n':
+                if (i + 1 >= argc || atoi(argv[i + 1]) < 0)
+                    usage();
+                sf_set_max_connections(atoi(argv[++i]));
+                break;
+            case 'p':
+                if (i + 1 >= argc)
+                    usage();
+                PersistDir = argv[++i];
+                break;
+            case 's':
+                if (i + 1 >= argc || atoi(argv[i + 1]) < 0)
+                    usage();
+                msgcommit_set_window(atoi(argv[++i]));
+                break;
+            case 'S':
+                CommitThread = 1;
+                break;
+            case 'P':
+                if (i + 1 >= argc || binding_set_default_policy(argv[++i]) < 0)
+                    usage();
+                break;
+            case 'q':
+                if (i + 1 >= argc || atoi(argv[i + 1]) <= 0)
+                    usage();
+                stomp_set_queue_size((size_t) atoi(argv[++i]) * 1024);
+                break;
+            case 'r':
+                if (i + 1 >= argc || atoi(argv[i + 1]) <= 0)
+                    usage();
+                sf_set_read_budget(atoi(argv[++i]));
+                break;
+            case 'w':
+                if (i + 1 >= argc)
+                    usage();
+                if ((Workers = atoi(argv[++i])) <= 0)
+                    Workers = sysconf(_SC_NPROCESSORS_ONLN);
+                if (Workers <= 0)
+                    Workers = 1;
+                break;
 
             default:
                 plog(LOG_ERR, "error: invalid option: %s", argv[i]);
@@ -98,14 +187,30 @@ static void
 usage(void)
 {
     printf("usage: %s [options..]\n", PROG_NAME);
-    puts("options:  -c [filename]   configuration file name");
+    puts("options:  -a [accepts]    connections accepted at a time before others get a turn (default: 64)");
+    puts("          -b [kilobytes]  backlog per queue for messages no subscriber can take (default: 65536)");
+    puts("          -c [filename]   configuration file name");
     puts("          -d              debug");
+    puts("          -e [method]     event notification method (epoll, kqueue, io_uring)");
+    puts("          -E [events]     events fetched per wait (default: 256)");
+    puts("          -H              use huge pages for object pools");
+    puts("          -l [count]      listen backlog (default: 4096)");
+    puts("          -m [megabytes]  memory budget for all queued messages (0: unlimited)");
+    puts("          -n [count]      connections per worker (0: an equal share of RLIMIT_NOFILE)");
+    puts("          -p [directory]  keep /queue/ messages on disk in this directory");
+    puts("          -P [policy]     queue dispatch: round-robin, least-outstanding, weighted, hash");
+    puts("          -q [kilobytes]  queue size limit per subscriber (default: 8192)");
+    puts("          -r [reads]      reads from one connection before others get a turn (default: 16)");
+    puts("          -s [usec]       wait this long to group writes into one disk sync (default: 0)");
+    puts("          -S              sync the disk on a helper thread");
+    puts("          -w [workers]    number of worker threads (0: one per CPU)");
     exit(EXIT_FAILURE);
 }
 
 static int
 init(void)
 {
+    int i;
     sf_sockaddr_t addr;
 
     if (sf_util_str2sa((struct sockaddr *) &addr, "0.0.0.0", STOMP_PORT) < 0) {
@@ -113,21 +218,87 @@ init(void)
         return -1;
     }
 
-    if (sf_init(&SFInstance) < 0) {
+    if ((SFInstances = calloc(Workers, sizeof(sf_instance_t))) == NULL) {
+        plog(LOG_ERR, "calloc() failed");
+        return -1;
+    }
+
+    sf_set_instances(Workers);
+    stomp_init();
+
+    if (PersistDir != NULL) {
+        if (msglog_init(PersistDir) < 0 || binding_recover() < 0) {
+            plog(LOG_ERR, "can't recover queues from %s", PersistDir);
+            return -1;
+        }
+
+        if (CommitThread && msgcommit_start_thread() < 0) {
+            plog(LOG_ERR, "msgcommit_start_thread() failed");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < Workers; i++) {
+        if (init_instance(&SFInstances[i], (struct sockaddr *) &addr) < 0)
+            return -1;
+    }
+
+    init_signal();
+    report_timer(NULL, NULL);
+
+    return 0;
+}
+
+static int
+init_instance(sf_instance_t *inst, struct sockaddr *addr)
+{
+    if (sf_init(inst) < 0) {
         plog(LOG_ERR, "sf_init() failed");
         return -1;
     }
 
-    if (sf_tcp_listen(&SFInstance, (struct sockaddr *) &addr, &StompProtoCB) < 0) {
+    /* each worker has its own listener; the kernel spreads connections over them */
+    if (Workers > 1)
+        sf_set_reuseport(inst, 1);
+
+    sf_set_loop_hook(inst, loop_hook, NULL);
+
+    if (sf_tcp_listen(inst, addr, &StompProtoCB) < 0) {
         plog(LOG_ERR, "sf_tcp_listen() failed");
         return -1;
     }
 
-    init_signal();
+    return 0;
+}
+
+static int
+start_workers(void)
+{
+    int i;
+    pthread_t tid;
+
+    for (i = 1; i < Workers; i++) {
+        if (pthread_create(&tid, NULL, worker_main, &SFInstances[i]) != 0) {
+            plog(LOG_ERR, "pthread_create() failed");
+            return -1;
+        }
+
+        pthread_detach(tid);
+    }
+
+    plog(LOG_INFO, "started %d worker(s)", Workers);
 
     return 0;
 }
 
+static void *
+worker_main(void *param)
+{
+    sf_main((sf_instance_t *) param);
+
+    return NULL;
+}
+
 static void
 init_signal(void)
 {
@@ -140,8 +311,34 @@ signal_handler(int signum)
 {
     switch (signum) {
     case SIGHUP:
+        ReportRequested = 1;
         break;
     case SIGTERM:
         break;
     }
 }
+
+/* logging is not async-signal-safe, so SIGHUP is handled from the event loop */
+static void
+report_timer(void *param1, void *param2)
+{
+    if (ReportRequested) {
+        ReportRequested = 0;
+        sf_pool_report();
+        msgcommit_report();
+    }
+
+    sf_timer_request(&SFInstances[0], &ReportTimer, 1000, report_timer, NULL, NULL);
+}
+
+/* durable writes of this iteration are flushed together, then their receipts go out */
+static int
+loop_hook(sf_instance_t *inst, void *param)
+{
+    int usec;
+
+    usec = msgcommit_poll();
+    stomp_release_receipts();
+
+    return usec;
+}
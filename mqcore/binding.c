@@ -32,15 +32,135 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "libsf/sf.h"
 #include "binding.h"
 #include "binding_hash.h"
+#include "binding_trie.h"
+#include "msgcommit.h"
 
 static binding_t *binding_create(int size, char *name, msgsink_push_msg_t *push_msg);
 static int binding_subscribe_register(binding_t *bi, msgsink_t *sink);
 static int binding_extend(binding_t *bi);
-static int binding_topic_push_msg(binding_topic_t *self, struct iovec *iov, int iovcnt);
-static int binding_queue_push_msg(binding_queue_t *self, struct iovec *iov, int iovcnt);
+static void binding_free(binding_t *bi);
+static int binding_topic_push_msg(binding_topic_t *self, message_t *msg);
+static int binding_queue_push_msg(binding_queue_t *self, message_t *msg);
+static int binding_queue_deliver(binding_queue_t *self, message_t *msg);
+static int binding_queue_hold(binding_queue_t *self, message_t *msg);
+static int binding_queue_pend(binding_queue_t *self, binding_member_t *bm, message_t *msg);
+static void binding_queue_drain(binding_queue_t *self);
+static void binding_queue_handover(binding_queue_t *self, msgqueue_t *pending);
+static void binding_queue_dispatch(binding_queue_t *self);
+static int binding_policy_lookup(char *name);
+static int binding_select_round_robin(binding_queue_t *self, message_t *msg, int *strict);
+static int binding_select_least(binding_queue_t *self, message_t *msg, int *strict);
+static int binding_select_weighted(binding_queue_t *self, message_t *msg, int *strict);
+static int binding_select_hash(binding_queue_t *self, message_t *msg, int *strict);
+static uint64_t binding_mix64(uint64_t x);
+static void binding_recover_queue(char *name, void *param);
+
+static pthread_rwlock_t BindingLock = PTHREAD_RWLOCK_INITIALIZER;
+
+typedef union {
+    binding_topic_t  bo_topic;
+    binding_queue_t  bo_queue;
+} binding_object_t;
+
+typedef binding_member_t binding_members_t[BINDING_MEMBERS_MAX];
+
+static sf_pool_t BindingPool = SF_POOL_INITIALIZER("binding", binding_object_t);
+static sf_pool_t BindingMembersPool = SF_POOL_INITIALIZER("binding members", binding_members_t);
+
+static size_t BindingBacklogSize = 1024 * 1024 * 64;
+
+static struct {
+    char              *bp_name;
+    binding_select_t  *bp_select;
+} BindingPolicies[] = {
+    { "round-robin",        binding_select_round_robin },   /* BINDING_POLICY_ROUND_ROBIN */
+    { "least-outstanding",  binding_select_least       },   /* BINDING_POLICY_LEAST */
+    { "weighted",           binding_select_weighted    },   /* BINDING_POLICY_WEIGHTED */
+    { "hash",               binding_select_hash        },   /* BINDING_POLICY_HASH */
+};
+
+static int BindingDefaultPolicy = BINDING_POLICY_ROUND_ROBIN;
+static binding_group_t *BindingGroupFunc;
+
+void
+binding_set_backlog_size(size_t size)
+{
+    BindingBacklogSize = size;
+}
+
+/* policy of queues created from now on */
+int
+binding_set_default_policy(char *name)
+{
+    int policy;
+
+    if ((policy = binding_policy_lookup(name)) < 0)
+        return -1;
+
+    BindingDefaultPolicy = policy;
+
+    return 0;
+}
+
+/* the protocol layer knows where a message keeps its group key; 0 means none */
+void
+binding_set_group_func(binding_group_t *func)
+{
+    BindingGroupFunc = func;
+}
+
+int
+binding_queue_set_policy(binding_t *bi, char *name)
+{
+    int policy;
+
+    if ((bi->bi_flags & BINDING_F_QUEUE) == 0 || (policy = binding_policy_lookup(name)) < 0)
+        return -1;
+
+    ((binding_queue_t *) bi)->biq_select = BindingPolicies[policy].bp_select;
+
+    return 0;
+}
+
+/*
+ * bindings are shared by all worker threads.  the exclusive lock is
+ * taken to create, destroy, subscribe or unsubscribe; the shared lock
+ * is held across lookup and use, so a binding found under it stays.
+ */
+void
+binding_lock(void)
+{
+    pthread_rwlock_wrlock(&BindingLock);
+}
+
+void
+binding_lock_shared(void)
+{
+    pthread_rwlock_rdlock(&BindingLock);
+}
+
+void
+binding_unlock(void)
+{
+    pthread_rwlock_unlock(&BindingLock);
+}
+
+/* one binding's queue state and its subscribers' delivery state; taken under the table lock */
+void
+binding_enter(binding_t *bi)
+{
+    pthread_mutex_lock(&bi->bi_lock);
+}
+
+void
+binding_leave(binding_t *bi)
+{
+    pthread_mutex_unlock(&bi->bi_lock);
+}
 
 binding_t *
 binding_topic_create(char *name, msgsink_t *sink)
@@ -53,9 +173,21 @@ binding_topic_create(char *name, msgsink_t *sink)
         return NULL;
     }
 
+    if (binding_trie_is_pattern(name)) {
+        if (binding_trie_register(&BindingTrie, bi) < 0) {
+            plog(LOG_ERR, "%s: binding_trie_register() failed", __func__);
+            binding_free(bi);
+            return NULL;
+        }
+
+        bi->bi_flags |= BINDING_F_PATTERN;
+    }
+
     if (binding_subscribe_register(bi, sink) < 0) {
         plog(LOG_ERR, "%s: binding_subscribe_register() failed", __func__);
-        free(bi);
+        if (bi->bi_flags & BINDING_F_PATTERN)
+            binding_trie_unregister(&BindingTrie, bi);
+        binding_free(bi);
         return NULL;
     }
 
@@ -75,9 +207,30 @@ binding_queue_create(char *name, msgsink_t *sink)
         return NULL;
     }
 
-    if (binding_subscribe_register(bi, sink) < 0) {
+    bi->bi_flags |= BINDING_F_QUEUE;
+    ((binding_queue_t *) bi)->biq_select = BindingPolicies[BindingDefaultPolicy].bp_select;
+
+    /* with persistence enabled every queue is durable */
+    if (msglog_enabled()) {
+        if ((((binding_queue_t *) bi)->biq_log = msglog_open(name)) == NULL) {
+            plog(LOG_ERR, "%s: msglog_open() failed", __func__);
+            binding_free(bi);
+            return NULL;
+        }
+
+        bi->bi_flags |= BINDING_F_DURABLE;
+    }
+
+    /* durable queues are also created on the first SEND, with no subscriber */
+    if (sink == NULL) {
+        if (binding_hash_register(&BindingHash, bi) < 0) {
+            plog(LOG_ERR, "%s: binding_hash_register() failed", __func__);
+            binding_free(bi);
+            return NULL;
+        }
+    } else if (binding_subscribe_register(bi, sink) < 0) {
         plog(LOG_ERR, "%s: binding_subscribe_register() failed", __func__);
-        free(bi);
+        binding_free(bi);
         return NULL;
     }
 
@@ -90,8 +243,11 @@ void
 binding_destroy(binding_t *bi)
 {
     binding_hash_unregister(&BindingHash, bi->bi_name);
-    free(bi->bi_members);
-    free(bi);
+
+    if (bi->bi_flags & BINDING_F_PATTERN)
+        binding_trie_unregister(&BindingTrie, bi);
+
+    binding_free(bi);
 
     plog(LOG_DEBUG, "%s: destroy binding %p", __func__, bi);
 }
@@ -99,8 +255,6 @@ binding_destroy(binding_t *bi)
 int
 binding_subscribe(binding_t *bi, msgsink_t *sink)
 {
-    int i;
-
     if (bi->bi_members_count == bi->bi_members_max) {
         plog(LOG_DEBUG, "%s: binding %p is full", __func__, bi);
 
@@ -110,61 +264,116 @@ binding_subscribe(binding_t *bi, msgsink_t *sink)
         }
     }
 
-    for (i = 0; i < bi->bi_members_max; i++) {
-        if (bi->bi_members[i] == NULL) {
-            plog(LOG_DEBUG, "%s: subscribe binding %p, msgsink %p", __func__, bi, sink);
-            bi->bi_members[i] = sink;
-            bi->bi_members_count++;
-            return 0;
-        }
-    }
+    plog(LOG_DEBUG, "%s: subscribe binding %p, msgsink %p", __func__, bi, sink);
 
-    plog(LOG_ERR, "%s: subscribing binding %p failed", __func__, bi);
+    bi->bi_members[bi->bi_members_count].bm_sink = sink;
+    bi->bi_members[bi->bi_members_count].bm_current = 0;
+    bi->bi_members[bi->bi_members_count].bm_pending = NULL;
+    bi->bi_members_count++;
 
-    return -1;
+    return 0;
 }
 
 int
 binding_unsubscribe(binding_t *bi, msgsink_t *sink)
 {
     int i;
+    msgqueue_t *pending;
 
     plog(LOG_DEBUG, "%s: unsubscribe binding %p, msgsink %p", __func__, bi, sink);
 
-    for (i = 0; i < bi->bi_members_max; i++) {
-        if (bi->bi_members[i] == sink) {
-            bi->bi_members[i] = NULL;
-            bi->bi_members_count--;
+    for (i = 0; i < bi->bi_members_count; i++) {
+        if (bi->bi_members[i].bm_sink != sink)
+            continue;
 
-            if (bi->bi_members_count == 0)
-                binding_destroy(bi);
-        }
+        pending = bi->bi_members[i].bm_pending;
+
+        /* the last member fills the hole */
+        bi->bi_members[i] = bi->bi_members[--bi->bi_members_count];
+
+        if (bi->bi_members_count == 0 && (bi->bi_flags & BINDING_F_DURABLE) == 0) {
+            if (pending != NULL)
+                msgqueue_destroy(pending);
+            binding_destroy(bi);
+        } else if (pending != NULL)
+            binding_queue_handover((binding_queue_t *) bi, pending);
+
+        break;
     }
 
     return 0;
 }
 
 int
-binding_push_msg(binding_t *self, struct iovec *iov, int iovcnt)
+binding_push_msg(binding_t *self, message_t *msg)
 {
+    int r;
+
     plog(LOG_DEBUG, "%s: push message", __func__);
 
-    return self->bi_msgsink.ms_push_msg(self, iov, iovcnt);
+    binding_enter(self);
+    r = self->bi_msgsink.ms_push_msg(self, msg);
+    binding_leave(self);
+
+    return r;
+}
+
+/* store a frame in a durable queue and hand out what the subscribers can take */
+int
+binding_append(binding_t *bi, struct iovec *iov, int iovcnt, uint64_t *batch)
+{
+    binding_queue_t *biq = (binding_queue_t *) bi;
+
+    if (msglog_append(biq->biq_log, iov, iovcnt) < 0) {
+        plog(LOG_ERR, "%s: msglog_append() failed", __func__);
+        return -1;
+    }
+
+    *batch = msgcommit_request(1);
+
+    binding_enter(bi);
+    binding_queue_dispatch(biq);
+    binding_leave(bi);
+
+    return 0;
+}
+
+/* a subscriber has room or credit again */
+void
+binding_resume(binding_t *bi)
+{
+    if ((bi->bi_flags & BINDING_F_QUEUE) == 0)
+        return;
+
+    binding_enter(bi);
+    binding_queue_dispatch((binding_queue_t *) bi);
+    binding_leave(bi);
+}
+
+/* recreate durable queues left by the previous run */
+int
+binding_recover(void)
+{
+    if (!msglog_enabled())
+        return 0;
+
+    return msglog_scan(binding_recover_queue, NULL);
 }
 
 static binding_t *
 binding_create(int size, char *name, msgsink_push_msg_t *push_msg)
 {
     binding_t *bi;
+    pthread_mutexattr_t attr;
 
-    if ((bi = calloc(1, size)) == NULL) {
-        plog(LOG_ERR, "%s: calloc() failed", __func__);
+    if (size > sizeof(binding_object_t) || (bi = sf_pool_alloc(&BindingPool)) == NULL) {
+        plog(LOG_ERR, "%s: sf_pool_alloc() failed", __func__);
         return NULL;
     }
 
-    if ((bi->bi_members = calloc(1, sizeof(msgsink_t *) * BINDING_MEMBERS_MAX)) == NULL) {
-        plog(LOG_ERR, "%s: calloc() failed", __func__);
-        free(bi);
+    if ((bi->bi_members = sf_pool_alloc(&BindingMembersPool)) == NULL) {
+        plog(LOG_ERR, "%s: sf_pool_alloc() failed", __func__);
+        sf_pool_free(&BindingPool, bi);
         return NULL;
     }
 
@@ -172,19 +381,29 @@ binding_create(int size, char *name, msgsink_push_msg_t *push_msg)
     strncpy(bi->bi_name, name, sizeof(bi->bi_name));
     bi->bi_members_max = BINDING_MEMBERS_MAX;
 
+    /* a redelivery or a flush may come back to the binding being pushed */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&bi->bi_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
     return bi;
 }
 
 static int
 binding_subscribe_register(binding_t *bi, msgsink_t *sink)
 {
+    if (binding_hash_register(&BindingHash, bi) < 0) {
+        plog(LOG_ERR, "%s: binding_hash_register() failed", __func__);
+        return -1;
+    }
+
     if (binding_subscribe(bi, sink) < 0) {
         plog(LOG_ERR, "%s: binding_subscribe() failed", __func__);
+        binding_hash_unregister(&BindingHash, bi->bi_name);
         return -1;
     }
 
-    binding_hash_register(&BindingHash, bi);
-
     return 0;
 }
 
@@ -192,37 +411,62 @@ static int
 binding_extend(binding_t *bi)
 {
     int mmax;
-    msgsink_t **newp;
+    binding_member_t *newp;
 
     mmax = bi->bi_members_max;
     mmax += mmax / 2;
 
     plog(LOG_DEBUG, "%s: extend binding members: %d -> %d", __func__, bi->bi_members_max, mmax);
 
-    if ((newp = realloc(bi->bi_members, sizeof(msgsink_t *) * mmax)) == NULL) {
+    /* the initial array comes from the pool; larger ones are malloc'ed */
+    if (bi->bi_members_max == BINDING_MEMBERS_MAX) {
+        if ((newp = malloc(sizeof(*newp) * mmax)) != NULL) {
+            memcpy(newp, bi->bi_members, sizeof(*newp) * bi->bi_members_max);
+            sf_pool_free(&BindingMembersPool, bi->bi_members);
+        }
+    } else
+        newp = realloc(bi->bi_members, sizeof(*newp) * mmax);
+
+    if (newp == NULL) {
         plog_error(LOG_ERR, __func__, "binding_subscribe() failed");
         return -1;
     }
 
     plog(LOG_DEBUG, "%s: old members = %p, new = %p", __func__, bi->bi_members, newp);
 
-    memset(&newp[bi->bi_members_max], 0, mmax - bi->bi_members_max);
+    memset(&newp[bi->bi_members_max], 0, sizeof(*newp) * (mmax - bi->bi_members_max));
     bi->bi_members_max = mmax;
     bi->bi_members = newp;
 
     return 0;
 }
 
+static void
+binding_free(binding_t *bi)
+{
+    if (bi->bi_flags & BINDING_F_DURABLE)
+        msglog_close(((binding_queue_t *) bi)->biq_log);
+    if ((bi->bi_flags & BINDING_F_QUEUE) && ((binding_queue_t *) bi)->biq_backlog != NULL)
+        msgqueue_destroy(((binding_queue_t *) bi)->biq_backlog);
+
+    if (bi->bi_members_max == BINDING_MEMBERS_MAX)
+        sf_pool_free(&BindingMembersPool, bi->bi_members);
+    else
+        free(bi->bi_members);
+
+    pthread_mutex_destroy(&bi->bi_lock);
+    sf_pool_free(&BindingPool, bi);
+}
+
 static int
-binding_topic_push_msg(binding_topic_t *self, struct iovec *iov, int iovcnt)
+binding_topic_push_msg(binding_topic_t *self, message_t *msg)
 {
     int i, errors = 0;
     msgsink_t *sink;
 
-    for (i = 0; i < self->bit_binding.bi_members_max; i++) {
-        if ((sink = self->bit_binding.bi_members[i]) == NULL)
-            continue;
-        if (sink->ms_push_msg(sink, iov, iovcnt) < 0)
+    for (i = 0; i < self->bit_binding.bi_members_count; i++) {
+        sink = self->bit_binding.bi_members[i].bm_sink;
+        if (sink->ms_push_msg(sink, msg) < 0)
             errors++;
     }
 
@@ -230,21 +474,313 @@ binding_topic_push_msg(binding_topic_t *self, struct iovec *iov, int iovcnt)
 }
 
 static int
-binding_queue_push_msg(binding_queue_t *self, struct iovec *iov, int iovcnt)
+binding_queue_push_msg(binding_queue_t *self, message_t *msg)
+{
+    /* nothing overtakes the backlog; it is handed out as credit comes back */
+    if (self->biq_backlog != NULL && msgqueue_head(self->biq_backlog) != NULL)
+        return binding_queue_hold(self, msg);
+
+    if (binding_queue_deliver(self, msg) == 0)
+        return 0;
+
+    return binding_queue_hold(self, msg);
+}
+
+/* the policy picks a member; those without credit or room pass it on */
+static int
+binding_queue_deliver(binding_queue_t *self, message_t *msg)
 {
-    int i, index, members;
+    int i, first, members, r = -1, strict = 0;
     msgsink_t *sink;
+    msgqueue_t *congested;
+    binding_member_t *bm;
 
-    members = self->biq_binding.bi_members_max;
-    for (i = 0; i < members; i++) {
-        index = self->biq_round;
-        self->biq_round = (self->biq_round + 1) % members;
+    if ((members = self->biq_binding.bi_members_count) == 0)
+        return -1;
 
-        if ((sink = self->biq_binding.bi_members[index]) == NULL)
+    /* a full member is refilled from the log or the backlog; it doesn't hold back producers */
+    congested = msgqueue_congested();
+
+    first = self->biq_select(self, msg, &strict);
+
+    if (strict) {
+        /* a message group waits for its own member, to stay in order, but nobody else does */
+        bm = &self->biq_binding.bi_members[first];
+
+        if ((bm->bm_pending == NULL || msgqueue_head(bm->bm_pending) == NULL) &&
+            bm->bm_sink->ms_push_msg(bm->bm_sink, msg) == 0)
+            r = 0;
+        else
+            r = binding_queue_pend(self, bm, msg);
+    } else {
+        for (i = 0; i < members; i++) {
+            sink = self->biq_binding.bi_members[(first + i) % members].bm_sink;
+            if (sink->ms_push_msg(sink, msg) == 0) {
+                r = 0;
+                break;
+            }
+        }
+    }
+
+    msgqueue_set_congested(congested);
+
+    return r;
+}
+
+static int
+binding_queue_hold(binding_queue_t *self, message_t *msg)
+{
+    msgsink_t *sink;
+
+    if (self->biq_backlog == NULL) {
+        if ((self->biq_backlog = msgqueue_create(BindingBacklogSize, NULL, NULL)) == NULL) {
+            plog(LOG_ERR, "%s: msgqueue_create() failed", __func__);
+            return -1;
+        }
+    }
+
+    sink = MSGQUEUE_SINK(self->biq_backlog);
+
+    return sink->ms_push_msg(sink, msg);
+}
+
+/* a member without room keeps the messages of its groups here, in order, up to the backlog size */
+static int
+binding_queue_pend(binding_queue_t *self, binding_member_t *bm, message_t *msg)
+{
+    msgsink_t *sink;
+
+    if (bm->bm_pending == NULL) {
+        if ((bm->bm_pending = msgqueue_create(BindingBacklogSize, NULL, NULL)) == NULL) {
+            plog(LOG_ERR, "%s: msgqueue_create() failed", __func__);
+            return -1;
+        }
+    }
+
+    sink = MSGQUEUE_SINK(bm->bm_pending);
+
+    if (msgqueue_head(bm->bm_pending) != NULL)
+        return sink->ms_push_msg(sink, msg);
+
+    if (sink->ms_push_msg(sink, msg) < 0)
+        return -1;
+
+    self->biq_blocked++;
+
+    return 0;
+}
+
+/* members take what waited for them before anything newer */
+static void
+binding_queue_drain(binding_queue_t *self)
+{
+    int i;
+    message_t *msg;
+    msgqueue_t *congested;
+    binding_member_t *bm;
+
+    congested = msgqueue_congested();
+
+    for (i = 0; i < self->biq_binding.bi_members_count && self->biq_blocked > 0; i++) {
+        bm = &self->biq_binding.bi_members[i];
+        if (bm->bm_pending == NULL || msgqueue_head(bm->bm_pending) == NULL)
             continue;
 
-        return sink->ms_push_msg(sink, iov, iovcnt);
+        while ((msg = msgqueue_head(bm->bm_pending)) != NULL) {
+            if (bm->bm_sink->ms_push_msg(bm->bm_sink, msg) < 0)
+                break;
+
+            msgqueue_pop_msg(bm->bm_pending);
+        }
+
+        if (msg == NULL)
+            self->biq_blocked--;
+    }
+
+    msgqueue_set_congested(congested);
+}
+
+/* what waited for a member that left goes where its groups go now */
+static void
+binding_queue_handover(binding_queue_t *self, msgqueue_t *pending)
+{
+    message_t *msg;
+
+    if (msgqueue_head(pending) != NULL)
+        self->biq_blocked--;
+
+    while ((msg = msgqueue_head(pending)) != NULL) {
+        if (binding_queue_deliver(self, msg) < 0 && binding_queue_hold(self, msg) < 0)
+            plog(LOG_ERR, "%s: message to \"%s\" is lost", __func__, self->biq_binding.bi_name);
+
+        msgqueue_pop_msg(pending);
     }
 
+    msgqueue_destroy(pending);
+}
+
+/* hand out the backlog, then the log, until every subscriber is full or waiting */
+static void
+binding_queue_dispatch(binding_queue_t *self)
+{
+    int r;
+    message_t *msg;
+
+    /* pushing may flush the subscriber, which asks for more */
+    if (self->biq_dispatching)
+        return;
+
+    self->biq_dispatching = 1;
+
+    if (self->biq_blocked > 0)
+        binding_queue_drain(self);
+
+    while (self->biq_binding.bi_members_count > self->biq_blocked) {
+        /* a durable queue only has a backlog of what a leaving member handed back */
+        if (self->biq_backlog != NULL && (msg = msgqueue_head(self->biq_backlog)) != NULL) {
+            if (binding_queue_deliver(self, msg) < 0)
+                break;
+
+            msgqueue_pop_msg(self->biq_backlog);
+        } else if (self->biq_binding.bi_flags & BINDING_F_DURABLE) {
+            if ((msg = msglog_peek(self->biq_log)) == NULL)
+                break;
+
+            /* the cursor file moves once the subscriber is done with it */
+            if ((r = binding_queue_deliver(self, msg)) == 0)
+                msglog_advance(self->biq_log, msg);
+
+            message_unref(msg);
+
+            if (r < 0)
+                break;   /* every subscriber is full */
+        } else
+            break;
+    }
+
+    self->biq_dispatching = 0;
+}
+
+static int
+binding_policy_lookup(char *name)
+{
+    int i;
+
+    for (i = 0; i < NELEMS(BindingPolicies); i++) {
+        if (strcmp(BindingPolicies[i].bp_name, name) == 0)
+            return i;
+    }
+
+    plog(LOG_ERR, "%s: unknown dispatch policy \"%s\"", __func__, name);
+
     return -1;
 }
+
+static int
+binding_select_round_robin(binding_queue_t *self, message_t *msg, int *strict)
+{
+    return self->biq_round++ % self->biq_binding.bi_members_count;
+}
+
+static int
+binding_select_least(binding_queue_t *self, message_t *msg, int *strict)
+{
+    int i, n, start, best;
+    size_t load, best_load = 0;
+    msgsink_t *sink;
+
+    n = self->biq_binding.bi_members_count;
+
+    /* start from a rotating position so ties are spread */
+    start = best = self->biq_round++ % n;
+
+    for (i = 0; i < n; i++) {
+        sink = self->biq_binding.bi_members[(start + i) % n].bm_sink;
+        load = (sink->ms_load != NULL) ? sink->ms_load(sink) : 0;
+
+        if (i == 0 || load < best_load) {
+            best = (start + i) % n;
+            best_load = load;
+        }
+    }
+
+    return best;
+}
+
+static int
+binding_select_weighted(binding_queue_t *self, message_t *msg, int *strict)
+{
+    int i, n, weight, total = 0, best = 0;
+    binding_member_t *bm;
+
+    n = self->biq_binding.bi_members_count;
+
+    /* smooth weighted round-robin: heavy members are picked often but not in bursts */
+    for (i = 0; i < n; i++) {
+        bm = &self->biq_binding.bi_members[i];
+        weight = (bm->bm_sink->ms_weight > 0) ? bm->bm_sink->ms_weight : 1;
+
+        bm->bm_current += weight;
+        total += weight;
+
+        if (bm->bm_current > self->biq_binding.bi_members[best].bm_current)
+            best = i;
+    }
+
+    self->biq_binding.bi_members[best].bm_current -= total;
+
+    return best;
+}
+
+static int
+binding_select_hash(binding_queue_t *self, message_t *msg, int *strict)
+{
+    int i, best = 0;
+    uint32_t key;
+    uint64_t score, best_score = 0;
+
+    if (BindingGroupFunc == NULL || (key = BindingGroupFunc(msg)) == 0)
+        return binding_select_round_robin(self, msg, strict);
+
+    /*
+     * highest random weight: a key only moves when its own member leaves.
+     * members sit at a fixed stride in their pool, so all bits of the
+     * pointer go through the mix along with the key
+     */
+    for (i = 0; i < self->biq_binding.bi_members_count; i++) {
+        score = binding_mix64(binding_mix64(key) ^ (uintptr_t) self->biq_binding.bi_members[i].bm_sink);
+
+        if (i == 0 || score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+
+    *strict = 1;
+
+    return best;
+}
+
+/* the splitmix64 finalizer */
+static uint64_t
+binding_mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    return x;
+}
+
+static void
+binding_recover_queue(char *name, void *param)
+{
+    binding_lock();
+
+    if (binding_hash_lookup(&BindingHash, name) == NULL && binding_queue_create(name, NULL) == NULL)
+        plog(LOG_ERR, "%s: can't recover queue \"%s\"", __func__, name);
+
+    binding_unlock();
+}
@@ -30,38 +30,79 @@
 #ifndef BINDING_H
 #define BINDING_H
 #include "msgsink.h"
+#include "msgqueue.h"
+#include "msglog.h"
 
 #define BINDING_NAME_MAX     64
 #define BINDING_MEMBERS_MAX   8
 
+#define BINDING_F_DURABLE     0x01   /* backed by a msglog; kept without subscribers */
+#define BINDING_F_PATTERN     0x02   /* topic name with wildcards, see binding_trie.c */
+#define BINDING_F_QUEUE       0x04
+
+#define BINDING_POLICY_ROUND_ROBIN   0
+#define BINDING_POLICY_LEAST         1   /* fewest outstanding bytes */
+#define BINDING_POLICY_WEIGHTED      2   /* smooth weighted round-robin */
+#define BINDING_POLICY_HASH          3   /* one member per message group */
+
 #define BINDING_SINK(p)   (&((binding_t *) (p))->bi_msgsink)
 
 typedef struct binding binding_t;
+typedef struct binding_queue binding_queue_t;
+
+/* members are kept packed at the front of the array */
+typedef struct {
+    msgsink_t   *bm_sink;
+    int          bm_current;   /* weighted round-robin state */
+    msgqueue_t  *bm_pending;   /* messages of its groups that waited for room, see binding_queue_pend() */
+} binding_member_t;
+
+/* index of the member to try first; *strict means no other member may take it */
+typedef int (binding_select_t)(binding_queue_t *self, message_t *msg, int *strict);
+typedef uint32_t (binding_group_t)(message_t *msg);
 
 struct binding {
     msgsink_t    bi_msgsink;
+    pthread_mutex_t  bi_lock;   /* push and dispatch; members change under the exclusive table lock */
     char         bi_name[BINDING_NAME_MAX];
+    int          bi_flags;
     int          bi_members_max;
     int          bi_members_count;
-    msgsink_t  **bi_members;
-    binding_t   *bi_hash_next;
-    binding_t   *bi_hash_prev;
+    binding_member_t  *bi_members;
+    binding_t   *bi_trie_next;
 };
 
 typedef struct {
     binding_t    bit_binding;
 } binding_topic_t;
 
-typedef struct {
+struct binding_queue {
     binding_t    biq_binding;
-    int          biq_round;
-} binding_queue_t;
+    binding_select_t  *biq_select;
+    unsigned     biq_round;
+    int          biq_dispatching;
+    int          biq_blocked;   /* members with pending messages */
+    msglog_t    *biq_log;
+    msgqueue_t  *biq_backlog;   /* what no subscriber had credit for; durable queues keep it in biq_log */
+};
 
+void binding_set_backlog_size(size_t size);
+int binding_set_default_policy(char *name);
+void binding_set_group_func(binding_group_t *func);
+int binding_queue_set_policy(binding_t *bi, char *name);
+void binding_lock(void);
+void binding_lock_shared(void);
+void binding_unlock(void);
+void binding_enter(binding_t *bi);
+void binding_leave(binding_t *bi);
 binding_t *binding_topic_create(char *name, msgsink_t *sink);
 binding_t *binding_queue_create(char *name, msgsink_t *sink);
 void binding_destroy(binding_t *bi);
 int binding_subscribe(binding_t *bi, msgsink_t *sink);
 int binding_unsubscribe(binding_t *bi, msgsink_t *sink);
-int binding_push_msg(binding_t *bi, struct iovec *iov, int iovcnt);
+int binding_push_msg(binding_t *bi, message_t *msg);
+int binding_append(binding_t *bi, struct iovec *iov, int iovcnt, uint64_t *batch);
+void binding_resume(binding_t *bi);
+int binding_recover(void);
 
 #endif
@@ -36,77 +36,195 @@
 #include "binding.h"
 #include "binding_hash.h"
 
-static unsigned binding_calc_hash(char *name);
+#define BINDING_HASH_INITIAL   256
+#define BINDING_HASH_MIGRATE   8       /* old buckets moved per update */
+
+#define BINDING_HASH_DELETED   ((binding_t *) -1)   /* tombstone, old table only */
+#define BINDING_HASH_HOME(hash, mask)  (((hash) ^ ((hash) >> 16)) & (mask))
+
+static int binding_hash_grow(binding_hash_t *bh);
+static void binding_hash_migrate(binding_hash_t *bh, unsigned count);
+static void binding_hash_insert(binding_hash_entry_t *tab, unsigned mask, binding_t *bi, uint32_t hash);
+static void binding_hash_delete(binding_hash_entry_t *tab, unsigned mask, binding_hash_entry_t *e);
+static binding_hash_entry_t *binding_hash_find(binding_hash_entry_t *tab, unsigned mask, char *name, uint32_t hash);
+static uint32_t binding_calc_hash(char *name);
 
 binding_hash_t BindingHash;
 
-void
+int
 binding_hash_register(binding_hash_t *bh, binding_t *bi)
 {
-    binding_t *next;
-    unsigned value, index;
-
-    value = binding_calc_hash(bi->bi_name);
-    index = value % NELEMS(bh->bh_hashtab);
+    if (bh->bh_old != NULL)
+        binding_hash_migrate(bh, BINDING_HASH_MIGRATE);
+
+    if (bh->bh_tab == NULL || (bh->bh_count + 1) * 4 > (bh->bh_mask + 1) * 3) {
+        if (binding_hash_grow(bh) < 0) {
+            plog(LOG_ERR, "%s: binding_hash_grow() failed", __func__);
+            return -1;
+        }
+    }
 
-    if ((next = bh->bh_hashtab[index]) != NULL)
-        next->bi_hash_prev = bi;
+    binding_hash_insert(bh->bh_tab, bh->bh_mask, bi, binding_calc_hash(bi->bi_name));
+    bh->bh_count++;
+    bh->bh_add_gen++;
 
-    bi->bi_hash_next = next;
-    bi->bi_hash_prev = NULL;
-    bh->bh_hashtab[index] = bi;
+    plog(LOG_DEBUG, "%s: register %p, name \"%s\"", __func__, bi, bi->bi_name);
 
-    plog(LOG_DEBUG, "%s: register %p, name \"%s\", hash %u", __func__, bi, bi->bi_name, index);
+    return 0;
 }
 
 void
 binding_hash_unregister(binding_hash_t *bh, char *name)
 {
-    binding_t *bi;
-    unsigned value, index;
-
-    value = binding_calc_hash(name);
-    index = value % NELEMS(bh->bh_hashtab);
+    int found = 0;
+    uint32_t hash;
+    binding_hash_entry_t *e;
 
-    if ((bi = binding_hash_lookup(bh, name)) == NULL)
+    if (bh->bh_tab == NULL)
         return;
 
-    if (bi->bi_hash_prev != NULL)
-        bi->bi_hash_prev->bi_hash_next = bi->bi_hash_next;
-    if (bi->bi_hash_next != NULL)
-        bi->bi_hash_next->bi_hash_prev = bi->bi_hash_prev;
-    if (bh->bh_hashtab[index] == bi)
-        bh->bh_hashtab[index] = bi->bi_hash_next;
+    hash = binding_calc_hash(name);
 
-    plog(LOG_DEBUG, "%s: unregister %p, name \"%s\", hash %u", __func__, bi, bi->bi_name, index);
+    /* a migrated entry is present in both tables */
+    if ((e = binding_hash_find(bh->bh_tab, bh->bh_mask, name, hash)) != NULL) {
+        binding_hash_delete(bh->bh_tab, bh->bh_mask, e);
+        found = 1;
+    }
+    if (bh->bh_old != NULL) {
+        if ((e = binding_hash_find(bh->bh_old, bh->bh_old_mask, name, hash)) != NULL) {
+            e->bhe_binding = BINDING_HASH_DELETED;
+            found = 1;
+        }
+        binding_hash_migrate(bh, BINDING_HASH_MIGRATE);
+    }
+
+    if (found) {
+        bh->bh_count--;
+        bh->bh_gen++;
+        plog(LOG_DEBUG, "%s: unregister name \"%s\"", __func__, name);
+    }
 }
 
 binding_t *
 binding_hash_lookup(binding_hash_t *bh, char *name)
 {
-    binding_t *p;
-    unsigned value, index;
+    uint32_t hash;
+    binding_hash_entry_t *e;
 
-    value = binding_calc_hash(name);
-    index = value % NELEMS(bh->bh_hashtab);
+    if (bh->bh_tab == NULL)
+        return NULL;
 
-    plog(LOG_DEBUG, "%s: name \"%s\", hash %u", __func__, name, index);
+    hash = binding_calc_hash(name);
 
-    p = bh->bh_hashtab[index];
-    while (p != NULL) {
-        if (strcmp(p->bi_name, name) == 0)
-            return p;
+    if ((e = binding_hash_find(bh->bh_tab, bh->bh_mask, name, hash)) != NULL)
+        return e->bhe_binding;
+    if (bh->bh_old != NULL &&
+        (e = binding_hash_find(bh->bh_old, bh->bh_old_mask, name, hash)) != NULL)
+        return e->bhe_binding;
 
-        p = p->bi_hash_next;
+    return NULL;
+}
+
+static int
+binding_hash_grow(binding_hash_t *bh)
+{
+    unsigned size;
+    binding_hash_entry_t *tab;
+
+    /* finish the previous resize before starting another */
+    if (bh->bh_old != NULL)
+        binding_hash_migrate(bh, bh->bh_old_mask + 1);
+
+    size = (bh->bh_tab == NULL) ? BINDING_HASH_INITIAL : (bh->bh_mask + 1) * 2;
+
+    if ((tab = calloc(size, sizeof(*tab))) == NULL) {
+        plog_error(LOG_ERR, "%s: calloc() failed", __func__);
+        return -1;
     }
 
-    return NULL;
+    if (bh->bh_tab != NULL) {
+        bh->bh_old = bh->bh_tab;
+        bh->bh_old_mask = bh->bh_mask;
+        bh->bh_migrate = 0;
+    }
+
+    bh->bh_tab = tab;
+    bh->bh_mask = size - 1;
+
+    plog(LOG_DEBUG, "%s: size %u, count %u", __func__, size, bh->bh_count);
+
+    return 0;
+}
+
+static void
+binding_hash_migrate(binding_hash_t *bh, unsigned count)
+{
+    binding_hash_entry_t *e;
+
+    /* old entries stay in place until the whole table is freed, so probe chains there stay intact */
+    for (; count > 0 && bh->bh_migrate <= bh->bh_old_mask; count--, bh->bh_migrate++) {
+        e = &bh->bh_old[bh->bh_migrate];
+        if (e->bhe_binding != NULL && e->bhe_binding != BINDING_HASH_DELETED)
+            binding_hash_insert(bh->bh_tab, bh->bh_mask, e->bhe_binding, e->bhe_hash);
+    }
+
+    if (bh->bh_migrate > bh->bh_old_mask) {
+        free(bh->bh_old);
+        bh->bh_old = NULL;
+    }
+}
+
+static void
+binding_hash_insert(binding_hash_entry_t *tab, unsigned mask, binding_t *bi, uint32_t hash)
+{
+    unsigned i;
+
+    for (i = BINDING_HASH_HOME(hash, mask); tab[i].bhe_binding != NULL; i = (i + 1) & mask)
+        ;
+
+    tab[i].bhe_hash = hash;
+    tab[i].bhe_binding = bi;
+}
+
+static void
+binding_hash_delete(binding_hash_entry_t *tab, unsigned mask, binding_hash_entry_t *e)
+{
+    unsigned i, j, k;
+
+    /* backward shift: pull up later entries whose home is not in (i, j] */
+    i = e - tab;
+    for (j = (i + 1) & mask; tab[j].bhe_binding != NULL; j = (j + 1) & mask) {
+        k = BINDING_HASH_HOME(tab[j].bhe_hash, mask);
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        tab[i] = tab[j];
+        i = j;
+    }
+
+    tab[i].bhe_binding = NULL;
+}
+
+static binding_hash_entry_t *
+binding_hash_find(binding_hash_entry_t *tab, unsigned mask, char *name, uint32_t hash)
+{
+    unsigned i;
+    binding_hash_entry_t *e;
+
+    for (i = BINDING_HASH_HOME(hash, mask);; i = (i + 1) & mask) {
+        e = &tab[i];
+        if (e->bhe_binding == NULL)
+            return NULL;
+        if (e->bhe_hash == hash && e->bhe_binding != BINDING_HASH_DELETED &&
+            strcmp(e->bhe_binding->bi_name, name) == 0)
+            return e;
+    }
 }
 
-static unsigned
+static uint32_t
 binding_calc_hash(char *name)
 {
-    unsigned hash = 2166136261U;
+    uint32_t hash = 2166136261U;
 
     /* FNV-1a hash */
     for (; *name != 0; name++) {
@@ -29,13 +29,31 @@
  */
 #ifndef BINDING_HASH_H
 #define BINDING_HASH_H
+#include <stdint.h>
 #include "binding.h"
 
 typedef struct {
-    binding_t  *bh_hashtab[257];
+    uint32_t    bhe_hash;      /* full hash, compared before the name */
+    binding_t  *bhe_binding;
+} binding_hash_entry_t;
+
+/*
+ * open addressing with linear probing.  the table doubles when it is
+ * 3/4 full; entries are moved from the old table a few buckets at a
+ * time on each update, so no single register pays for the whole resize.
+ */
+typedef struct {
+    binding_hash_entry_t  *bh_tab;
+    unsigned               bh_mask;
+    unsigned               bh_count;
+    unsigned               bh_gen;         /* bumped whenever a name is removed */
+    unsigned               bh_add_gen;     /* bumped whenever a name is added */
+    binding_hash_entry_t  *bh_old;         /* table being drained */
+    unsigned               bh_old_mask;
+    unsigned               bh_migrate;     /* next bucket of bh_old to move */
 } binding_hash_t;
 
-void binding_hash_register(binding_hash_t *bh, binding_t *bi);
+int binding_hash_register(binding_hash_t *bh, binding_t *bi);
 void binding_hash_unregister(binding_hash_t *bh, char *name);
 binding_t *binding_hash_lookup(binding_hash_t *bh, char *name);
 
@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libsf/sf.h"
+#include "binding.h"
+#include "binding_trie.h"
+
+typedef struct {
+    char   *ts_ptr;
+    int     ts_len;
+} binding_trie_seg_t;
+
+static int binding_trie_split(char *name, binding_trie_seg_t *segs);
+static binding_trie_node_t **binding_trie_slot(binding_trie_node_t *node, char *seg, int len);
+static int binding_trie_reserve(binding_trie_node_t *node);
+static void binding_trie_prune(binding_trie_node_t *node);
+static void binding_trie_collect(binding_trie_node_t *node, binding_trie_seg_t *segs, int i, int n,
+                                 binding_trie_cache_t *c);
+static void binding_trie_add(binding_trie_cache_t *c, binding_t *bi);
+static unsigned binding_trie_calc_hash(char *name, int len);
+
+binding_trie_t BindingTrie;
+static binding_trie_node_t *BindingTrieNone;   /* the slot of a node without literal children; never set */
+
+/* senders on several workers match at once under the shared binding lock */
+static __thread binding_trie_cache_t *BindingTrieCache;
+static __thread binding_trie_cache_t BindingTrieScratch;   /* results too long to cache */
+
+int
+binding_trie_is_pattern(char *name)
+{
+    int i, n;
+    binding_trie_seg_t segs[BINDING_TRIE_DEPTH_MAX];
+
+    if ((n = binding_trie_split(name, segs)) < 0)
+        return 0;
+
+    for (i = 0; i < n; i++) {
+        if (segs[i].ts_len == 1 &&
+            (*segs[i].ts_ptr == '*' || *segs[i].ts_ptr == '#' || *segs[i].ts_ptr == '>'))
+            return 1;
+    }
+
+    return 0;
+}
+
+int
+binding_trie_register(binding_trie_t *bt, binding_t *bi)
+{
+    int i, n, literal;
+    binding_trie_node_t *node, **p;
+    binding_trie_seg_t segs[BINDING_TRIE_DEPTH_MAX];
+
+    if ((n = binding_trie_split(bi->bi_name, segs)) < 0) {
+        plog(LOG_ERR, "%s: too many segments in \"%s\"", __func__, bi->bi_name);
+        return -1;
+    }
+
+    for (i = 0, node = &bt->bt_root; i < n; i++, node = *p) {
+        if (*(p = binding_trie_slot(node, segs[i].ts_ptr, segs[i].ts_len)) != NULL)
+            continue;
+
+        /* a literal child may need more buckets, which moves the chains */
+        if ((literal = (p != &node->btn_star && p != &node->btn_hash))) {
+            if (binding_trie_reserve(node) < 0)
+                goto error;
+            p = binding_trie_slot(node, segs[i].ts_ptr, segs[i].ts_len);
+        }
+
+        if ((*p = calloc(1, sizeof(binding_trie_node_t))) == NULL ||
+            ((*p)->btn_name = strndup(segs[i].ts_ptr, segs[i].ts_len)) == NULL) {
+            plog_error(LOG_ERR, "%s: calloc() failed", __func__);
+            free(*p);
+            *p = NULL;
+            goto error;
+        }
+
+        (*p)->btn_name_hash = binding_trie_calc_hash(segs[i].ts_ptr, segs[i].ts_len);
+        (*p)->btn_parent = node;
+
+        if (literal)
+            node->btn_children_count++;
+    }
+
+    bi->bi_trie_next = node->btn_bindings;
+    node->btn_bindings = bi;
+
+    bt->bt_count++;
+    bt->bt_gen++;
+
+    plog(LOG_DEBUG, "%s: register pattern \"%s\"", __func__, bi->bi_name);
+
+    return 0;
+
+error:
+    binding_trie_prune(node);
+    return -1;
+}
+
+void
+binding_trie_unregister(binding_trie_t *bt, binding_t *bi)
+{
+    int i, n;
+    binding_t **bp;
+    binding_trie_node_t *node;
+    binding_trie_seg_t segs[BINDING_TRIE_DEPTH_MAX];
+
+    if ((n = binding_trie_split(bi->bi_name, segs)) < 0)
+        return;
+
+    for (i = 0, node = &bt->bt_root; i < n && node != NULL; i++)
+        node = *binding_trie_slot(node, segs[i].ts_ptr, segs[i].ts_len);
+
+    if (node == NULL)
+        return;
+
+    for (bp = &node->btn_bindings; *bp != NULL; bp = &(*bp)->bi_trie_next) {
+        if (*bp == bi) {
+            *bp = bi->bi_trie_next;
+            bt->bt_count--;
+            bt->bt_gen++;
+            break;
+        }
+    }
+
+    binding_trie_prune(node);
+
+    plog(LOG_DEBUG, "%s: unregister pattern \"%s\"", __func__, bi->bi_name);
+}
+
+/* bindings of every pattern matching name; the result stays valid until the trie changes */
+int
+binding_trie_match(binding_trie_t *bt, char *name, binding_t ***result)
+{
+    int n;
+    binding_trie_cache_t *c;
+    binding_trie_seg_t segs[BINDING_TRIE_DEPTH_MAX];
+
+    if (bt->bt_count == 0)
+        return 0;
+
+    if (BindingTrieCache == NULL &&
+        (BindingTrieCache = calloc(BINDING_TRIE_CACHE_SIZE, sizeof(binding_trie_cache_t))) == NULL) {
+        plog_error(LOG_ERR, "%s: calloc() failed", __func__);
+        return 0;
+    }
+
+    c = &BindingTrieCache[binding_trie_calc_hash(name, strlen(name)) % BINDING_TRIE_CACHE_SIZE];
+
+    if (c->btc_gen == bt->bt_gen && strcmp(c->btc_name, name) == 0) {
+        *result = c->btc_bindings;
+        return c->btc_count;
+    }
+
+    if ((n = binding_trie_split(name, segs)) < 0)
+        return 0;
+
+    if (strlen(name) >= sizeof(c->btc_name))
+        c = &BindingTrieScratch;
+
+    c->btc_count = 0;
+    binding_trie_collect(&bt->bt_root, segs, 0, n, c);
+
+    if (c != &BindingTrieScratch) {
+        strcpy(c->btc_name, name);
+        c->btc_gen = bt->bt_gen;
+    }
+
+    *result = c->btc_bindings;
+
+    return c->btc_count;
+}
+
+static int
+binding_trie_split(char *name, binding_trie_seg_t *segs)
+{
+    int n = 0;
+    char *p;
+
+    for (;;) {
+        if (n == BINDING_TRIE_DEPTH_MAX)
+            return -1;
+
+        segs[n].ts_ptr = name;
+
+        if ((p = strpbrk(name, "./")) == NULL) {
+            segs[n++].ts_len = strlen(name);
+            return n;
+        }
+
+        segs[n++].ts_len = p - name;
+        name = p + 1;
+    }
+}
+
+/* where the child for seg is, or would be linked once binding_trie_reserve() made room */
+static binding_trie_node_t **
+binding_trie_slot(binding_trie_node_t *node, char *seg, int len)
+{
+    unsigned hash;
+    binding_trie_node_t **p;
+
+    if (len == 1 && *seg == '*')
+        return &node->btn_star;
+    if (len == 1 && (*seg == '#' || *seg == '>'))
+        return &node->btn_hash;
+
+    if (node->btn_children == NULL)
+        return &BindingTrieNone;
+
+    hash = binding_trie_calc_hash(seg, len);
+
+    for (p = &node->btn_children[hash & node->btn_children_mask]; *p != NULL; p = &(*p)->btn_sibling) {
+        if ((*p)->btn_name_hash == hash &&
+            strncmp((*p)->btn_name, seg, len) == 0 && (*p)->btn_name[len] == '\0')
+            break;
+    }
+
+    return p;
+}
+
+/* room for one more literal child; the chains are rehashed into twice the buckets when full */
+static int
+binding_trie_reserve(binding_trie_node_t *node)
+{
+    unsigned i, size;
+    binding_trie_node_t **tab, *child;
+
+    if (node->btn_children != NULL && node->btn_children_count <= node->btn_children_mask)
+        return 0;
+
+    size = (node->btn_children == NULL) ? BINDING_TRIE_CHILDREN_INITIAL : (node->btn_children_mask + 1) * 2;
+
+    if ((tab = calloc(size, sizeof(*tab))) == NULL) {
+        plog_error(LOG_ERR, "%s: calloc() failed", __func__);
+        return -1;
+    }
+
+    if (node->btn_children != NULL) {
+        for (i = 0; i <= node->btn_children_mask; i++) {
+            while ((child = node->btn_children[i]) != NULL) {
+                node->btn_children[i] = child->btn_sibling;
+                child->btn_sibling = tab[child->btn_name_hash & (size - 1)];
+                tab[child->btn_name_hash & (size - 1)] = child;
+            }
+        }
+
+        free(node->btn_children);
+    }
+
+    node->btn_children = tab;
+    node->btn_children_mask = size - 1;
+
+    return 0;
+}
+
+/* free nodes left without patterns, from node up to the root */
+static void
+binding_trie_prune(binding_trie_node_t *node)
+{
+    binding_trie_node_t *parent, **p;
+
+    while ((parent = node->btn_parent) != NULL) {
+        if (node->btn_bindings != NULL || node->btn_children_count > 0 ||
+            node->btn_star != NULL || node->btn_hash != NULL)
+            break;
+
+        p = binding_trie_slot(parent, node->btn_name, strlen(node->btn_name));
+        *p = node->btn_sibling;
+
+        if (p != &parent->btn_star && p != &parent->btn_hash)
+            parent->btn_children_count--;
+
+        free(node->btn_children);
+        free(node->btn_name);
+        free(node);
+        node = parent;
+    }
+}
+
+static void
+binding_trie_collect(binding_trie_node_t *node, binding_trie_seg_t *segs, int i, int n,
+                     binding_trie_cache_t *c)
+{
+    int k;
+    binding_t *bi;
+    binding_trie_node_t *child;
+
+    /* "#" swallows any number of the remaining segments, none included */
+    if (node->btn_hash != NULL) {
+        for (k = i; k <= n; k++)
+            binding_trie_collect(node->btn_hash, segs, k, n, c);
+    }
+
+    if (i == n) {
+        for (bi = node->btn_bindings; bi != NULL; bi = bi->bi_trie_next)
+            binding_trie_add(c, bi);
+        return;
+    }
+
+    if ((child = *binding_trie_slot(node, segs[i].ts_ptr, segs[i].ts_len)) != NULL)
+        binding_trie_collect(child, segs, i + 1, n, c);
+    if (node->btn_star != NULL && node->btn_star != child)
+        binding_trie_collect(node->btn_star, segs, i + 1, n, c);
+}
+
+static void
+binding_trie_add(binding_trie_cache_t *c, binding_t *bi)
+{
+    int i;
+
+    for (i = 0; i < c->btc_count; i++) {
+        if (c->btc_bindings[i] == bi)
+            return;
+    }
+
+    if (c->btc_count == BINDING_TRIE_MATCH_MAX) {
+        plog(LOG_WARNING, "%s: too many patterns match, \"%s\" ignored", __func__, bi->bi_name);
+        return;
+    }
+
+    c->btc_bindings[c->btc_count++] = bi;
+}
+
+static unsigned
+binding_trie_calc_hash(char *name, int len)
+{
+    unsigned hash = 2166136261U;
+
+    /* FNV-1a hash */
+    for (; len > 0; name++, len--) {
+        hash ^= *((unsigned char *) name);
+        hash *= 16777619;
+    }
+
+    return hash;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef BINDING_TRIE_H
+#define BINDING_TRIE_H
+#include "binding.h"
+
+#define BINDING_TRIE_DEPTH_MAX    32    /* segments per destination */
+#define BINDING_TRIE_MATCH_MAX    32    /* bindings delivered to per destination */
+#define BINDING_TRIE_CACHE_SIZE   256
+#define BINDING_TRIE_CHILDREN_INITIAL  4   /* buckets for the literal children of a node */
+
+typedef struct binding_trie_node binding_trie_node_t;
+
+/* one segment of a wildcard pattern; names are split on '.' and '/' */
+struct binding_trie_node {
+    char                  *btn_name;
+    unsigned               btn_name_hash;
+    binding_trie_node_t   *btn_parent;
+    binding_trie_node_t  **btn_children;  /* literal segments, chained by name hash */
+    unsigned               btn_children_mask;
+    unsigned               btn_children_count;
+    binding_trie_node_t   *btn_sibling;   /* next in the parent's chain */
+    binding_trie_node_t   *btn_star;      /* "*": exactly one segment */
+    binding_trie_node_t   *btn_hash;      /* "#" or ">": any number of segments */
+    binding_t             *btn_bindings;  /* patterns ending here */
+};
+
+/* recent match results, valid while btc_gen is current; each thread has its own */
+typedef struct {
+    unsigned     btc_gen;
+    char         btc_name[BINDING_NAME_MAX];
+    int          btc_count;
+    binding_t   *btc_bindings[BINDING_TRIE_MATCH_MAX];
+} binding_trie_cache_t;
+
+typedef struct {
+    binding_trie_node_t    bt_root;
+    int                    bt_count;
+    unsigned               bt_gen;
+} binding_trie_t;
+
+int binding_trie_is_pattern(char *name);
+int binding_trie_register(binding_trie_t *bt, binding_t *bi);
+void binding_trie_unregister(binding_trie_t *bt, binding_t *bi);
+int binding_trie_match(binding_trie_t *bt, char *name, binding_t ***result);
+
+extern binding_trie_t BindingTrie;
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libsf/sf.h"
+#include "message.h"
+
+message_t *
+message_create(struct iovec *iov, int iovcnt)
+{
+    int i, len = 0;
+    char *p;
+    message_t *msg;
+
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    if ((msg = malloc(sizeof(*msg) + len)) == NULL) {
+        plog(LOG_ERR, "%s: malloc() failed", __func__);
+        return NULL;
+    }
+
+    msg->msg_refcnt = 1;
+    msg->msg_len = len;
+    msg->msg_ptr = msg->msg_data;
+    msg->msg_free = NULL;
+
+    for (i = 0, p = msg->msg_data; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+
+    plog(LOG_DEBUG, "%s: create message %p, len %d", __func__, msg, len);
+
+    return msg;
+}
+
+/* queues on other worker threads hold references, so the count is atomic */
+message_t *
+message_ref(message_t *msg)
+{
+    __sync_add_and_fetch(&msg->msg_refcnt, 1);
+    return msg;
+}
+
+void
+message_unref(message_t *msg)
+{
+    if (__sync_sub_and_fetch(&msg->msg_refcnt, 1) == 0) {
+        plog(LOG_DEBUG, "%s: free message %p", __func__, msg);
+
+        if (msg->msg_free != NULL)
+            msg->msg_free(msg);
+        else
+            free(msg);
+    }
+}
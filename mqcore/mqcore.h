@@ -31,5 +31,9 @@
 #define MQCORE_H
 #include "binding.h"
 #include "binding_hash.h"
+#include "binding_trie.h"
+#include "message.h"
+#include "msglog.h"
+#include "msgcommit.h"
 #include "msgqueue.h"
 #endif
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "libsf/sf.h"
+#include "msglog.h"
+#include "msgcommit.h"
+
+static void msgcommit_run(void);
+static void *msgcommit_thread(void *param);
+static int64_t msgcommit_due(void);
+static uint64_t msgcommit_now(void);
+
+/*
+ * durable writes are grouped into batches.  a batch is closed and flushed
+ * at the end of the loop iteration that opened it, or once it is older
+ * than the window; receipts wait until their batch is on disk.
+ */
+static pthread_mutex_t MsgcommitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t MsgcommitRunLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t MsgcommitCond;
+
+static int MsgcommitWindow;          /* usec */
+static int MsgcommitThreaded;
+static uint64_t MsgcommitOpen = 1;   /* batch new writes join */
+static uint64_t MsgcommitDone;       /* last batch on disk */
+static int MsgcommitPending;         /* requests in the open batch */
+static int MsgcommitRecords;         /* records in the open batch */
+static uint64_t MsgcommitFirst;      /* when the open batch got its first request */
+
+/* instances waiting for a batch to complete */
+static sf_instance_t *MsgcommitWatch[MSGCOMMIT_INSTANCES_MAX];
+static int MsgcommitWatchCount;
+
+static uint64_t MsgcommitBatches, MsgcommitTotalRecords, MsgcommitMaxRecords;
+static uint64_t MsgcommitTotalUsec, MsgcommitMaxUsec;
+
+void
+msgcommit_set_window(int usec)
+{
+    MsgcommitWindow = usec;
+}
+
+/* flush on a helper thread so the event loops never wait for the disk */
+int
+msgcommit_start_thread(void)
+{
+    pthread_t tid;
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&MsgcommitCond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&tid, NULL, msgcommit_thread, NULL) != 0) {
+        plog(LOG_ERR, "%s: pthread_create() failed", __func__);
+        return -1;
+    }
+
+    pthread_detach(tid);
+    MsgcommitThreaded = 1;
+
+    return 0;
+}
+
+/* called after a durable write; returns the batch it will be flushed with */
+uint64_t
+msgcommit_request(int records)
+{
+    uint64_t batch;
+
+    pthread_mutex_lock(&MsgcommitLock);
+
+    if (MsgcommitPending++ == 0) {
+        MsgcommitFirst = msgcommit_now();
+
+        if (MsgcommitThreaded)
+            pthread_cond_signal(&MsgcommitCond);
+    }
+
+    MsgcommitRecords += records;
+    batch = MsgcommitOpen;
+
+    pthread_mutex_unlock(&MsgcommitLock);
+
+    return batch;
+}
+
+uint64_t
+msgcommit_committed(void)
+{
+    return __sync_add_and_fetch(&MsgcommitDone, 0);
+}
+
+/* wake inst up when the next batch completes */
+void
+msgcommit_watch(sf_instance_t *inst)
+{
+    int i;
+
+    pthread_mutex_lock(&MsgcommitLock);
+
+    for (i = 0; i < MsgcommitWatchCount; i++) {
+        if (MsgcommitWatch[i] == inst)
+            break;
+    }
+
+    if (i == MsgcommitWatchCount && i < MSGCOMMIT_INSTANCES_MAX)
+        MsgcommitWatch[MsgcommitWatchCount++] = inst;
+
+    pthread_mutex_unlock(&MsgcommitLock);
+}
+
+/* called at the end of every loop iteration; returns usec until the open batch is due */
+int
+msgcommit_poll(void)
+{
+    int64_t wait;
+
+    /* an unlocked peek is enough; whoever made the request polls too */
+    if (MsgcommitThreaded || MsgcommitPending == 0)
+        return -1;
+
+    pthread_mutex_lock(&MsgcommitLock);
+    wait = msgcommit_due();
+    pthread_mutex_unlock(&MsgcommitLock);
+
+    if (wait != 0)
+        return (int) wait;
+
+    msgcommit_run();
+
+    return -1;
+}
+
+void
+msgcommit_report(void)
+{
+    pthread_mutex_lock(&MsgcommitLock);
+
+    if (MsgcommitBatches > 0) {
+        plog(LOG_INFO, "commit: %llu batches, %llu records (avg %llu, max %llu per batch), "
+             "sync %llu usec avg, %llu usec max",
+             (unsigned long long) MsgcommitBatches,
+             (unsigned long long) MsgcommitTotalRecords,
+             (unsigned long long) (MsgcommitTotalRecords / MsgcommitBatches),
+             (unsigned long long) MsgcommitMaxRecords,
+             (unsigned long long) (MsgcommitTotalUsec / MsgcommitBatches),
+             (unsigned long long) MsgcommitMaxUsec);
+    }
+
+    pthread_mutex_unlock(&MsgcommitLock);
+}
+
+static void
+msgcommit_run(void)
+{
+    int i, count, records;
+    uint64_t batch, start, usec;
+    sf_instance_t *watch[MSGCOMMIT_INSTANCES_MAX];
+
+    /* one flush at a time; a caller that waited here may find its batch done */
+    pthread_mutex_lock(&MsgcommitRunLock);
+    pthread_mutex_lock(&MsgcommitLock);
+
+    if (MsgcommitPending == 0) {
+        pthread_mutex_unlock(&MsgcommitLock);
+        pthread_mutex_unlock(&MsgcommitRunLock);
+        return;
+    }
+
+    batch = MsgcommitOpen++;
+    records = MsgcommitRecords;
+    MsgcommitPending = MsgcommitRecords = 0;
+
+    pthread_mutex_unlock(&MsgcommitLock);
+
+    start = msgcommit_now();
+    msglog_commit();
+    usec = msgcommit_now() - start;
+
+    pthread_mutex_lock(&MsgcommitLock);
+
+    __sync_lock_test_and_set(&MsgcommitDone, batch);
+
+    MsgcommitBatches++;
+    MsgcommitTotalRecords += records;
+    MsgcommitTotalUsec += usec;
+    if (records > MsgcommitMaxRecords)
+        MsgcommitMaxRecords = records;
+    if (usec > MsgcommitMaxUsec)
+        MsgcommitMaxUsec = usec;
+
+    count = MsgcommitWatchCount;
+    memcpy(watch, MsgcommitWatch, sizeof(watch[0]) * count);
+    MsgcommitWatchCount = 0;
+
+    pthread_mutex_unlock(&MsgcommitLock);
+    pthread_mutex_unlock(&MsgcommitRunLock);
+
+    plog(LOG_DEBUG, "%s: batch %llu, %d records, %llu usec", __func__,
+         (unsigned long long) batch, records, (unsigned long long) usec);
+
+    for (i = 0; i < count; i++) {
+        if (!pthread_equal(watch[i]->inst_thread, pthread_self()))
+            sf_wakeup(watch[i]);
+    }
+}
+
+static void *
+msgcommit_thread(void *param)
+{
+    int64_t wait;
+    uint64_t abstime;
+    struct timespec ts;
+
+    pthread_mutex_lock(&MsgcommitLock);
+
+    for (;;) {
+        if ((wait = msgcommit_due()) < 0) {
+            pthread_cond_wait(&MsgcommitCond, &MsgcommitLock);
+            continue;
+        }
+
+        if (wait > 0) {
+            abstime = msgcommit_now() + wait;
+            ts.tv_sec = abstime / 1000000;
+            ts.tv_nsec = (abstime % 1000000) * 1000;
+            pthread_cond_timedwait(&MsgcommitCond, &MsgcommitLock, &ts);
+            continue;
+        }
+
+        pthread_mutex_unlock(&MsgcommitLock);
+        msgcommit_run();
+        pthread_mutex_lock(&MsgcommitLock);
+    }
+
+    return NULL;
+}
+
+/* called with MsgcommitLock held; -1 if nothing is pending */
+static int64_t
+msgcommit_due(void)
+{
+    int64_t wait;
+
+    if (MsgcommitPending == 0)
+        return -1;
+
+    wait = MsgcommitWindow - (int64_t) (msgcommit_now() - MsgcommitFirst);
+
+    return (wait > 0) ? wait : 0;
+}
+
+static uint64_t
+msgcommit_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
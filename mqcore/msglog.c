@@ -0,0 +1,860 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libsf/sf.h"
+#include "msglog.h"
+#include "msgcommit.h"
+
+#define MSGLOG_RECSIZE(len) \
+    (sizeof(msglog_record_t) + (((size_t) (len) + MSGLOG_ALIGN - 1) & ~((size_t) MSGLOG_ALIGN - 1)))
+
+#define MSGLOG_SYNC_SEGMENTS   8
+
+#define MSGLOG_DONE_TEST(d, bits, seq)   ((d)[((seq) & ((bits) - 1)) / 64] & (1ULL << ((seq) % 64)))
+#define MSGLOG_DONE_SET(d, bits, seq)    ((d)[((seq) & ((bits) - 1)) / 64] |= (1ULL << ((seq) % 64)))
+#define MSGLOG_DONE_CLEAR(d, bits, seq)  ((d)[((seq) & ((bits) - 1)) / 64] &= ~(1ULL << ((seq) % 64)))
+
+/* a record handed to subscriber queues; it points into the mapping */
+typedef struct {
+    msglog_t          *lm_log;
+    msglog_segment_t  *lm_seg;
+    uint64_t           lm_seq;
+    int                lm_dispatched;   /* released to the log when freed, see msglog_advance() */
+    message_t          lm_msg;
+} msglog_message_t;
+
+static int msglog_encode(char *buf, int bufmax, char *name);
+static int msglog_decode(char *buf, int bufmax, char *name);
+static int msglog_recover(msglog_t *log);
+static void msglog_recover_cursor(msglog_t *log);
+static int msglog_list_segments(msglog_t *log, uint64_t **bases);
+static int msglog_compare_base(const void *a, const void *b);
+static msglog_segment_t *msglog_segment_open(msglog_t *log, uint64_t base, int create);
+static size_t msglog_segment_scan(msglog_segment_t *seg, uint64_t *seq);
+static int msglog_segment_clear(msglog_segment_t *seg);
+static void msglog_segment_drop(msglog_t *log);
+static void msglog_segment_unref(msglog_segment_t *seg);
+static int msglog_roll(msglog_t *log);
+static int msglog_done_reserve(msglog_t *log);
+static void msglog_release(msglog_t *log, uint64_t seq);
+static void msglog_mark_dirty(msglog_t *log);
+static void msglog_sync(msglog_t *log);
+static void msglog_message_free(message_t *msg);
+static uint64_t msglog_checksum(uint64_t seq, char *buf, size_t len);
+
+static char MsglogDir[MSGLOG_PATH_MAX];
+
+/* logs with records or a cursor not yet on disk */
+static pthread_mutex_t MsglogDirtyLock = PTHREAD_MUTEX_INITIALIZER;
+static msglog_t *MsglogDirty;
+
+static sf_pool_t MsglogMessagePool = SF_POOL_INITIALIZER("log message", msglog_message_t);
+
+int
+msglog_init(char *dir)
+{
+    if (strlen(dir) >= sizeof(MsglogDir)) {
+        plog(LOG_ERR, "%s: directory name too long", __func__);
+        return -1;
+    }
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        plog_error(LOG_ERR, "%s: mkdir() failed", __func__);
+        return -1;
+    }
+
+    strcpy(MsglogDir, dir);
+
+    return 0;
+}
+
+int
+msglog_enabled(void)
+{
+    return MsglogDir[0] != '\0';
+}
+
+/* call func for every destination that has a log directory */
+int
+msglog_scan(void (*func)(char *name, void *param), void *param)
+{
+    DIR *dir;
+    struct dirent *de;
+    char name[MSGLOG_PATH_MAX];
+
+    if ((dir = opendir(MsglogDir)) == NULL) {
+        plog_error(LOG_ERR, "%s: opendir() failed", __func__);
+        return -1;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        if (msglog_decode(name, sizeof(name), de->d_name) < 0)
+            continue;
+
+        func(name, param);
+    }
+
+    closedir(dir);
+
+    return 0;
+}
+
+msglog_t *
+msglog_open(char *name)
+{
+    char ename[MSGLOG_PATH_MAX], path[MSGLOG_PATH_MAX];
+    uint64_t cursor;
+    msglog_t *log;
+
+    if ((log = calloc(1, sizeof(*log))) == NULL) {
+        plog_error(LOG_ERR, "%s: calloc() failed", __func__);
+        return NULL;
+    }
+
+    pthread_mutex_init(&log->ml_lock, NULL);
+    log->ml_cursor_fd = -1;
+
+    if (msglog_encode(ename, sizeof(ename), name) < 0 ||
+        snprintf(log->ml_path, sizeof(log->ml_path), "%s/%s", MsglogDir, ename) >= sizeof(log->ml_path) ||
+        snprintf(path, sizeof(path), "%s/cursor", log->ml_path) >= sizeof(path)) {
+        plog(LOG_ERR, "%s: destination name too long", __func__);
+        goto error;
+    }
+
+    if (mkdir(log->ml_path, 0700) < 0 && errno != EEXIST) {
+        plog_error(LOG_ERR, "%s: mkdir() failed", __func__);
+        goto error;
+    }
+
+    if ((log->ml_cursor_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+        plog_error(LOG_ERR, "%s: open() failed", __func__);
+        goto error;
+    }
+
+    if (pread(log->ml_cursor_fd, &cursor, sizeof(cursor), 0) != sizeof(cursor))
+        cursor = 0;
+
+    log->ml_cursor_seq = log->ml_cursor_synced = cursor;
+
+    if (msglog_recover(log) < 0) {
+        plog(LOG_ERR, "%s: msglog_recover() failed", __func__);
+        goto error;
+    }
+
+    plog(LOG_INFO, "%s: \"%s\": %llu records pending", __func__, name,
+         (unsigned long long) (log->ml_seq - log->ml_cursor_seq));
+
+    return log;
+
+ error:
+    msglog_close(log);
+    return NULL;
+}
+
+void
+msglog_close(msglog_t *log)
+{
+    msglog_t **p;
+    msglog_segment_t *seg, *next;
+
+    pthread_mutex_lock(&MsglogDirtyLock);
+
+    for (p = &MsglogDirty; *p != NULL; p = &(*p)->ml_dirty_next) {
+        if (*p == log) {
+            *p = log->ml_dirty_next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&MsglogDirtyLock);
+
+    if (log->ml_cursor_fd >= 0) {
+        msglog_sync(log);
+        close(log->ml_cursor_fd);
+    }
+
+    for (seg = log->ml_head; seg != NULL; seg = next) {
+        next = seg->mls_next;
+        msglog_segment_unref(seg);
+    }
+
+    pthread_mutex_destroy(&log->ml_lock);
+    free(log->ml_done);
+    free(log);
+}
+
+/* the frame is copied straight into the mapping; it is on disk after the next commit */
+int
+msglog_append(msglog_t *log, struct iovec *iov, int iovcnt)
+{
+    int i;
+    char *p;
+    size_t len = 0, recsize;
+    msglog_record_t *rec;
+    msglog_segment_t *seg;
+
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    if ((recsize = MSGLOG_RECSIZE(len)) > MSGLOG_SEGMENT_SIZE) {
+        plog(LOG_ERR, "%s: message too large (%zu bytes)", __func__, len);
+        return -1;
+    }
+
+    pthread_mutex_lock(&log->ml_lock);
+
+    if (recsize > log->ml_tail->mls_size - log->ml_tail->mls_len) {
+        if (msglog_roll(log) < 0) {
+            plog(LOG_ERR, "%s: msglog_roll() failed", __func__);
+            pthread_mutex_unlock(&log->ml_lock);
+            return -1;
+        }
+    }
+
+    seg = log->ml_tail;
+    rec = (msglog_record_t *) (seg->mls_map + seg->mls_len);
+
+    for (i = 0, p = (char *) (rec + 1); i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+
+    rec->mlr_len = len;
+    rec->mlr_seq = log->ml_seq++;
+    rec->mlr_sum = msglog_checksum(rec->mlr_seq, (char *) (rec + 1), len);
+    rec->mlr_magic = MSGLOG_MAGIC;
+    seg->mls_len += recsize;
+
+    msglog_mark_dirty(log);
+    pthread_mutex_unlock(&log->ml_lock);
+
+    return 0;
+}
+
+/* the record at the cursor, or NULL if everything has been dispatched */
+message_t *
+msglog_peek(msglog_t *log)
+{
+    msglog_record_t *rec;
+    msglog_message_t *lm;
+
+    pthread_mutex_lock(&log->ml_lock);
+
+    if (log->ml_cursor_seq == log->ml_seq) {
+        pthread_mutex_unlock(&log->ml_lock);
+        return NULL;
+    }
+
+    /* the cursor may still be at the end of a segment the writer has rolled over */
+    if (log->ml_cursor_off == log->ml_cursor->mls_len) {
+        log->ml_cursor = log->ml_cursor->mls_next;
+        log->ml_cursor_off = 0;
+    }
+
+    if (msglog_done_reserve(log) < 0) {
+        plog(LOG_ERR, "%s: msglog_done_reserve() failed", __func__);
+        pthread_mutex_unlock(&log->ml_lock);
+        return NULL;
+    }
+
+    if ((lm = sf_pool_alloc(&MsglogMessagePool)) == NULL) {
+        plog(LOG_ERR, "%s: sf_pool_alloc() failed", __func__);
+        pthread_mutex_unlock(&log->ml_lock);
+        return NULL;
+    }
+
+    rec = (msglog_record_t *) (log->ml_cursor->mls_map + log->ml_cursor_off);
+
+    lm->lm_log = log;
+    lm->lm_seg = log->ml_cursor;
+    lm->lm_seq = log->ml_cursor_seq;
+    lm->lm_dispatched = 0;
+    lm->lm_msg.msg_refcnt = 1;
+    lm->lm_msg.msg_len = rec->mlr_len;
+    lm->lm_msg.msg_ptr = (char *) (rec + 1);
+    lm->lm_msg.msg_free = msglog_message_free;
+    __sync_add_and_fetch(&lm->lm_seg->mls_refcnt, 1);
+
+    pthread_mutex_unlock(&log->ml_lock);
+
+    return &lm->lm_msg;
+}
+
+/*
+ * msg, from msglog_peek(), has been handed out.  the record stays in the
+ * log until the last reference to msg goes, i.e. it has been written to an
+ * auto-ack subscriber or acknowledged; only then may the cursor file pass it.
+ */
+void
+msglog_advance(msglog_t *log, message_t *msg)
+{
+    msglog_record_t *rec;
+    msglog_message_t *lm;
+
+    lm = (msglog_message_t *) ((char *) msg - offsetof(msglog_message_t, lm_msg));
+    lm->lm_dispatched = 1;
+
+    pthread_mutex_lock(&log->ml_lock);
+
+    rec = (msglog_record_t *) (log->ml_cursor->mls_map + log->ml_cursor_off);
+    log->ml_cursor_off += MSGLOG_RECSIZE(rec->mlr_len);
+    log->ml_cursor_seq++;
+
+    if (log->ml_cursor_off == log->ml_cursor->mls_len && log->ml_cursor != log->ml_tail) {
+        log->ml_cursor = log->ml_cursor->mls_next;
+        log->ml_cursor_off = 0;
+    }
+
+    pthread_mutex_unlock(&log->ml_lock);
+}
+
+/* group commit: everything appended since the last call shares one msync per segment */
+void
+msglog_commit(void)
+{
+    msglog_t *log, *next;
+
+    pthread_mutex_lock(&MsglogDirtyLock);
+    log = MsglogDirty;
+    MsglogDirty = NULL;
+    pthread_mutex_unlock(&MsglogDirtyLock);
+
+    for (; log != NULL; log = next) {
+        next = log->ml_dirty_next;
+        msglog_sync(log);
+    }
+}
+
+static int
+msglog_encode(char *buf, int bufmax, char *name)
+{
+    int len = 0;
+    unsigned char c;
+
+    for (; (c = *name) != '\0'; name++) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+            c == '-' || c == '_' || (c == '.' && len > 0)) {
+            if (len + 1 >= bufmax)
+                return -1;
+            buf[len++] = c;
+        } else {
+            if (len + 3 >= bufmax)
+                return -1;
+            len += snprintf(buf + len, bufmax - len, "%%%02X", c);
+        }
+    }
+
+    buf[len] = '\0';
+
+    return 0;
+}
+
+static int
+msglog_decode(char *buf, int bufmax, char *name)
+{
+    int len = 0;
+    unsigned c;
+
+    for (; *name != '\0'; name++) {
+        if (len + 1 >= bufmax)
+            return -1;
+
+        if (*name == '%') {
+            if (sscanf(name + 1, "%2x", &c) != 1)
+                return -1;
+            buf[len++] = c;
+            name += 2;
+        } else
+            buf[len++] = *name;
+    }
+
+    buf[len] = '\0';
+
+    return 0;
+}
+
+/* segments are replayed in order; anything after the first bad record is dropped */
+static int
+msglog_recover(msglog_t *log)
+{
+    int i, count;
+    char path[MSGLOG_PATH_MAX + 32];
+    uint64_t seq, *bases;
+    msglog_segment_t *seg;
+
+    if ((count = msglog_list_segments(log, &bases)) < 0) {
+        plog(LOG_ERR, "%s: msglog_list_segments() failed", __func__);
+        return -1;
+    }
+
+    seq = (count > 0) ? bases[0] : log->ml_cursor_seq;
+
+    for (i = 0; i < count; i++) {
+        if (bases[i] != seq || (seg = msglog_segment_open(log, bases[i], 0)) == NULL)
+            break;
+
+        seg->mls_len = seg->mls_synced = msglog_segment_scan(seg, &seq);
+
+        if (log->ml_tail == NULL)
+            log->ml_head = seg;
+        else
+            log->ml_tail->mls_next = seg;
+
+        log->ml_tail = seg;
+    }
+
+    for (; i < count; i++) {
+        plog(LOG_WARNING, "%s: %s: discard segment %llu", __func__, log->ml_path,
+             (unsigned long long) bases[i]);
+        snprintf(path, sizeof(path), "%s/%020llu.log", log->ml_path, (unsigned long long) bases[i]);
+        unlink(path);
+    }
+
+    free(bases);
+    log->ml_seq = seq;
+
+    if (log->ml_tail == NULL) {
+        if ((log->ml_head = log->ml_tail = msglog_segment_open(log, seq, 1)) == NULL)
+            return -1;
+    } else if (msglog_segment_clear(log->ml_tail) < 0)
+        return -1;
+
+    msglog_recover_cursor(log);
+
+    return 0;
+}
+
+/* whatever was handed out but not done with before the restart is dispatched again */
+static void
+msglog_recover_cursor(msglog_t *log)
+{
+    uint64_t seq;
+    msglog_record_t *rec;
+
+    if (log->ml_cursor_seq < log->ml_head->mls_base)
+        log->ml_cursor_seq = log->ml_head->mls_base;
+    if (log->ml_cursor_seq > log->ml_seq)
+        log->ml_cursor_seq = log->ml_seq;
+
+    log->ml_commit_seq = log->ml_cursor_seq;
+
+    while (log->ml_head != log->ml_tail && log->ml_head->mls_next->mls_base <= log->ml_commit_seq)
+        msglog_segment_drop(log);
+
+    log->ml_cursor = log->ml_head;
+    log->ml_cursor_off = 0;
+
+    for (seq = log->ml_cursor->mls_base; seq < log->ml_cursor_seq; seq++) {
+        rec = (msglog_record_t *) (log->ml_cursor->mls_map + log->ml_cursor_off);
+        log->ml_cursor_off += MSGLOG_RECSIZE(rec->mlr_len);
+    }
+}
+
+static int
+msglog_list_segments(msglog_t *log, uint64_t **bases)
+{
+    int count = 0, max = 0;
+    char *end;
+    uint64_t base, *p;
+    DIR *dir;
+    struct dirent *de;
+
+    *bases = NULL;
+
+    if ((dir = opendir(log->ml_path)) == NULL) {
+        plog_error(LOG_ERR, "%s: opendir() failed", __func__);
+        return -1;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        base = strtoull(de->d_name, &end, 10);
+        if (end == de->d_name || strcmp(end, ".log") != 0)
+            continue;
+
+        if (count == max) {
+            max = (max == 0) ? 16 : max * 2;
+            if ((p = realloc(*bases, sizeof(uint64_t) * max)) == NULL) {
+                plog_error(LOG_ERR, "%s: realloc() failed", __func__);
+                closedir(dir);
+                free(*bases);
+                return -1;
+            }
+            *bases = p;
+        }
+
+        (*bases)[count++] = base;
+    }
+
+    closedir(dir);
+    qsort(*bases, count, sizeof(uint64_t), msglog_compare_base);
+
+    return count;
+}
+
+static int
+msglog_compare_base(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+static msglog_segment_t *
+msglog_segment_open(msglog_t *log, uint64_t base, int create)
+{
+    int dirfd, r;
+    struct stat st;
+    msglog_segment_t *seg;
+
+    if ((seg = calloc(1, sizeof(*seg))) == NULL) {
+        plog_error(LOG_ERR, "%s: calloc() failed", __func__);
+        return NULL;
+    }
+
+    seg->mls_refcnt = 1;
+    seg->mls_base = base;
+    seg->mls_map = MAP_FAILED;
+    snprintf(seg->mls_path, sizeof(seg->mls_path), "%s/%020llu.log", log->ml_path, (unsigned long long) base);
+
+    if ((seg->mls_fd = open(seg->mls_path, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0600)) < 0) {
+        plog_error(LOG_ERR, "%s: open() failed", __func__);
+        goto error;
+    }
+
+    if (create) {
+        /* allocated up front; a write to a hole in the mapping is SIGBUS once the disk is full */
+        if ((r = posix_fallocate(seg->mls_fd, 0, MSGLOG_SEGMENT_SIZE)) != 0) {
+            errno = r;
+            plog_error(LOG_ERR, "%s: posix_fallocate() failed", __func__);
+            goto error;
+        }
+
+        if (fsync(seg->mls_fd) < 0) {
+            plog_error(LOG_ERR, "%s: fsync() failed", __func__);
+            goto error;
+        }
+
+        /* make the new file itself survive a crash */
+        if ((dirfd = open(log->ml_path, O_RDONLY)) >= 0) {
+            fsync(dirfd);
+            close(dirfd);
+        }
+
+        seg->mls_size = MSGLOG_SEGMENT_SIZE;
+    } else {
+        if (fstat(seg->mls_fd, &st) < 0 || st.st_size < sizeof(msglog_record_t)) {
+            plog(LOG_ERR, "%s: %s: broken segment", __func__, seg->mls_path);
+            goto error;
+        }
+
+        seg->mls_size = st.st_size;
+    }
+
+    seg->mls_map = mmap(NULL, seg->mls_size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->mls_fd, 0);
+    if (seg->mls_map == MAP_FAILED) {
+        plog_error(LOG_ERR, "%s: mmap() failed", __func__);
+        goto error;
+    }
+
+    return seg;
+
+ error:
+    if (seg->mls_fd >= 0) {
+        close(seg->mls_fd);
+        if (create)
+            unlink(seg->mls_path);
+    }
+
+    free(seg);
+    return NULL;
+}
+
+/* returns the length of the valid records; seq is advanced past them */
+static size_t
+msglog_segment_scan(msglog_segment_t *seg, uint64_t *seq)
+{
+    size_t off = 0, recsize;
+    msglog_record_t *rec;
+
+    while (off + sizeof(*rec) <= seg->mls_size) {
+        rec = (msglog_record_t *) (seg->mls_map + off);
+
+        if (rec->mlr_magic != MSGLOG_MAGIC || rec->mlr_seq != *seq)
+            break;
+        if ((recsize = MSGLOG_RECSIZE(rec->mlr_len)) > seg->mls_size - off)
+            break;
+        if (rec->mlr_sum != msglog_checksum(rec->mlr_seq, (char *) (rec + 1), rec->mlr_len))
+            break;
+
+        off += recsize;
+        (*seq)++;
+    }
+
+    return off;
+}
+
+/* zero whatever follows the last valid record, so stale bytes are never replayed */
+static int
+msglog_segment_clear(msglog_segment_t *seg)
+{
+    int r;
+
+    if (ftruncate(seg->mls_fd, seg->mls_len) < 0) {
+        plog_error(LOG_ERR, "%s: ftruncate() failed", __func__);
+        return -1;
+    }
+
+    /* and back to full size without holes, see msglog_segment_open() */
+    if ((r = posix_fallocate(seg->mls_fd, seg->mls_len, seg->mls_size - seg->mls_len)) != 0) {
+        errno = r;
+        plog_error(LOG_ERR, "%s: posix_fallocate() failed", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* every record of the head segment is done with */
+static void
+msglog_segment_drop(msglog_t *log)
+{
+    msglog_segment_t *seg;
+
+    seg = log->ml_head;
+    log->ml_head = seg->mls_next;
+
+    seg->mls_obsolete = 1;
+    msglog_segment_unref(seg);
+}
+
+/* messages on other worker threads hold references, so the count is atomic */
+static void
+msglog_segment_unref(msglog_segment_t *seg)
+{
+    if (__sync_sub_and_fetch(&seg->mls_refcnt, 1) > 0)
+        return;
+
+    plog(LOG_DEBUG, "%s: release segment %s", __func__, seg->mls_path);
+
+    munmap(seg->mls_map, seg->mls_size);
+    close(seg->mls_fd);
+
+    if (seg->mls_obsolete)
+        unlink(seg->mls_path);
+
+    free(seg);
+}
+
+static int
+msglog_roll(msglog_t *log)
+{
+    msglog_segment_t *seg;
+
+    if ((seg = msglog_segment_open(log, log->ml_seq, 1)) == NULL)
+        return -1;
+
+    log->ml_tail->mls_next = seg;
+    log->ml_tail = seg;
+
+    return 0;
+}
+
+/* called with ml_lock held; makes room to track the record at the cursor */
+static int
+msglog_done_reserve(msglog_t *log)
+{
+    uint64_t seq, *done;
+    unsigned bits;
+
+    if (log->ml_cursor_seq - log->ml_commit_seq < log->ml_done_bits)
+        return 0;
+
+    bits = (log->ml_done_bits == 0) ? 1024 : log->ml_done_bits * 2;
+
+    if ((done = calloc(bits / 64, sizeof(*done))) == NULL) {
+        plog_error(LOG_ERR, "%s: calloc() failed", __func__);
+        return -1;
+    }
+
+    /* bits are indexed by seq modulo the size, so they move */
+    for (seq = log->ml_commit_seq; seq < log->ml_cursor_seq; seq++) {
+        if (MSGLOG_DONE_TEST(log->ml_done, log->ml_done_bits, seq))
+            MSGLOG_DONE_SET(done, bits, seq);
+    }
+
+    free(log->ml_done);
+    log->ml_done = done;
+    log->ml_done_bits = bits;
+
+    return 0;
+}
+
+/* acks come in any order; the commit point moves over a run of released records */
+static void
+msglog_release(msglog_t *log, uint64_t seq)
+{
+    int request = 0;
+
+    pthread_mutex_lock(&log->ml_lock);
+
+    MSGLOG_DONE_SET(log->ml_done, log->ml_done_bits, seq);
+
+    if (seq == log->ml_commit_seq) {
+        do {
+            MSGLOG_DONE_CLEAR(log->ml_done, log->ml_done_bits, log->ml_commit_seq);
+            log->ml_commit_seq++;
+        } while (log->ml_commit_seq < log->ml_cursor_seq &&
+                 MSGLOG_DONE_TEST(log->ml_done, log->ml_done_bits, log->ml_commit_seq));
+
+        while (log->ml_head != log->ml_cursor && log->ml_head->mls_next->mls_base <= log->ml_commit_seq)
+            msglog_segment_drop(log);
+
+        /* a log already dirty is in a batch that will write the cursor too */
+        request = !log->ml_dirty;
+        msglog_mark_dirty(log);
+    }
+
+    pthread_mutex_unlock(&log->ml_lock);
+
+    if (request)
+        msgcommit_request(0);
+}
+
+/* called with ml_lock held */
+static void
+msglog_mark_dirty(msglog_t *log)
+{
+    if (log->ml_dirty)
+        return;
+
+    log->ml_dirty = 1;
+
+    pthread_mutex_lock(&MsglogDirtyLock);
+    log->ml_dirty_next = MsglogDirty;
+    MsglogDirty = log;
+    pthread_mutex_unlock(&MsglogDirtyLock);
+}
+
+static void
+msglog_sync(msglog_t *log)
+{
+    int i, count = 0;
+    size_t from[MSGLOG_SYNC_SEGMENTS], to[MSGLOG_SYNC_SEGMENTS], pagemask;
+    uint64_t cursor;
+    msglog_segment_t *seg, *segs[MSGLOG_SYNC_SEGMENTS];
+
+    pagemask = ~((size_t) getpagesize() - 1);
+
+    /* take a snapshot, then flush without blocking appends */
+    pthread_mutex_lock(&log->ml_lock);
+    log->ml_dirty = 0;
+
+    for (seg = log->ml_head; seg != NULL; seg = seg->mls_next) {
+        if (seg->mls_synced == seg->mls_len)
+            continue;
+
+        if (count == MSGLOG_SYNC_SEGMENTS) {
+            msglog_mark_dirty(log);
+            break;
+        }
+
+        __sync_add_and_fetch(&seg->mls_refcnt, 1);
+        segs[count] = seg;
+        from[count] = seg->mls_synced & pagemask;
+        to[count] = seg->mls_len;
+        count++;
+    }
+
+    cursor = log->ml_commit_seq;
+    pthread_mutex_unlock(&log->ml_lock);
+
+    for (i = 0; i < count; i++) {
+        if (msync(segs[i]->mls_map + from[i], to[i] - from[i], MS_SYNC) < 0)
+            plog_error(LOG_ERR, "%s: msync() failed", __func__);
+        else
+            segs[i]->mls_synced = to[i];
+
+        msglog_segment_unref(segs[i]);
+    }
+
+    /* the cursor goes after the records it may point past */
+    if (cursor != log->ml_cursor_synced) {
+        if (pwrite(log->ml_cursor_fd, &cursor, sizeof(cursor), 0) != sizeof(cursor) ||
+            fdatasync(log->ml_cursor_fd) < 0)
+            plog_error(LOG_ERR, "%s: writing cursor failed", __func__);
+        else
+            log->ml_cursor_synced = cursor;
+    }
+}
+
+static void
+msglog_message_free(message_t *msg)
+{
+    msglog_message_t *lm;
+
+    lm = (msglog_message_t *) ((char *) msg - offsetof(msglog_message_t, lm_msg));
+
+    /* durable bindings are never destroyed, so the log outlives its messages */
+    if (lm->lm_dispatched)
+        msglog_release(lm->lm_log, lm->lm_seq);
+
+    msglog_segment_unref(lm->lm_seg);
+    sf_pool_free(&MsglogMessagePool, lm);
+}
+
+/* FNV-1a over 64-bit words with a fold; enough to catch torn writes */
+static uint64_t
+msglog_checksum(uint64_t seq, char *buf, size_t len)
+{
+    uint64_t w, sum = 0xcbf29ce484222325ULL ^ seq;
+
+    for (; len >= sizeof(w); buf += sizeof(w), len -= sizeof(w)) {
+        memcpy(&w, buf, sizeof(w));
+        sum = (sum ^ w) * 0x100000001b3ULL;
+        sum ^= sum >> 32;
+    }
+
+    for (; len > 0; buf++, len--)
+        sum = (sum ^ (unsigned char) *buf) * 0x100000001b3ULL;
+
+    return sum ^ (sum >> 29);
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef MSGLOG_H
+#define MSGLOG_H
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "message.h"
+
+#define MSGLOG_SEGMENT_SIZE    (16 * 1024 * 1024)
+#define MSGLOG_MAGIC           0x314c514d     /* "MQL1" */
+#define MSGLOG_ALIGN           8
+#define MSGLOG_PATH_MAX        512
+
+/* on-disk record header; the frame follows, padded to MSGLOG_ALIGN */
+typedef struct {
+    uint32_t   mlr_magic;
+    uint32_t   mlr_len;
+    uint64_t   mlr_seq;
+    uint64_t   mlr_sum;
+} msglog_record_t;
+
+typedef struct msglog_segment msglog_segment_t;
+
+/* one mapped file, named after the sequence number of its first record */
+struct msglog_segment {
+    msglog_segment_t  *mls_next;
+    unsigned           mls_refcnt;     /* the log and every message delivered from it */
+    int                mls_fd;
+    int                mls_obsolete;   /* unlinked when the last reference goes */
+    uint64_t           mls_base;
+    char              *mls_map;
+    size_t             mls_size;
+    size_t             mls_len;        /* bytes appended */
+    size_t             mls_synced;     /* bytes known to be on disk */
+    char               mls_path[MSGLOG_PATH_MAX + 32];
+};
+
+typedef struct msglog msglog_t;
+
+struct msglog {
+    pthread_mutex_t    ml_lock;
+    msglog_t          *ml_dirty_next;
+    int                ml_dirty;
+    int                ml_cursor_fd;
+    uint64_t           ml_seq;           /* sequence number of the next record */
+    uint64_t           ml_cursor_seq;    /* next record to dispatch */
+    uint64_t           ml_commit_seq;    /* records before it are done with; the cursor file keeps it */
+    uint64_t           ml_cursor_synced;
+    uint64_t          *ml_done;          /* released records from ml_commit_seq on, one bit each */
+    unsigned           ml_done_bits;     /* power of 2 */
+    msglog_segment_t  *ml_head;
+    msglog_segment_t  *ml_tail;
+    msglog_segment_t  *ml_cursor;
+    size_t             ml_cursor_off;
+    char               ml_path[MSGLOG_PATH_MAX];
+};
+
+int msglog_init(char *dir);
+int msglog_enabled(void);
+int msglog_scan(void (*func)(char *name, void *param), void *param);
+msglog_t *msglog_open(char *name);
+void msglog_close(msglog_t *log);
+int msglog_append(msglog_t *log, struct iovec *iov, int iovcnt);
+message_t *msglog_peek(msglog_t *log);
+void msglog_advance(msglog_t *log, message_t *msg);
+void msglog_commit(void);
+
+#endif
@@ -35,181 +35,443 @@
 #include "libsf/sf.h"
 #include "msgqueue.h"
 
-typedef struct {
-    unsigned  mmh_len;
-} msgqueue_msghdr_t;
+static msgqueue_segment_t *msgqueue_segment_alloc(void);
+static void msgqueue_segment_free(msgqueue_segment_t *seg);
+static int msgqueue_charge(msgqueue_t *self, size_t len);
+static int msgqueue_push_msg(msgqueue_t *self, message_t *msg);
+static int msgqueue_enqueue(msgqueue_t *self, message_t *msg, message_t *tag, void *owner, int force);
+static size_t msgqueue_entry_size(msgqueue_entry_t *ent);
+static size_t msgqueue_entry_len(msgqueue_entry_t *ent);
+static int msgqueue_skip_line(message_t *msg);
+static void msgqueue_wake(msgqueue_t *self);
+static void msgqueue_waiter_unlink(msgqueue_waiter_t *mw);
+
+/* drained segments are kept here and shared by all queues */
+static pthread_mutex_t MsgqueuePoolLock = PTHREAD_MUTEX_INITIALIZER;
+static msgqueue_segment_t *MsgqueuePool;
+static int MsgqueuePoolCount;
+
+static sf_pool_t MsgqueueObjPool = SF_POOL_INITIALIZER("msgqueue", msgqueue_t);
+
+/* broker-wide limit of bytes held by all queues, 0 means unlimited */
+static size_t MsgqueueBudget;
+static size_t MsgqueueUsage;
+
+/* waiter lists of all queues; taken after the queue lock */
+static pthread_mutex_t MsgqueueWaitLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the last queue a push of this thread found over its high-water mark */
+static __thread msgqueue_t *MsgqueueCongested;
 
-static int msgqueue_wnext(msgqueue_t *self);
-static int msgqueue_rnext(msgqueue_t *self);
-static int msgqueue_total_len(struct iovec *iov, int iovcnt);
-static int msgqueue_push_msg(msgqueue_t *self, struct iovec *iov, int iovcnt);
+void
+msgqueue_set_budget(size_t budget)
+{
+    MsgqueueBudget = budget;
+}
 
 msgqueue_t *
 msgqueue_create(size_t queue_size, void (*callback)(void *), void *param)
 {
-    int i;
     msgqueue_t *mq;
     
-    if ((mq = malloc(sizeof(*mq))) == NULL) {
-        plog(LOG_ERR, "%s: malloc() failed", __func__);
-        return NULL;
-    }
-
-    for (i = 0; i < NELEMS(mq->mq_pbuf); i++)
-        sf_pbuf_init(&mq->mq_pbuf[i], 0);
-
-    if (sf_pbuf_init(&mq->mq_pbuf[0], queue_size / MSGQUEUE_PBUFS) < 0) {
-        free(mq);
+    if ((mq = sf_pool_alloc(&MsgqueueObjPool)) == NULL) {
+        plog(LOG_ERR, "%s: sf_pool_alloc() failed", __func__);
         return NULL;
     }
 
     MSGSINK_INIT(&mq->mq_msgsink, msgqueue_push_msg);
-    mq->mq_pbuf_r = 0;
-    mq->mq_pbuf_w = 0;
     mq->mq_queue_total_size = queue_size;
+    mq->mq_hiwat = queue_size / 4 * 3;
+    mq->mq_lowat = queue_size / 4;
 
     mq->mq_push_callback = callback;
     mq->mq_push_cbparam = param;
+    pthread_mutex_init(&mq->mq_lock, NULL);
 
     plog(LOG_DEBUG, "%s: create new msgqueue %p, queue_size %zu", __func__, mq, mq->mq_queue_total_size);
 
     return mq;
 }
 
+/* called with the queue locked whenever an entry with an owner is popped */
 void
-msgqueue_destroy(msgqueue_t *self)
+msgqueue_set_pop_callback(msgqueue_t *self, void (*callback)(void *))
 {
-    int i;
+    self->mq_pop_callback = callback;
+}
 
+void
+msgqueue_destroy(msgqueue_t *self)
+{
     plog(LOG_DEBUG, "%s: destroy msgqueue %p", __func__, self);
 
-    for (i = 0; i < NELEMS(self->mq_pbuf); i++) {
-        plog(LOG_DEBUG, "%s: pbuf_release %p", __func__, &self->mq_pbuf[i]);
-        sf_pbuf_release(&self->mq_pbuf[i]);
-    }
+    msgqueue_lock(self);
+    msgqueue_wake(self);
+    msgqueue_unlock(self);
+
+    while (msgqueue_pop_msg(self) == 0)
+        ;
+
+    if (self->mq_head != NULL)
+        msgqueue_segment_free(self->mq_head);
+
+    pthread_mutex_destroy(&self->mq_lock);
+    sf_pool_free(&MsgqueueObjPool, self);
+}
+
+/* the producer side may run on another worker thread */
+void
+msgqueue_lock(msgqueue_t *self)
+{
+    pthread_mutex_lock(&self->mq_lock);
+}
 
-    free(self);
+void
+msgqueue_unlock(msgqueue_t *self)
+{
+    pthread_mutex_unlock(&self->mq_lock);
 }
 
 int
 msgqueue_peek(msgqueue_t *self, char **buf, int *len)
 {
-    sf_pbuf_t *pbuf;
-    msgqueue_msghdr_t *header;
+    message_t *msg;
 
-redo:
-    pbuf = &self->mq_pbuf[self->mq_pbuf_r];
-    if (sf_pbuf_data_len(pbuf) < sizeof(*header)) {
-        if (msgqueue_rnext(self) < 0)
-            return -1;
+    if (self->mq_head == NULL ||
+        (self->mq_head == self->mq_tail && self->mq_head_pos == self->mq_tail_pos))
+        return -1;
+
+    msg = self->mq_head->mqs_ents[self->mq_head_pos].mqe_msg;
+    *len = msg->msg_len;
+    *buf = msg->msg_ptr;
+
+    return 0;
+}
 
-        goto redo;
+/* the head message without taking a reference */
+message_t *
+msgqueue_head(msgqueue_t *self)
+{
+    if (self->mq_head == NULL ||
+        (self->mq_head == self->mq_tail && self->mq_head_pos == self->mq_tail_pos))
+        return NULL;
+
+    return self->mq_head->mqs_ents[self->mq_head_pos].mqe_msg;
+}
+
+/*
+ * gather queued messages from the head, at least one even if it exceeds
+ * the budget. returns the number of iovecs; a tagged message takes two.
+ */
+int
+msgqueue_peekv(msgqueue_t *self, struct iovec *iov, int iovmax, size_t budget)
+{
+    int count = 0, pos, skip;
+    size_t total = 0;
+    msgqueue_entry_t *ent;
+    msgqueue_segment_t *seg;
+
+    for (seg = self->mq_head, pos = self->mq_head_pos; seg != NULL && count + 2 <= iovmax; pos++) {
+        if (pos == MSGQUEUE_SEGMENT_MSGS) {
+            seg = seg->mqs_next;
+            pos = 0;
+            if (seg == NULL)
+                break;
+        }
+
+        if (seg == self->mq_tail && pos == self->mq_tail_pos)
+            break;
+
+        ent = &seg->mqs_ents[pos];
+        if (count > 0 && total + msgqueue_entry_len(ent) > budget)
+            break;
+
+        skip = 0;
+        if (ent->mqe_tag != NULL) {
+            iov[count].iov_base = ent->mqe_tag->msg_ptr;
+            iov[count].iov_len = ent->mqe_tag->msg_len;
+            count++;
+            skip = msgqueue_skip_line(ent->mqe_msg);
+        }
+
+        iov[count].iov_base = ent->mqe_msg->msg_ptr + skip;
+        iov[count].iov_len = ent->mqe_msg->msg_len - skip;
+        count++;
+
+        total += msgqueue_entry_len(ent);
     }
 
-    header = (msgqueue_msghdr_t *) sf_pbuf_head(pbuf);
-    *len = header->mmh_len;
-    *buf = (char *) (header + 1);
+    return count;
+}
+
+int
+msgqueue_pop_msg(msgqueue_t *self)
+{
+    size_t size;
+    msgqueue_entry_t *ent;
+    msgqueue_segment_t *seg;
+
+    if ((seg = self->mq_head) == NULL)
+        return -1;
+    if (seg == self->mq_tail && self->mq_head_pos == self->mq_tail_pos)
+        return -1;
+
+    ent = &seg->mqs_ents[self->mq_head_pos++];
+    size = msgqueue_entry_size(ent);
+    self->mq_queued_size -= size;
+    __sync_sub_and_fetch(&MsgqueueUsage, size);
+
+    message_unref(ent->mqe_msg);
+    if (ent->mqe_tag != NULL)
+        message_unref(ent->mqe_tag);
+    if (ent->mqe_owner != NULL && self->mq_pop_callback != NULL)
+        self->mq_pop_callback(ent->mqe_owner);
+    if (self->mq_waiters != NULL && self->mq_queued_size <= self->mq_lowat)
+        msgqueue_wake(self);
+
+    if (self->mq_head_pos == MSGQUEUE_SEGMENT_MSGS && seg != self->mq_tail) {
+        self->mq_head = seg->mqs_next;
+        self->mq_head_pos = 0;
+        msgqueue_segment_free(seg);
+    } else if (seg == self->mq_tail && self->mq_head_pos == self->mq_tail_pos) {
+        /* drained; give the last segment back too */
+        self->mq_head = self->mq_tail = NULL;
+        self->mq_head_pos = self->mq_tail_pos = 0;
+        msgqueue_segment_free(seg);
+    }
 
     return 0;
 }
 
+/* pop the messages fully covered by len bytes sent; returns the bytes sent of the new head */
+size_t
+msgqueue_consume(msgqueue_t *self, size_t len)
+{
+    size_t elen;
+
+    while (self->mq_head != NULL &&
+           (self->mq_head != self->mq_tail || self->mq_head_pos != self->mq_tail_pos)) {
+        elen = msgqueue_entry_len(&self->mq_head->mqs_ents[self->mq_head_pos]);
+        if (len < elen)
+            break;
+
+        len -= elen;
+        msgqueue_pop_msg(self);
+    }
+
+    return len;
+}
+
+/* entries of an owner that goes away stay queued, but no longer report their pop */
+void
+msgqueue_disown(msgqueue_t *self, void *owner)
+{
+    int pos;
+    msgqueue_segment_t *seg;
+
+    msgqueue_lock(self);
+
+    for (seg = self->mq_head, pos = self->mq_head_pos; seg != NULL; pos++) {
+        if (pos == MSGQUEUE_SEGMENT_MSGS) {
+            seg = seg->mqs_next;
+            pos = 0;
+            if (seg == NULL)
+                break;
+        }
+
+        if (seg == self->mq_tail && pos == self->mq_tail_pos)
+            break;
+
+        if (seg->mqs_ents[pos].mqe_owner == owner)
+            seg->mqs_ents[pos].mqe_owner = NULL;
+    }
+
+    msgqueue_unlock(self);
+}
+
+/* returns the queue and forgets it; call once before pushing to reset */
+msgqueue_t *
+msgqueue_congested(void)
+{
+    msgqueue_t *mq = MsgqueueCongested;
+
+    MsgqueueCongested = NULL;
+    return mq;
+}
+
+/* put back what msgqueue_congested() took */
+void
+msgqueue_set_congested(msgqueue_t *self)
+{
+    MsgqueueCongested = self;
+}
+
+/* mw_func is called once, with the queue locked, when the queue drains or goes away */
 int
-msgqueue_pop_msg(msgqueue_t *self)
+msgqueue_wait(msgqueue_t *self, msgqueue_waiter_t *mw)
 {
-    sf_pbuf_t *pbuf;
-    msgqueue_msghdr_t *header;
+    int r = -1;
 
-redo:
-    pbuf = &self->mq_pbuf[self->mq_pbuf_r];
-    if (sf_pbuf_data_len(pbuf) < sizeof(*header)) {
-        if (msgqueue_rnext(self) < 0)
-            return -1;
+    msgqueue_lock(self);
+
+    /* it may have drained already */
+    if (self->mq_queued_size > self->mq_lowat) {
+        pthread_mutex_lock(&MsgqueueWaitLock);
+
+        mw->mw_queue = self;
+        mw->mw_prev = NULL;
+        if ((mw->mw_next = self->mq_waiters) != NULL)
+            self->mq_waiters->mw_prev = mw;
+        self->mq_waiters = mw;
 
-        goto redo;
+        pthread_mutex_unlock(&MsgqueueWaitLock);
+        r = 0;
     }
 
-    header = (msgqueue_msghdr_t *) sf_pbuf_head(pbuf);
-    sf_pbuf_adjust(pbuf, sizeof(msgqueue_msghdr_t) + header->mmh_len);
+    msgqueue_unlock(self);
 
-    return 0;
+    return r;
 }
 
-static int
-msgqueue_wnext(msgqueue_t *self)
+/* the queue may be gone already, so it is not locked here */
+void
+msgqueue_unwait(msgqueue_waiter_t *mw)
 {
-    int wnext;
+    pthread_mutex_lock(&MsgqueueWaitLock);
 
-    wnext = (self->mq_pbuf_w + 1) % NELEMS(self->mq_pbuf);
+    if (mw->mw_queue != NULL)
+        msgqueue_waiter_unlink(mw);
 
-    if (sf_pbuf_buffer_len(&self->mq_pbuf[wnext]) != 0)
-        return -1;
-    if (sf_pbuf_init(&self->mq_pbuf[wnext], self->mq_queue_total_size / MSGQUEUE_PBUFS) < 0)
-        return -1;
+    pthread_mutex_unlock(&MsgqueueWaitLock);
+}
 
-    self->mq_pbuf_w = wnext;
+static msgqueue_segment_t *
+msgqueue_segment_alloc(void)
+{
+    msgqueue_segment_t *seg;
 
-    return 0;
+    pthread_mutex_lock(&MsgqueuePoolLock);
+
+    if ((seg = MsgqueuePool) != NULL) {
+        MsgqueuePool = seg->mqs_next;
+        MsgqueuePoolCount--;
+    }
+
+    pthread_mutex_unlock(&MsgqueuePoolLock);
+
+    if (seg == NULL && (seg = malloc(sizeof(*seg))) == NULL) {
+        plog(LOG_ERR, "%s: malloc() failed", __func__);
+        return NULL;
+    }
+
+    seg->mqs_next = NULL;
+
+    return seg;
+}
+
+static void
+msgqueue_segment_free(msgqueue_segment_t *seg)
+{
+    pthread_mutex_lock(&MsgqueuePoolLock);
+
+    if (MsgqueuePoolCount < MSGQUEUE_POOL_MAX) {
+        seg->mqs_next = MsgqueuePool;
+        MsgqueuePool = seg;
+        MsgqueuePoolCount++;
+        seg = NULL;
+    }
+
+    pthread_mutex_unlock(&MsgqueuePoolLock);
+
+    if (seg != NULL)
+        free(seg);
 }
 
 static int
-msgqueue_rnext(msgqueue_t *self)
+msgqueue_charge(msgqueue_t *self, size_t len)
 {
-    if (self->mq_pbuf_r == self->mq_pbuf_w)
+    if (self->mq_queued_size + len > self->mq_queue_total_size)
         return -1;
 
-    sf_pbuf_release(&self->mq_pbuf[self->mq_pbuf_r]);
-    self->mq_pbuf_r++;
-    self->mq_pbuf_r %= NELEMS(self->mq_pbuf);
+    if (__sync_add_and_fetch(&MsgqueueUsage, len) > MsgqueueBudget && MsgqueueBudget > 0) {
+        __sync_sub_and_fetch(&MsgqueueUsage, len);
+        return -1;
+    }
+
+    self->mq_queued_size += len;
 
     return 0;
 }
 
-static int
-msgqueue_total_len(struct iovec *iov, int iovcnt)
+/* replies to the session itself are never refused */
+int
+msgqueue_push_reply(msgqueue_t *self, message_t *msg)
 {
-    int i, len = 0;
+    return msgqueue_enqueue(self, msg, NULL, NULL, 1);
+}
 
-    for (i = 0; i < iovcnt; i++)
-        len += iov[i].iov_len;
+/* tag is sent in place of the first line of msg, see msgqueue_peekv() */
+int
+msgqueue_push_tagged(msgqueue_t *self, message_t *msg, message_t *tag, void *owner)
+{
+    return msgqueue_enqueue(self, msg, tag, owner, 0);
+}
 
-    return len;
+static int
+msgqueue_push_msg(msgqueue_t *self, message_t *msg)
+{
+    return msgqueue_enqueue(self, msg, NULL, NULL, 0);
 }
 
 static int
-msgqueue_push_msg(msgqueue_t *self, struct iovec *iov, int iovcnt)
+msgqueue_enqueue(msgqueue_t *self, message_t *msg, message_t *tag, void *owner, int force)
 {
-    int i, total_len;
-    sf_pbuf_t *pbuf;
-    msgqueue_msghdr_t header;
+    size_t size;
+    msgqueue_segment_t *seg;
+    msgqueue_entry_t *ent;
 
     plog(LOG_DEBUG, "%s: push message %p", __func__, self);
 
-    total_len = msgqueue_total_len(iov, iovcnt);
-    header.mmh_len = total_len;
+    size = msg->msg_len + ((tag != NULL) ? tag->msg_len : 0);
+
+    msgqueue_lock(self);
 
-    if (total_len > self->mq_queue_total_size / MSGQUEUE_PBUFS) {
-        plog(LOG_DEBUG, "%s: too big message size", __func__);
+    if (force) {
+        self->mq_queued_size += size;
+        __sync_add_and_fetch(&MsgqueueUsage, size);
+    } else if (msgqueue_charge(self, size) < 0) {
+        plog(LOG_DEBUG, "%s: not enough space", __func__);
+        MsgqueueCongested = self;
+        msgqueue_unlock(self);
         return -1;
     }
 
-redo:
-    pbuf = &self->mq_pbuf[self->mq_pbuf_w];
-    if (sf_pbuf_write_prepare(pbuf, sizeof(header) + total_len) < 0) {
-        if (msgqueue_wnext(self) < 0) {
-            plog(LOG_DEBUG, "%s: not enough space", __func__);
+    if (!force && self->mq_queued_size > self->mq_hiwat)
+        MsgqueueCongested = self;
+
+    if (self->mq_tail == NULL || self->mq_tail_pos == MSGQUEUE_SEGMENT_MSGS) {
+        if ((seg = msgqueue_segment_alloc()) == NULL) {
+            self->mq_queued_size -= size;
+            __sync_sub_and_fetch(&MsgqueueUsage, size);
+            msgqueue_unlock(self);
             return -1;
         }
 
-        goto redo;
+        if (self->mq_tail == NULL)
+            self->mq_head = seg;
+        else
+            self->mq_tail->mqs_next = seg;
+
+        self->mq_tail = seg;
+        self->mq_tail_pos = 0;
     }
 
-    if (sf_pbuf_write(pbuf, (char *) &header, sizeof(header)) < 0)
-        return -1;
+    ent = &self->mq_tail->mqs_ents[self->mq_tail_pos++];
+    ent->mqe_msg = message_ref(msg);
+    ent->mqe_tag = (tag != NULL) ? message_ref(tag) : NULL;
+    ent->mqe_owner = owner;
 
-    for (i = 0; i < iovcnt; i++) {
-        if (sf_pbuf_write(pbuf, iov[i].iov_base, iov[i].iov_len) < 0)
-            return -1;
-    }
+    msgqueue_unlock(self);
 
     plog(LOG_DEBUG, "%s: push ok", __func__);
 
@@ -218,3 +480,64 @@ redo:
 
     return 0;
 }
+
+/* bytes charged to the queue */
+static size_t
+msgqueue_entry_size(msgqueue_entry_t *ent)
+{
+    return ent->mqe_msg->msg_len + ((ent->mqe_tag != NULL) ? ent->mqe_tag->msg_len : 0);
+}
+
+/* bytes put on the wire */
+static size_t
+msgqueue_entry_len(msgqueue_entry_t *ent)
+{
+    if (ent->mqe_tag == NULL)
+        return ent->mqe_msg->msg_len;
+
+    return ent->mqe_tag->msg_len + ent->mqe_msg->msg_len - msgqueue_skip_line(ent->mqe_msg);
+}
+
+static int
+msgqueue_skip_line(message_t *msg)
+{
+    char *p;
+
+    if ((p = memchr(msg->msg_ptr, '\n', msg->msg_len)) == NULL)
+        return 0;
+
+    return p - msg->msg_ptr + 1;
+}
+
+static void
+msgqueue_wake(msgqueue_t *self)
+{
+    msgqueue_waiter_t *mw;
+
+    pthread_mutex_lock(&MsgqueueWaitLock);
+
+    while ((mw = self->mq_waiters) != NULL) {
+        msgqueue_waiter_unlink(mw);
+        mw->mw_func(mw->mw_param);
+    }
+
+    pthread_mutex_unlock(&MsgqueueWaitLock);
+}
+
+/* must be called with MsgqueueWaitLock held */
+static void
+msgqueue_waiter_unlink(msgqueue_waiter_t *mw)
+{
+    msgqueue_t *mq = mw->mw_queue;
+
+    if (mw->mw_prev != NULL)
+        mw->mw_prev->mw_next = mw->mw_next;
+    else
+        mq->mq_waiters = mw->mw_next;
+
+    if (mw->mw_next != NULL)
+        mw->mw_next->mw_prev = mw->mw_prev;
+
+    mw->mw_next = mw->mw_prev = NULL;
+    mw->mw_queue = NULL;
+}
@@ -29,25 +29,72 @@
  */
 #ifndef MSGQUEUE_H
 #define MSGQUEUE_H
+#include <pthread.h>
 #include "libsf/sf.h"
 #include "msgsink.h"
 
-#define MSGQUEUE_PBUFS  4
+#define MSGQUEUE_SEGMENT_MSGS   63
+#define MSGQUEUE_POOL_MAX       4096
+
+typedef struct msgqueue_segment msgqueue_segment_t;
+typedef struct msgqueue_waiter msgqueue_waiter_t;
+
+/* a tag replaces the first line of the message when it is sent */
+typedef struct {
+    message_t           *mqe_msg;
+    message_t           *mqe_tag;
+    void                *mqe_owner;   /* passed to the pop callback, or NULL */
+} msgqueue_entry_t;
+
+struct msgqueue_segment {
+    msgqueue_segment_t  *mqs_next;
+    msgqueue_entry_t     mqs_ents[MSGQUEUE_SEGMENT_MSGS];
+};
+
+/* a producer waiting for a queue to drain below its low-water mark */
+struct msgqueue_waiter {
+    msgqueue_waiter_t   *mw_next;
+    msgqueue_waiter_t   *mw_prev;
+    void                *mw_queue;   /* msgqueue_t waited on, NULL if not waiting */
+    void               (*mw_func)(void *param);
+    void                *mw_param;
+};
 
 typedef struct {
-    msgsink_t  mq_msgsink;
-    sf_pbuf_t  mq_pbuf[MSGQUEUE_PBUFS];
-    int        mq_pbuf_r;
-    int        mq_pbuf_w;
-    size_t     mq_queue_total_size;
-    void     (*mq_push_callback)(void *param);
-    void      *mq_push_cbparam;
+    msgsink_t            mq_msgsink;
+    msgqueue_segment_t  *mq_head;   /* segments are allocated on demand */
+    msgqueue_segment_t  *mq_tail;
+    int                  mq_head_pos;
+    int                  mq_tail_pos;
+    size_t               mq_queued_size;
+    size_t               mq_queue_total_size;
+    size_t               mq_hiwat;
+    size_t               mq_lowat;
+    msgqueue_waiter_t   *mq_waiters;
+    void               (*mq_push_callback)(void *param);
+    void                *mq_push_cbparam;
+    void               (*mq_pop_callback)(void *owner);
+    pthread_mutex_t      mq_lock;
 } msgqueue_t;
 
+void msgqueue_set_budget(size_t budget);
 msgqueue_t *msgqueue_create(size_t queue_size, void (*callback)(void *), void *param);
+void msgqueue_set_pop_callback(msgqueue_t *self, void (*callback)(void *));
 void msgqueue_destroy(msgqueue_t *self);
+void msgqueue_lock(msgqueue_t *self);
+void msgqueue_unlock(msgqueue_t *self);
 int msgqueue_peek(msgqueue_t *self, char **buf, int *len);
+int msgqueue_peekv(msgqueue_t *self, struct iovec *iov, int iovmax, size_t budget);
+message_t *msgqueue_head(msgqueue_t *self);
 int msgqueue_pop_msg(msgqueue_t *self);
+size_t msgqueue_consume(msgqueue_t *self, size_t len);
+int msgqueue_push_tagged(msgqueue_t *self, message_t *msg, message_t *tag, void *owner);
+void msgqueue_disown(msgqueue_t *self, void *owner);
+msgqueue_t *msgqueue_congested(void);
+void msgqueue_set_congested(msgqueue_t *self);
+int msgqueue_wait(msgqueue_t *self, msgqueue_waiter_t *mw);
+void msgqueue_unwait(msgqueue_waiter_t *mw);
+int msgqueue_push_reply(msgqueue_t *self, message_t *msg);
 
 #define MSGQUEUE_SINK(p)   (&(p)->mq_msgsink)
 
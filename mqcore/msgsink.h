@@ -29,12 +29,15 @@
  */
 #ifndef MSGSINK_H
 #define MSGSINK_H
-#include <sys/uio.h>
+#include "message.h"
 
-typedef int (msgsink_push_msg_t)(void *self, struct iovec *iov, int iovcnt);
+typedef int (msgsink_push_msg_t)(void *self, message_t *msg);
+typedef size_t (msgsink_load_t)(void *self);
 
 typedef struct {
     msgsink_push_msg_t  *ms_push_msg;
+    msgsink_load_t      *ms_load;     /* bytes taken but not consumed yet, or NULL */
+    int                  ms_weight;   /* share under weighted dispatch, 0 counts as 1 */
 } msgsink_t;
 
 #define MSGSINK_INIT(msgsink, func)   ((msgsink)->ms_push_msg = (msgsink_push_msg_t *) (func))
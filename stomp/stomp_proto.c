@@ -32,14 +32,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
 #include "libsf/sf.h"
 #include "mqcore/mqcore.h"
 #include "stomp_proto.h"
 #include "stomp_subr.h"
+#include "stomp_scan.h"
 
-#define STOMP_HEADERS_MAX       8
-#define STOMP_HEADER_LEN_MAX    80
 
 static int stomp_session_start(sf_t *sf, void *udata);
 static int stomp_session_end(sf_t *sf, void *udata);
@@ -91,12 +92,20 @@ static int stomp_connected_disconnect(sf_t *sf, void *udata, stomp_msg_t *msg);
 static int stomp_connected_send(sf_t *sf, void *udata, stomp_msg_t *msg);
 static int stomp_connected_subscribe(sf_t *sf, void *udata, stomp_msg_t *msg);
 static int stomp_connected_unsubscribe(sf_t *sf, void *udata, stomp_msg_t *msg);
+static int stomp_connected_ack(sf_t *sf, void *udata, stomp_msg_t *msg);
+static int stomp_connected_begin(sf_t *sf, void *udata, stomp_msg_t *msg);
+static int stomp_connected_commit(sf_t *sf, void *udata, stomp_msg_t *msg);
+static int stomp_connected_abort(sf_t *sf, void *udata, stomp_msg_t *msg);
 
 stomp_command_t StompCommandsInitial[] = {
     { STOMP_CONNECT,     "CONNECT",      STOMP_STATE_CONNECTED,  stomp_initial_connect,      },
 };
 
 stomp_command_t StompCommandsConnected[] = {
+    { STOMP_ABORT,       "ABORT",        STOMP_STATE_CONNECTED,  stomp_connected_abort       },
+    { STOMP_ACK,         "ACK",          STOMP_STATE_CONNECTED,  stomp_connected_ack         },
+    { STOMP_BEGIN,       "BEGIN",        STOMP_STATE_CONNECTED,  stomp_connected_begin       },
+    { STOMP_COMMIT,      "COMMIT",       STOMP_STATE_CONNECTED,  stomp_connected_commit      },
     { STOMP_DISCONNECT,  "DISCONNECT",   STOMP_STATE_INITIAL,    stomp_connected_disconnect  },
     { STOMP_SEND,        "SEND",         STOMP_STATE_CONNECTED,  stomp_connected_send        },
     { STOMP_SUBSCRIBE,   "SUBSCRIBE",    STOMP_STATE_CONNECTED,  stomp_connected_subscribe   },
@@ -116,18 +125,31 @@ struct stomp_msg {
     int               sm_len;
 };
 
+static int stomp_receipt_reply(sf_t *sf, stomp_msg_t *msg, uint64_t batch);
 static int stomp_read_header(char *buf, int bufmax, stomp_msg_t *msg, char *key);
+static int stomp_read_id(char *buf, int bufmax, stomp_msg_t *msg, char *key);
+static char *stomp_header_value(stomp_msg_t *msg, char *key, int *len);
 static char *stomp_find_header(stomp_msg_t *msg, char *key);
-static int stomp_parse(stomp_msg_t *msg, char *buf, int len, stomp_command_t *cmdtable, int numtable);
+static int stomp_parse(stomp_parser_t *sp, char *buf, int len);
+static void stomp_parse_line(stomp_parser_t *sp, char *buf, int end);
+static void stomp_parse_reset(stomp_parser_t *sp);
 static stomp_command_t *stomp_parse_command(char *buf, int len, stomp_command_t *cmdtable, int numtable);
-static void stomp_parse_lines(stomp_msg_t *msg, char *buf, int buflen);
-static char *stomp_next_line(char *buf, int buflen);
 static char *stomp_skip_command(char *buf);
-static int stomp_is_header(char *buf);
 static int stomp_make_connected(char *buf, int bufmax, unsigned session_id);
-static int stomp_make_message(char *buf, int bufmax, unsigned message_id);
+static int stomp_make_message(char *buf, int bufmax, uint64_t message_id);
+static int stomp_make_receipt(char *buf, int bufmax, char *receipt_id);
+static uint32_t stomp_message_group(message_t *msg);
 
-static unsigned SessionId, MessageId;
+static unsigned SessionId;
+static uint64_t MessageId;
+
+/* ids are seeded from the clock so messages recovered from disk never share one with new ones */
+void
+stomp_init(void)
+{
+    MessageId = (uint64_t) time(NULL) << 24;
+    binding_set_group_func(stomp_message_group);
+}
 
 static int
 stomp_session_start(sf_t *sf, void *udata)
@@ -155,25 +177,23 @@ static int
 stomp_msg_estimlen(sf_t *sf, char *buf, int len, void *udata)
 {
     int est_len;
-    char *p, clen[256];
-    stomp_msg_t msg;
+    stomp_parser_t tmp, *sp;
 
-    if (stomp_parse(&msg, buf, len, NULL, 0) < 0) {
-        plog(LOG_DEBUG, "%s: stomp_parse() failed", __func__);
-        return -1;
+    if ((sp = stomp_get_parser(sf)) == NULL) {
+        stomp_parse_reset(&tmp);
+        sp = &tmp;
     }
 
-    if (stomp_read_header(clen, sizeof(clen), &msg, "content-length:") < 0)
-        return -1;
+    stomp_parse(sp, buf, len);
 
-    est_len = strtol(clen, &p, 10);
-    if (*p != '\n' && *p != '\r' && *p != 0)
-        return -1;
-    if (msg.sm_body == NULL || msg.sm_buf == NULL)
+    if (sp->sp_state < STOMP_PARSE_BODY || sp->sp_clen < 0)
         return -1;
 
-    /* message body size + header size + terminator size */
-    est_len += (msg.sm_body - msg.sm_buf) + 1;
+    /* message body size + header size + terminator size; no buffer takes more */
+    if ((size_t) sp->sp_body + sp->sp_clen + 1 > INT_MAX)
+        return INT_MAX;
+
+    est_len = sp->sp_body + sp->sp_clen + 1;
 
     plog(LOG_DEBUG, "%s: estimated message length = %d", __func__, est_len);
 
@@ -183,30 +203,22 @@ stomp_msg_estimlen(sf_t *sf, char *buf, int len, void *udata)
 static int
 stomp_msg_length(sf_t *sf, char *buf, int len, void *udata)
 {
-    int i, clen;
-
-    if ((clen = stomp_msg_estimlen(sf, buf, len, udata)) > 0) {
-        if (len >= clen) {
-            if (buf[clen - 1] != 0)
-                return -1;
-            else
-                return clen;
-        }
-    } else {
-        for (i = 0; i < len; i++) {
-            if (buf[i] == 0)
-                return i + 1;
-        }
+    stomp_parser_t tmp, *sp;
+
+    if ((sp = stomp_get_parser(sf)) == NULL) {
+        stomp_parse_reset(&tmp);
+        sp = &tmp;
     }
 
-    return -1;
+    return stomp_parse(sp, buf, len);
 }
 
 static int
 stomp_msg_input(sf_t *sf, char *buf, int len, void *udata)
 {
-    int state;
+    int i, state;
     stomp_msg_t msg;
+    stomp_parser_t tmp, *sp;
     stomp_command_tables_t *t;
 
     if (udata == NULL) {
@@ -214,13 +226,41 @@ stomp_msg_input(sf_t *sf, char *buf, int len, void *udata)
         return -1;
     }
 
+    if ((sp = stomp_get_parser(sf)) == NULL) {
+        stomp_parse_reset(&tmp);
+        sp = &tmp;
+    }
+
+    if (stomp_parse(sp, buf, len) != len) {
+        plog(LOG_ERR, "%s: incomplete frame", __func__);
+        stomp_parse_reset(sp);
+        return -1;
+    }
+
+    if (sp->sp_nhdr > STOMP_HEADERS_MAX) {
+        plog(LOG_ERR, "%s: too many headers (%d)", __func__, sp->sp_nhdr);
+        stomp_parse_reset(sp);
+        return -1;
+    }
+
     state = stomp_get_state(sf);
     t = &StompCommands[state];
 
     plog(LOG_DEBUG, "%s: [input] state = %d, buf = >>>\n%s<<<", __func__, state, buf);
 
-    if (stomp_parse(&msg, buf, len, t->sct_cmds, t->sct_num) < 0) {
-        plog(LOG_ERR, "%s: stomp_parse() failed", __func__);
+    memset(&msg, 0, sizeof(msg));
+    msg.sm_buf = buf + sp->sp_cmd;
+    msg.sm_len = len - sp->sp_cmd;
+    msg.sm_body = buf + sp->sp_body;
+
+    for (i = 0; i < sp->sp_nhdr; i++)
+        msg.sm_hdr[i] = buf + sp->sp_hdr[i];
+
+    /* the handler may destroy the session data, parser included */
+    stomp_parse_reset(sp);
+
+    if ((msg.sm_cmd = stomp_parse_command(msg.sm_buf, msg.sm_len, t->sct_cmds, t->sct_num)) == NULL) {
+        plog(LOG_ERR, "%s: unknown command", __func__);
         return -1;
     }
 
@@ -243,7 +283,7 @@ stomp_initial_connect(sf_t *sf, void *udata, stomp_msg_t *msg)
     int len;
     char buf[256];
 
-    len = stomp_make_connected(buf, sizeof(buf), ++SessionId);
+    len = stomp_make_connected(buf, sizeof(buf), __sync_add_and_fetch(&SessionId, 1));
     if (sf_send(sf, buf, len + 1) < 0) {
         plog(LOG_ERR, "%s: xp_send() failed", __func__);
         return -1;
@@ -264,11 +304,13 @@ stomp_connected_disconnect(sf_t *sf, void *udata, stomp_msg_t *msg)
 static int
 stomp_connected_send(sf_t *sf, void *udata, stomp_msg_t *msg)
 {
-    int header_len, body_len;
-    char dest[256], header[256], *body;
+    int r, header_len, body_len, dest_len;
+    uint64_t batch = 0;
+    char header[256], tx[64], *dest, *body;
     struct iovec iov[2];
 
-    if (stomp_read_header(dest, sizeof(dest), msg, "destination:") < 0) {
+    /* not copied; stomp_enqueue() resolves it through the session's destination cache */
+    if ((dest = stomp_header_value(msg, "destination:", &dest_len)) == NULL) {
         plog(LOG_ERR, "%s: destination header is not found", __func__);
         return -1;
     }
@@ -278,7 +320,7 @@ stomp_connected_send(sf_t *sf, void *udata, stomp_msg_t *msg)
         return -1;
     }
 
-    header_len = stomp_make_message(header, sizeof(header), ++MessageId);
+    header_len = stomp_make_message(header, sizeof(header), __sync_add_and_fetch(&MessageId, 1));
     body_len = (msg->sm_len - (body - msg->sm_buf));
 
     iov[0].iov_base = header;
@@ -286,61 +328,244 @@ stomp_connected_send(sf_t *sf, void *udata, stomp_msg_t *msg)
     iov[1].iov_base = body;
     iov[1].iov_len = body_len;
 
-    return stomp_enqueue(sf, dest, iov, NELEMS(iov));
+    if ((r = stomp_read_id(tx, sizeof(tx), msg, "transaction:")) == 0)
+        r = stomp_tx_send(sf, tx, dest, dest_len, iov, NELEMS(iov));
+    else if (r == -1)
+        r = stomp_enqueue(sf, dest, dest_len, iov, NELEMS(iov), &batch);
+
+    if (r < 0)
+        return -1;
+
+    return stomp_receipt_reply(sf, msg, batch);
 }
 
 static int
 stomp_connected_subscribe(sf_t *sf, void *udata, stomp_msg_t *msg)
 {
-    char dest[256];
+    int r;
+    char dest[256], id[64], ack[32], dispatch[32], buf[32];
+    stomp_subopts_t opts;
 
     if (stomp_read_header(dest, sizeof(dest), msg, "destination:") < 0) {
         plog(LOG_ERR, "%s: destination header is not found", __func__);
         return -1;
     }
 
-    return stomp_subscribe(sf, dest);
+    memset(&opts, 0, sizeof(opts));
+    opts.sso_id = id;
+    opts.sso_dispatch = dispatch;
+
+    /* without an id, the destination names the subscription (STOMP 1.0) */
+    if ((r = stomp_read_id(id, sizeof(id), msg, "id:")) == -2)
+        return -1;
+    if (r < 0)
+        id[0] = 0;
+
+    if (stomp_read_header(ack, sizeof(ack), msg, "ack:") < 0 || strcmp(ack, "auto") == 0)
+        opts.sso_ack = STOMP_ACKMODE_AUTO;
+    else if (strcmp(ack, "client") == 0)
+        opts.sso_ack = STOMP_ACKMODE_CLIENT;
+    else if (strcmp(ack, "client-individual") == 0)
+        opts.sso_ack = STOMP_ACKMODE_CLIENT_INDIVIDUAL;
+    else {
+        plog(LOG_ERR, "%s: unknown ack mode \"%s\"", __func__, ack);
+        return -1;
+    }
+
+    /* messages a queue subscriber may have outstanding, 0: unlimited */
+    if (stomp_read_header(buf, sizeof(buf), msg, "prefetch-count:") == 0 && (opts.sso_prefetch = atoi(buf)) < 0)
+        opts.sso_prefetch = 0;
+
+    if (stomp_read_header(buf, sizeof(buf), msg, "weight:") == 0 && (opts.sso_weight = atoi(buf)) < 0)
+        opts.sso_weight = 0;
+
+    /* round-robin, least-outstanding, weighted or hash (on message-group:) */
+    if (stomp_read_header(dispatch, sizeof(dispatch), msg, "dispatch:") < 0)
+        dispatch[0] = 0;
+
+    if (stomp_subscribe(sf, dest, &opts) < 0)
+        return -1;
+
+    return stomp_receipt_reply(sf, msg, 0);
 }
 
 static int
 stomp_connected_unsubscribe(sf_t *sf, void *udata, stomp_msg_t *msg)
 {
-    char dest[256];
+    int r;
+    char dest[256], id[64];
+
+    if ((r = stomp_read_id(id, sizeof(id), msg, "id:")) == -2)
+        return -1;
+    if (r < 0)
+        id[0] = 0;
 
     if (stomp_read_header(dest, sizeof(dest), msg, "destination:") < 0) {
-        plog(LOG_ERR, "%s: destination header is not found", __func__);
+        if (id[0] == 0) {
+            plog(LOG_ERR, "%s: neither id nor destination header is found", __func__);
+            return -1;
+        }
+        dest[0] = 0;
+    }
+
+    if (stomp_unsubscribe(sf, dest, id) < 0)
+        return -1;
+
+    return stomp_receipt_reply(sf, msg, 0);
+}
+
+static int
+stomp_connected_ack(sf_t *sf, void *udata, stomp_msg_t *msg)
+{
+    int r;
+    char sub[64], id[64], tx[64];
+
+    /* STOMP 1.2 names the message by id: */
+    if (stomp_read_header(id, sizeof(id), msg, "message-id:") < 0 &&
+        stomp_read_header(id, sizeof(id), msg, "id:") < 0) {
+        plog(LOG_ERR, "%s: message-id header is not found", __func__);
         return -1;
     }
 
-    return stomp_unsubscribe(sf, dest);
+    if ((r = stomp_read_id(sub, sizeof(sub), msg, "subscription:")) == -2)
+        return -1;
+    if (r < 0)
+        sub[0] = 0;
+
+    if ((r = stomp_read_id(tx, sizeof(tx), msg, "transaction:")) == -2)
+        return -1;
+    if (r < 0)
+        tx[0] = 0;
+
+    if (stomp_ack(sf, sub, strtoull(id, NULL, 10), tx) < 0)
+        return -1;
+
+    return stomp_receipt_reply(sf, msg, 0);
+}
+
+static int
+stomp_connected_begin(sf_t *sf, void *udata, stomp_msg_t *msg)
+{
+    char tx[64];
+
+    if (stomp_read_id(tx, sizeof(tx), msg, "transaction:") < 0) {
+        plog(LOG_ERR, "%s: no valid transaction header", __func__);
+        return -1;
+    }
+
+    if (stomp_begin(sf, tx) < 0)
+        return -1;
+
+    return stomp_receipt_reply(sf, msg, 0);
+}
+
+static int
+stomp_connected_commit(sf_t *sf, void *udata, stomp_msg_t *msg)
+{
+    uint64_t batch = 0;
+    char tx[64];
+
+    if (stomp_read_id(tx, sizeof(tx), msg, "transaction:") < 0) {
+        plog(LOG_ERR, "%s: no valid transaction header", __func__);
+        return -1;
+    }
+
+    if (stomp_commit(sf, tx, &batch) < 0)
+        return -1;
+
+    return stomp_receipt_reply(sf, msg, batch);
+}
+
+static int
+stomp_connected_abort(sf_t *sf, void *udata, stomp_msg_t *msg)
+{
+    char tx[64];
+
+    if (stomp_read_id(tx, sizeof(tx), msg, "transaction:") < 0) {
+        plog(LOG_ERR, "%s: no valid transaction header", __func__);
+        return -1;
+    }
+
+    if (stomp_abort(sf, tx) < 0)
+        return -1;
+
+    return stomp_receipt_reply(sf, msg, 0);
+}
+
+/* answer a receipt: header, once the commit batch it depends on is on disk */
+static int
+stomp_receipt_reply(sf_t *sf, stomp_msg_t *msg, uint64_t batch)
+{
+    int len;
+    char receipt[256], reply[320];
+
+    if (stomp_read_header(receipt, sizeof(receipt), msg, "receipt:") < 0)
+        return 0;
+
+    /* the frame terminator is sent too */
+    len = stomp_make_receipt(reply, sizeof(reply), receipt) + 1;
+
+    return stomp_receipt(sf, reply, len, batch);
 }
 
 static int
 stomp_read_header(char *buf, int bufmax, stomp_msg_t *msg, char *key)
+{
+    int len;
+    char *p;
+
+    if ((p = stomp_header_value(msg, key, &len)) == NULL)
+        return -1;
+
+    if (len > bufmax - 1)
+        len = bufmax - 1;
+
+    memcpy(buf, p, len);
+    buf[len] = 0;
+
+    return 0;
+}
+
+/* ids are compared whole, so one too long for buf is refused (-2) rather than cut */
+static int
+stomp_read_id(char *buf, int bufmax, stomp_msg_t *msg, char *key)
+{
+    int len;
+    char *p;
+
+    if ((p = stomp_header_value(msg, key, &len)) == NULL)
+        return -1;
+
+    if (len > bufmax - 1) {
+        plog(LOG_ERR, "%s: %s value too long (%d bytes)", __func__, key, len);
+        return -2;
+    }
+
+    memcpy(buf, p, len);
+    buf[len] = 0;
+
+    return 0;
+}
+
+/* the value as it lies in the frame; it is not terminated */
+static char *
+stomp_header_value(stomp_msg_t *msg, char *key, int *len)
 {
     char *p, *hdr;
 
     if ((hdr = stomp_find_header(msg, key)) == NULL)
-        return -1;
+        return NULL;
 
     if ((p = strchr(hdr, ':')) == NULL)
-        return -1;
+        return NULL;
 
     for (p++; isspace(*p); p++)
         ;
 
-    while (*p != '\n' && *p != '\r' && *p != 0) {
-        if (bufmax <= 1) 
-            break;
-        else {
-            *buf = *p;
-            buf++; p++;
-        }
-    }
-
-    *buf = 0;
+    for (*len = 0; p[*len] != '\n' && p[*len] != '\r' && p[*len] != 0; (*len)++)
+        ;
 
-    return 0;
+    return p;
 }
 
 static char *
@@ -357,78 +582,130 @@ stomp_find_header(stomp_msg_t *msg, char *key)
     return NULL;
 }
 
+/*
+ * scan the frame from where the previous call stopped. returns the frame
+ * length once the terminator is seen, -1 while more data is needed.
+ */
 static int
-stomp_parse(stomp_msg_t *msg, char *buf, int len, stomp_command_t *cmdtable, int numtable)
+stomp_parse(stomp_parser_t *sp, char *buf, int len)
 {
-    memset(msg, 0, sizeof(*msg));
-    msg->sm_buf = buf;
-    msg->sm_len = len;
-    stomp_parse_lines(msg, buf, len);
+    char *p;
 
-    if (cmdtable != NULL) {
-        if ((msg->sm_cmd = stomp_parse_command(buf, len, cmdtable, numtable)) == NULL)
-            return -1;
+    while (sp->sp_state != STOMP_PARSE_DONE && sp->sp_off < len) {
+        switch (sp->sp_state) {
+        case STOMP_PARSE_COMMAND:
+            /* skip heart-beats and line breaks left by the previous frame */
+            if (buf[sp->sp_off] == '\n' || buf[sp->sp_off] == '\r') {
+                sp->sp_off++;
+                break;
+            }
+
+            sp->sp_cmd = sp->sp_line = sp->sp_off;
+            sp->sp_state = STOMP_PARSE_HEADER;
+            break;
+
+        case STOMP_PARSE_HEADER:
+            if ((sp->sp_off += stomp_scan_eol(buf + sp->sp_off, len - sp->sp_off)) == len)
+                break;
+
+            if (buf[sp->sp_off] == 0) {
+                /* no blank line before the terminator */
+                sp->sp_body = sp->sp_off;
+                sp->sp_len = sp->sp_off + 1;
+                sp->sp_state = STOMP_PARSE_DONE;
+                break;
+            }
+
+            stomp_parse_line(sp, buf, sp->sp_off);
+            sp->sp_off++;
+            break;
+
+        case STOMP_PARSE_BODY:
+            if (sp->sp_clen >= 0) {
+                if ((size_t) len < (size_t) sp->sp_body + sp->sp_clen + 1)
+                    return -1;
+                if (buf[sp->sp_body + sp->sp_clen] == 0) {
+                    sp->sp_len = sp->sp_body + sp->sp_clen + 1;
+                    sp->sp_state = STOMP_PARSE_DONE;
+                    break;
+                }
+
+                /* content-length is wrong; look for the terminator instead */
+                sp->sp_clen = -1;
+            }
+
+            if ((p = memchr(buf + sp->sp_off, 0, len - sp->sp_off)) == NULL) {
+                sp->sp_off = len;
+                break;
+            }
+
+            sp->sp_off = p - buf;
+            sp->sp_len = sp->sp_off + 1;
+            sp->sp_state = STOMP_PARSE_DONE;
+            break;
+        }
     }
 
-    return 0;
+    return (sp->sp_state == STOMP_PARSE_DONE) ? sp->sp_len : -1;
 }
 
-static stomp_command_t *
-stomp_parse_command(char *buf, int len, stomp_command_t *cmdtable, int numtable)
+static void
+stomp_parse_line(stomp_parser_t *sp, char *buf, int end)
 {
-    int i, l;
+    int len;
+    long clen;
+    char *p, *line;
 
-    for (i = 0; i < numtable; i++) {
-        if ((l = strlen(cmdtable[i].sc_str)) > len)
-            continue;
-        if (strncmp(cmdtable[i].sc_str, buf, l) == 0)
-            return &cmdtable[i];
+    line = buf + sp->sp_line;
+    len = end - sp->sp_line;
+    sp->sp_line = end + 1;
+
+    if (len > 0 && line[len - 1] == '\r')
+        len--;
+
+    if (line == buf + sp->sp_cmd)
+        return;
+
+    if (len == 0) {
+        sp->sp_body = end + 1;
+        sp->sp_state = STOMP_PARSE_BODY;
+        return;
     }
 
-    return NULL;
+    /* counted past the limit, so stomp_msg_input() can refuse the frame */
+    if (sp->sp_nhdr < STOMP_HEADERS_MAX)
+        sp->sp_hdr[sp->sp_nhdr] = line - buf;
+    sp->sp_nhdr++;
+
+    if (len > 15 && strncmp(line, "content-length:", 15) == 0) {
+        clen = strtol(line + 15, &p, 10);
+        if ((*p != '\n' && *p != '\r') || clen < 0)
+            sp->sp_clen = -1;
+        else if (clen > INT_MAX)
+            sp->sp_clen = INT_MAX;   /* too large for any buffer, see stomp_msg_estimlen() */
+        else
+            sp->sp_clen = (int) clen;
+    }
 }
 
 static void
-stomp_parse_lines(stomp_msg_t *msg, char *buf, int buflen)
+stomp_parse_reset(stomp_parser_t *sp)
 {
-    int count = 0;
-    char *p, *next;
-
-    for (p = stomp_next_line(buf, buflen); p != NULL; p = next) {
-        next = stomp_next_line(p, buflen - (p - buf));
-
-        if (count < NELEMS(msg->sm_hdr)) {
-            if (stomp_is_header(p))
-                msg->sm_hdr[count++] = p;
-            else {
-                msg->sm_body = p;
-                return;
-            }
-        }
-    }
+    memset(sp, 0, sizeof(*sp));
+    sp->sp_state = STOMP_PARSE_COMMAND;
+    sp->sp_clen = -1;
 }
 
-static char *
-stomp_next_line(char *buf, int buflen)
+static stomp_command_t *
+stomp_parse_command(char *buf, int len, stomp_command_t *cmdtable, int numtable)
 {
-    int i, flag = 0;
+    int i, l;
 
-    for (i = 0; i < buflen; i++) {
-        if (buf[i] == '\r' || buf[i] == '\n') {
-            flag = 1;
+    for (i = 0; i < numtable; i++) {
+        if ((l = strlen(cmdtable[i].sc_str)) > len)
             continue;
-        }
-
-        if (flag) {
-            switch (buf[i]) {
-            case '\r':
-            case '\n':
-                continue;
-
-            default:
-                return &buf[i];
-            }
-        }
+        if (strncmp(cmdtable[i].sc_str, buf, l) == 0)
+            return &cmdtable[i];
     }
 
     return NULL;
@@ -445,21 +722,6 @@ stomp_skip_command(char *buf)
     return p + 1;
 }
 
-static int
-stomp_is_header(char *buf)
-{
-    int i;
-
-    for (i = 0; i < STOMP_HEADER_LEN_MAX; i++, buf++) {
-        if (*buf == '\n' || *buf == '\r' || *buf == 0)
-            break;
-        if (*buf == ':')
-            return 1;
-    }
-
-    return 0;
-}
-
 static int
 stomp_make_connected(char *buf, int bufmax, unsigned session_id)
 {
@@ -469,9 +731,46 @@ stomp_make_connected(char *buf, int bufmax, unsigned session_id)
 }
 
 static int
-stomp_make_message(char *buf, int bufmax, unsigned message_id)
+stomp_make_message(char *buf, int bufmax, uint64_t message_id)
 {
     return snprintf(buf, bufmax,
                     "MESSAGE\n"
-                    "message-id:%u\n", message_id);
+                    "message-id:%llu\n", (unsigned long long) message_id);
+}
+
+static int
+stomp_make_receipt(char *buf, int bufmax, char *receipt_id)
+{
+    return snprintf(buf, bufmax,
+                    "RECEIPT\n"
+                    "receipt-id:%s\n\n", receipt_id);
+}
+
+/* hash of the message-group: header for hash dispatch, 0 if there is none */
+static uint32_t
+stomp_message_group(message_t *msg)
+{
+    char *p, *end, *eol;
+    uint32_t hash = 2166136261U;
+
+    end = msg->msg_ptr + msg->msg_len;
+
+    for (p = msg->msg_ptr; p < end; p = eol + 1) {
+        if ((eol = memchr(p, '\n', end - p)) == NULL)
+            break;
+        if (eol == p || (eol == p + 1 && *p == '\r'))
+            break;   /* end of headers */
+
+        if (eol - p > 14 && memcmp(p, "message-group:", 14) == 0) {
+            /* FNV-1a hash */
+            for (p += 14; p < eol && *p != '\r'; p++) {
+                hash ^= *((unsigned char *) p);
+                hash *= 16777619;
+            }
+
+            return (hash == 0) ? 1 : hash;
+        }
+    }
+
+    return 0;
 }
@@ -35,4 +35,6 @@
 
 extern sf_protocb_t StompProtoCB;
 
+void stomp_init(void);
+
 #endif
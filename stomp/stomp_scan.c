@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "libsf/sf.h"
+#include "stomp_scan.h"
+
+/*
+ * find the end of a header line: the first '\n' or NUL in buf. returns
+ * its offset, or len if there is none. the vector versions are chosen
+ * at the first call by the cpu features.
+ */
+
+static int stomp_scan_eol_resolve(char *buf, int len);
+static int stomp_scan_eol_scalar(char *buf, int len);
+#ifdef __SSE2__
+static int stomp_scan_eol_sse2(char *buf, int len);
+static int stomp_scan_eol_avx2(char *buf, int len) __attribute__((target("avx2")));
+#endif
+
+static int (*StompScanEol)(char *buf, int len) = stomp_scan_eol_resolve;
+
+int
+stomp_scan_eol(char *buf, int len)
+{
+    return StompScanEol(buf, len);
+}
+
+static int
+stomp_scan_eol_resolve(char *buf, int len)
+{
+    int (*func)(char *, int) = stomp_scan_eol_scalar;
+
+#ifdef __SSE2__
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        func = stomp_scan_eol_avx2;
+    else
+        func = stomp_scan_eol_sse2;
+#endif
+
+    StompScanEol = func;
+    return func(buf, len);
+}
+
+static int
+stomp_scan_eol_scalar(char *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] == '\n' || buf[i] == 0)
+            break;
+    }
+
+    return i;
+}
+
+#ifdef __SSE2__
+static int
+stomp_scan_eol_sse2(char *buf, int len)
+{
+    int i, mask;
+    __m128i v, nl = _mm_set1_epi8('\n'), zero = _mm_setzero_si128();
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((__m128i *) (buf + i));
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, zero)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + stomp_scan_eol_scalar(buf + i, len - i);
+}
+
+static int
+stomp_scan_eol_avx2(char *buf, int len)
+{
+    int i;
+    unsigned mask;
+    __m256i v, nl = _mm256_set1_epi8('\n'), zero = _mm256_setzero_si256();
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((__m256i *) (buf + i));
+        mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, zero)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + stomp_scan_eol_sse2(buf + i, len - i);
+}
+#endif
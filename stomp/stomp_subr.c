@@ -36,16 +36,136 @@
 #include "mqcore/mqcore.h"
 #include "stomp_subr.h"
 
+#define STOMP_SEND_IOV      64
+#define STOMP_SEND_BUDGET   (256 * 1024)
+#define STOMP_DEST_CACHE    4
+#define STOMP_SUBID_MAX     64
+#define STOMP_TXID_MAX      64
+
+typedef struct stomp_receipt stomp_receipt_t;
+
+/* a RECEIPT held back until the write it answers is on disk */
+struct stomp_receipt {
+    stomp_receipt_t  *sr_next;
+    uint64_t          sr_batch;
+    message_t        *sr_msg;
+};
+
+/* a destination this session sent to recently, valid while the binding hash generations match */
 typedef struct {
+    unsigned      sd_gen;
+    unsigned      sd_add_gen;   /* only checked for a miss */
+    int           sd_len;
+    binding_t    *sd_bind;   /* NULL if no binding had the name */
+    char          sd_name[BINDING_NAME_MAX];
+} stomp_dest_t;
+
+typedef struct stomp_data stomp_data_t;
+typedef struct stomp_sub stomp_sub_t;
+typedef struct stomp_inflight stomp_inflight_t;
+typedef struct stomp_tx stomp_tx_t;
+typedef struct stomp_txop stomp_txop_t;
+
+/* delivered to a client-ack subscription, not acknowledged yet */
+struct stomp_inflight {
+    stomp_inflight_t  *si_next;
+    stomp_inflight_t  *si_prev;
+    uint64_t           si_id;
+    message_t         *si_msg;
+};
+
+/* one SUBSCRIBE; all subscriptions of a session feed the same msgqueue */
+struct stomp_sub {
+    msgsink_t     su_msgsink;
+    stomp_sub_t  *su_next;
+    stomp_data_t *su_ss;
+    binding_t    *su_bind;
+    message_t    *su_tag;    /* "MESSAGE\nsubscription:<id>\n", NULL without an id */
+    int           su_ack;    /* STOMP_ACKMODE_* */
+    int           su_prefetch;          /* credit of a queue subscription, 0: unlimited */
+    int           su_queued;            /* auto-ack messages not written yet */
+    int           su_inflight_count;
+    size_t        su_inflight_bytes;
+    stomp_inflight_t  *su_inflight_head;   /* in delivery order */
+    stomp_inflight_t  *su_inflight_tail;
+    char          su_id[STOMP_SUBID_MAX];
+};
+
+/* a SEND or ACK held until its transaction commits */
+struct stomp_txop {
+    stomp_txop_t  *so_next;
+    message_t     *so_msg;        /* MESSAGE frame of a SEND, NULL for an ACK */
+    uint64_t       so_id;         /* message-id of an ACK */
+    char           so_name[256];  /* destination of a SEND, subscription of an ACK */
+};
+
+struct stomp_tx {
+    stomp_tx_t    *st_next;
+    stomp_txop_t  *st_head;
+    stomp_txop_t  *st_tail;
+    char           st_id[STOMP_TXID_MAX];
+};
+
+struct stomp_data {
     int           ss_state;
-    binding_t    *ss_bind;
+    sf_t         *ss_sf;
+    stomp_sub_t  *ss_subs;
+    stomp_tx_t   *ss_txs;
     msgqueue_t   *ss_msgq;
-    char         *ss_sbuf;
-    int           ss_slen;
-} stomp_data_t;
+    int           ss_credit;   /* a subscription got credit back while sending */
+    int           ss_soff;   /* bytes of the head message already sent */
+    stomp_parser_t  ss_parser;
+    stomp_receipt_t  *ss_receipt_head;
+    stomp_receipt_t  *ss_receipt_tail;
+    stomp_data_t     *ss_wait_next;   /* sessions of this thread with held receipts */
+    stomp_data_t     *ss_wait_prev;
+    msgqueue_waiter_t  ss_blocked;   /* input is paused until this queue drains */
+    int               ss_dest_next;   /* cache slot to replace next */
+    stomp_dest_t      ss_dest[STOMP_DEST_CACHE];
+};
 
+static int stomp_subscribe0(sf_t *sf, char *dest, stomp_subopts_t *opts);
+static int stomp_unsubscribe0(sf_t *sf, char *dest, char *id);
+static void stomp_ack0(stomp_data_t *ss, char *sub_id, uint64_t msg_id);
+static stomp_sub_t *stomp_sub_create(stomp_data_t *ss, char *id, int ack, int prefetch);
+static void stomp_sub_destroy(stomp_data_t *ss, stomp_sub_t *sub);
+static stomp_sub_t *stomp_sub_find(stomp_data_t *ss, binding_t *bi, char *id);
+static int stomp_sub_push_msg(stomp_sub_t *self, message_t *msg);
+static void stomp_sub_popped(void *owner);
+static size_t stomp_sub_load(stomp_sub_t *self);
+static int stomp_inflight_ack(stomp_sub_t *sub, uint64_t msg_id);
+static void stomp_inflight_release(stomp_sub_t *sub, stomp_inflight_t *si);
+static void stomp_redeliver(binding_t *bi, message_t *msg);
+static uint64_t stomp_message_id(message_t *msg);
+static stomp_tx_t *stomp_tx_find(stomp_data_t *ss, char *tx);
+static int stomp_tx_add(stomp_data_t *ss, char *tx, char *name, message_t *msg, uint64_t msg_id);
+static void stomp_tx_destroy(stomp_data_t *ss, stomp_tx_t *st);
+static int stomp_enqueue0(sf_t *sf, char *dest, binding_t *bi, struct iovec *iov, int iovcnt, uint64_t *batch);
+static stomp_dest_t *stomp_dest_lookup(stomp_data_t *ss, char *dest, int dest_len);
+static int stomp_reply(sf_t *sf, stomp_data_t *ss, message_t *msg);
+static int stomp_create_msgq(sf_t *sf, stomp_data_t *ss);
+static void stomp_wait_unlink(stomp_data_t *ss);
+static int stomp_send_resume0(sf_t *sf, stomp_data_t *ss);
 static binding_t *stomp_new_binding(char *dest, msgsink_t *sink);
 static void stomp_push_notify(void *param);
+static void stomp_unblock_notify(void *param);
+
+static size_t StompQueueSize = 1024 * 1024 * 8;
+static sf_pool_t StompDataPool = SF_POOL_INITIALIZER("stomp", stomp_data_t);
+static sf_pool_t StompReceiptPool = SF_POOL_INITIALIZER("receipt", stomp_receipt_t);
+static sf_pool_t StompSubPool = SF_POOL_INITIALIZER("subscription", stomp_sub_t);
+static sf_pool_t StompInflightPool = SF_POOL_INITIALIZER("inflight", stomp_inflight_t);
+static sf_pool_t StompTxPool = SF_POOL_INITIALIZER("transaction", stomp_tx_t);
+static sf_pool_t StompTxopPool = SF_POOL_INITIALIZER("txop", stomp_txop_t);
+
+/* each worker thread releases the receipts of its own sessions */
+static __thread stomp_data_t *StompWaitList;
+
+void
+stomp_set_queue_size(size_t size)
+{
+    StompQueueSize = size;
+}
 
 int
 stomp_create_session(sf_t *sf)
@@ -53,11 +173,15 @@ stomp_create_session(sf_t *sf)
     stomp_data_t *ss;
 
     if (sf_get_udata(sf) == NULL) {
-        if ((ss = (stomp_data_t *) calloc(1, sizeof(stomp_data_t))) == NULL) {
-            plog(LOG_DEBUG, "%s: calloc() failed", __func__);
+        if ((ss = (stomp_data_t *) sf_pool_alloc(&StompDataPool)) == NULL) {
+            plog(LOG_DEBUG, "%s: sf_pool_alloc() failed", __func__);
             return -1;
         }
 
+        ss->ss_sf = sf;
+        ss->ss_parser.sp_clen = -1;
+        ss->ss_blocked.mw_func = stomp_unblock_notify;
+        ss->ss_blocked.mw_param = sf;
         sf_set_udata(sf, ss);
     }
 
@@ -68,22 +192,38 @@ void
 stomp_destroy_session(sf_t *sf)
 {
     stomp_data_t *ss;
+    stomp_receipt_t *sr;
 
     if ((ss = (stomp_data_t *) sf_get_udata(sf)) == NULL)
         return;
 
-    if (ss->ss_bind != NULL) {
-        binding_unsubscribe(ss->ss_bind, MSGQUEUE_SINK(ss->ss_msgq));
-        ss->ss_bind = NULL;
+    msgqueue_unwait(&ss->ss_blocked);
+
+    while ((sr = ss->ss_receipt_head) != NULL) {
+        ss->ss_receipt_head = sr->sr_next;
+        message_unref(sr->sr_msg);
+        sf_pool_free(&StompReceiptPool, sr);
     }
 
+    stomp_wait_unlink(ss);
+
+    while (ss->ss_txs != NULL)
+        stomp_tx_destroy(ss, ss->ss_txs);
+
+    binding_lock();
+
+    while (ss->ss_subs != NULL)
+        stomp_sub_destroy(ss, ss->ss_subs);
+
+    binding_unlock();
+
     if (ss->ss_msgq != NULL) {
         msgqueue_destroy(ss->ss_msgq);
         ss->ss_msgq = NULL;
     }
 
     sf_set_udata(sf, NULL);
-    free(ss);
+    sf_pool_free(&StompDataPool, ss);
 }
 
 int
@@ -95,6 +235,15 @@ stomp_get_state(sf_t *sf)
     return (ss == NULL) ? -1 : ss->ss_state;
 }
 
+stomp_parser_t *
+stomp_get_parser(sf_t *sf)
+{
+    stomp_data_t *ss;
+
+    ss = (stomp_data_t *) sf_get_udata(sf);
+    return (ss == NULL) ? NULL : &ss->ss_parser;
+}
+
 void
 stomp_set_state(sf_t *sf, int state)
 {
@@ -105,143 +254,964 @@ stomp_set_state(sf_t *sf, int state)
 }
 
 int
-stomp_subscribe(sf_t *sf, char *dest)
+stomp_subscribe(sf_t *sf, char *dest, stomp_subopts_t *opts)
 {
-    binding_t *bi;
+    int r;
+
+    binding_lock();
+    r = stomp_subscribe0(sf, dest, opts);
+    binding_unlock();
+
+    return r;
+}
+
+/* a subscription is found by id if given, otherwise by dest */
+int
+stomp_unsubscribe(sf_t *sf, char *dest, char *id)
+{
+    int r;
+
+    binding_lock();
+    r = stomp_unsubscribe0(sf, dest, id);
+    binding_unlock();
+
+    return r;
+}
+
+/* dest is not terminated; *batch is set to the commit batch a receipt has to wait for */
+int
+stomp_enqueue(sf_t *sf, char *dest, int dest_len, struct iovec *iov, int iovcnt, uint64_t *batch)
+{
+    int r;
+    char name[256];
     msgqueue_t *mq;
     stomp_data_t *ss;
+    stomp_dest_t *sd;
 
-    if ((ss = (stomp_data_t *) sf_get_udata(sf)) == NULL) {
-        plog(LOG_ERR, "%s: udata == NULL. why?", __func__);
+    if ((ss = (stomp_data_t *) sf_get_udata(sf)) == NULL)
         return -1;
+
+    msgqueue_congested();
+    binding_lock_shared();
+
+    if ((sd = stomp_dest_lookup(ss, dest, dest_len)) != NULL)
+        r = stomp_enqueue0(sf, sd->sd_name, sd->sd_bind, iov, iovcnt, batch);
+    else {
+        /* too long to cache */
+        if (dest_len > sizeof(name) - 1)
+            dest_len = sizeof(name) - 1;
+
+        memcpy(name, dest, dest_len);
+        name[dest_len] = 0;
+
+        r = stomp_enqueue0(sf, name, binding_hash_lookup(&BindingHash, name), iov, iovcnt, batch);
     }
 
-    if (ss->ss_bind != NULL) {
-        plog(LOG_ERR, "%s: XXX only one subscription is allowed per connection", __func__);
+    /*
+     * stop reading from the producer while a queue it filled is over
+     * its high-water mark; the queue is still alive under the shared binding lock
+     */
+    if ((mq = msgqueue_congested()) != NULL && ss->ss_blocked.mw_queue == NULL) {
+        if (msgqueue_wait(mq, &ss->ss_blocked) == 0 && sf_pause_input(sf) < 0)
+            plog(LOG_ERR, "%s: sf_pause_input() failed", __func__);
+    }
+
+    binding_unlock();
+
+    return r;
+}
+
+/* tx is the transaction id, or NULL */
+int
+stomp_ack(sf_t *sf, char *sub_id, uint64_t msg_id, char *tx)
+{
+    stomp_data_t *ss;
+
+    if ((ss = (stomp_data_t *) sf_get_udata(sf)) == NULL)
+        return -1;
+
+    if (tx != NULL && *tx != 0)
+        return stomp_tx_add(ss, tx, sub_id, NULL, msg_id);
+
+    binding_lock_shared();
+    stomp_ack0(ss, sub_id, msg_id);
+    binding_unlock();
+
+    return 0;
+}
+
+int
+stomp_begin(sf_t *sf, char *tx)
+{
+    stomp_data_t *ss;
+    stomp_tx_t *st;
+
+    if ((ss = (stomp_data_t *) sf_get_udata(sf)) == NULL)
+        return -1;
+
+    if (stomp_tx_find(ss, tx) != NULL) {
+        plog(LOG_ERR, "%s: transaction \"%s\" is already begun", __func__, tx);
         return -1;
     }
 
-    if ((mq = ss->ss_msgq) == NULL) {
-        if ((mq = msgqueue_create(1024 * 1024 * 8, /* XXX */
-                                  stomp_push_notify, sf)) == NULL) {
-            plog(LOG_ERR, "%s: msgqueue_create() failed", __func__);
+    if ((st = sf_pool_alloc(&StompTxPool)) == NULL) {
+        plog(LOG_ERR, "%s: sf_pool_alloc() failed", __func__);
+        return -1;
+    }
+
+    snprintf(st->st_id, sizeof(st->st_id), "%s", tx);
+    st->st_next = ss->ss_txs;
+    ss->ss_txs = st;
+
+    return 0;
+}
+
+/* a SEND in a transaction is copied and enqueued on COMMIT */
+int
+stomp_tx_send(sf_t *sf, char *tx, char *dest, int dest_len, struct iovec *iov, int iovcnt)
+{
+    char name[256];
+    message_t *msg;
+    stomp_data_t *ss;
+
+    if ((ss = (stomp_data_t *) sf_get_udata(sf)) == NULL)
+        return -1;
+
+    if ((msg = message_create(iov, iovcnt)) == NULL) {
+        plog(LOG_ERR, "%s: message_create() failed", __func__);
+        return -1;
+    }
+
+    if (dest_len > sizeof(name) - 1)
+        dest_len = sizeof(name) - 1;
+
+    memcpy(name, dest, dest_len);
+    name[dest_len] = 0;
+
+    if (stomp_tx_add(ss, tx, name, msg, 0) < 0) {
+        message_unref(msg);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+stomp_commit(sf_t *sf, char *tx, uint64_t *batch)
+{
+    uint64_t b;
+    struct iovec iov;
+    stomp_data_t *ss;
+    stomp_tx_t *st;
+    stomp_txop_t *so;
+
+    if ((ss = (stomp_data_t *) sf_get_udata(sf)) == NULL)
+        return -1;
+
+    if ((st = stomp_tx_find(ss, tx)) == NULL) {
+        plog(LOG_ERR, "%s: no such transaction \"%s\"", __func__, tx);
+        return -1;
+    }
+
+    for (so = st->st_head; so != NULL; so = so->so_next) {
+        if (so->so_msg == NULL) {
+            binding_lock_shared();
+            stomp_ack0(ss, so->so_name, so->so_id);
+            binding_unlock();
+            continue;
+        }
+
+        iov.iov_base = so->so_msg->msg_ptr;
+        iov.iov_len = so->so_msg->msg_len;
+
+        b = 0;
+        if (stomp_enqueue(sf, so->so_name, strlen(so->so_name), &iov, 1, &b) < 0)
+            plog(LOG_ERR, "%s: stomp_enqueue() failed", __func__);
+        if (b > *batch)
+            *batch = b;
+    }
+
+    stomp_tx_destroy(ss, st);
+
+    return 0;
+}
+
+int
+stomp_abort(sf_t *sf, char *tx)
+{
+    stomp_data_t *ss;
+    stomp_tx_t *st;
+
+    if ((ss = (stomp_data_t *) sf_get_udata(sf)) == NULL)
+        return -1;
+
+    if ((st = stomp_tx_find(ss, tx)) == NULL) {
+        plog(LOG_ERR, "%s: no such transaction \"%s\"", __func__, tx);
+        return -1;
+    }
+
+    stomp_tx_destroy(ss, st);
+
+    return 0;
+}
+
+/* receipts go out in order, so one held back holds back the rest */
+int
+stomp_receipt(sf_t *sf, char *buf, int len, uint64_t batch)
+{
+    int r;
+    struct iovec iov;
+    message_t *msg;
+    stomp_data_t *ss;
+    stomp_receipt_t *sr;
+
+    if ((ss = (stomp_data_t *) sf_get_udata(sf)) == NULL)
+        return -1;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    if ((msg = message_create(&iov, 1)) == NULL) {
+        plog(LOG_ERR, "%s: message_create() failed", __func__);
+        return -1;
+    }
+
+    if (ss->ss_receipt_tail != NULL && batch < ss->ss_receipt_tail->sr_batch)
+        batch = ss->ss_receipt_tail->sr_batch;
+
+    if (batch <= msgcommit_committed()) {
+        r = stomp_reply(sf, ss, msg);
+        message_unref(msg);
+        return r;
+    }
+
+    if ((sr = sf_pool_alloc(&StompReceiptPool)) == NULL) {
+        plog(LOG_ERR, "%s: sf_pool_alloc() failed", __func__);
+        message_unref(msg);
+        return -1;
+    }
+
+    sr->sr_batch = batch;
+    sr->sr_msg = msg;
+
+    if (ss->ss_receipt_tail == NULL) {
+        ss->ss_receipt_head = ss->ss_receipt_tail = sr;
+
+        ss->ss_wait_prev = NULL;
+        if ((ss->ss_wait_next = StompWaitList) != NULL)
+            StompWaitList->ss_wait_prev = ss;
+        StompWaitList = ss;
+    } else {
+        ss->ss_receipt_tail->sr_next = sr;
+        ss->ss_receipt_tail = sr;
+    }
+
+    msgcommit_watch(sf->sf_inst);
+
+    return 0;
+}
+
+/* called at the end of every loop iteration */
+void
+stomp_release_receipts(void)
+{
+    uint64_t done;
+    stomp_data_t *ss, *next;
+    stomp_receipt_t *sr;
+
+    if (StompWaitList == NULL)
+        return;
+
+    done = msgcommit_committed();
+
+    for (ss = StompWaitList; ss != NULL; ss = next) {
+        next = ss->ss_wait_next;
+
+        while ((sr = ss->ss_receipt_head) != NULL && sr->sr_batch <= done) {
+            if ((ss->ss_receipt_head = sr->sr_next) == NULL)
+                ss->ss_receipt_tail = NULL;
+
+            if (stomp_reply(ss->ss_sf, ss, sr->sr_msg) < 0)
+                plog(LOG_ERR, "%s: stomp_reply() failed", __func__);
+
+            message_unref(sr->sr_msg);
+            sf_pool_free(&StompReceiptPool, sr);
+        }
+
+        if (ss->ss_receipt_head == NULL)
+            stomp_wait_unlink(ss);
+        else
+            msgcommit_watch(ss->ss_sf->sf_inst);
+    }
+}
+
+int
+stomp_send_resume(sf_t *sf)
+{
+    int r;
+    stomp_data_t *ss;
+    stomp_sub_t *sub;
+
+    if ((ss = (stomp_data_t *) sf_get_udata(sf)) == NULL)
+        return -1;
+
+    if (ss->ss_msgq == NULL) {
+        plog(LOG_ERR, "%s: no msgq. why?", __func__);
+        return -1;
+    }
+
+    r = stomp_send_resume0(sf, ss);
+
+    /* drained, or some subscription has credit again; queues may hold more for us */
+    if (r > 0 || ss->ss_credit) {
+        ss->ss_credit = 0;
+        binding_lock_shared();
+
+        for (sub = ss->ss_subs; sub != NULL; sub = sub->su_next) {
+            if (sub->su_bind->bi_flags & BINDING_F_QUEUE)
+                binding_resume(sub->su_bind);
+        }
+
+        binding_unlock();
+    }
+
+    return (r < 0) ? -1 : 0;
+}
+
+static int
+stomp_subscribe0(sf_t *sf, char *dest, stomp_subopts_t *opts)
+{
+    int prefetch;
+    char *id = opts->sso_id;
+    binding_t *bi;
+    stomp_data_t *ss;
+    stomp_sub_t *sub;
+
+    if ((ss = (stomp_data_t *) sf_get_udata(sf)) == NULL) {
+        plog(LOG_ERR, "%s: udata == NULL. why?", __func__);
+        return -1;
+    }
+
+    bi = binding_hash_lookup(&BindingHash, dest);
+
+    if (id != NULL && *id != 0) {
+        if (stomp_sub_find(ss, NULL, id) != NULL) {
+            plog(LOG_ERR, "%s: subscription id \"%s\" is already used", __func__, id);
             return -1;
         }
+    } else if (bi != NULL && stomp_sub_find(ss, bi, NULL) != NULL) {
+        plog(LOG_DEBUG, "%s: binding \"%s\" is already subscribed", __func__, dest);
+        return 0;   /* silent discard */
+    }
+
+    if (ss->ss_msgq == NULL && stomp_create_msgq(sf, ss) < 0) {
+        plog(LOG_ERR, "%s: stomp_create_msgq() failed", __func__);
+        return -1;
     }
 
-    if ((bi = binding_hash_lookup(&BindingHash, dest)) != NULL) {
-        if (binding_subscribe(bi, MSGQUEUE_SINK(mq)) < 0) {
+    /* topics have no backlog to keep what a subscriber has no credit for */
+    prefetch = (strncmp(dest, "/queue/", 7) == 0) ? opts->sso_prefetch : 0;
+
+    if ((sub = stomp_sub_create(ss, id, opts->sso_ack, prefetch)) == NULL) {
+        plog(LOG_ERR, "%s: stomp_sub_create() failed", __func__);
+        return -1;
+    }
+
+    sub->su_msgsink.ms_weight = opts->sso_weight;
+
+    if (bi != NULL) {
+        if (binding_subscribe(bi, &sub->su_msgsink) < 0) {
             plog(LOG_ERR, "%s: can't subscribe binding \"%s\"", __func__, dest);
-            msgqueue_destroy(mq);
-            ss->ss_msgq = NULL;
+            stomp_sub_destroy(ss, sub);
             return -1;
         }
     } else {
-        if ((bi = stomp_new_binding(dest, MSGQUEUE_SINK(mq))) == NULL) {
+        if ((bi = stomp_new_binding(dest, &sub->su_msgsink)) == NULL) {
             plog(LOG_ERR, "%s: can't create new binding \"%s\"", __func__, dest);
-            msgqueue_destroy(mq);
-            ss->ss_msgq = NULL;
+            stomp_sub_destroy(ss, sub);
             return -1;
         }
     }
 
-    ss->ss_bind = bi;
-    ss->ss_msgq = mq;
+    sub->su_bind = bi;
+
+    if (opts->sso_dispatch != NULL && *opts->sso_dispatch != 0 &&
+        binding_queue_set_policy(bi, opts->sso_dispatch) < 0)
+        plog(LOG_ERR, "%s: can't set dispatch policy \"%s\" on \"%s\"", __func__, opts->sso_dispatch, dest);
+
+    /* deliver what a durable queue has kept */
+    binding_resume(bi);
 
     return 0;
 }
 
-int
-stomp_unsubscribe(sf_t *sf, char *dest)
+static int
+stomp_unsubscribe0(sf_t *sf, char *dest, char *id)
 {
-    binding_t *bi;
+    binding_t *bi = NULL;
     stomp_data_t *ss;
+    stomp_sub_t *sub;
 
     if ((ss = (stomp_data_t *) sf_get_udata(sf)) == NULL) {
         plog(LOG_ERR, "%s: udata == NULL. why?", __func__);
         return -1;
     }
 
-    if ((bi = binding_hash_lookup(&BindingHash, dest)) == NULL) {
-        plog(LOG_DEBUG, "%s: can't find binding \"%s\"", __func__, dest);
-        return 0;   /* silent discard */
+    if (id == NULL || *id == 0) {
+        if (dest == NULL || (bi = binding_hash_lookup(&BindingHash, dest)) == NULL) {
+            plog(LOG_DEBUG, "%s: can't find binding \"%s\"", __func__, (dest == NULL) ? "" : dest);
+            return 0;   /* silent discard */
+        }
     }
 
-    if (ss->ss_bind != bi) {
-        plog(LOG_DEBUG, "%s: binding \"%s\" is not bound for this session", __func__, dest);
+    if ((sub = stomp_sub_find(ss, bi, id)) == NULL) {
+        plog(LOG_DEBUG, "%s: no such subscription in this session", __func__);
         return 0;   /* silent discard */
     }
 
-    if (ss->ss_msgq == NULL) {
-        plog(LOG_DEBUG, "%s: this session has no message queue", __func__);
-        return 0;   /* silent discard */
+    stomp_sub_destroy(ss, sub);
+
+    return 0;
+}
+
+/* must be called with the shared binding lock held; a subscription's deliveries are under its binding */
+static void
+stomp_ack0(stomp_data_t *ss, char *sub_id, uint64_t msg_id)
+{
+    int r = -1;
+    stomp_sub_t *sub;
+
+    if (sub_id != NULL && *sub_id != 0) {
+        if ((sub = stomp_sub_find(ss, NULL, sub_id)) != NULL) {
+            binding_enter(sub->su_bind);
+            r = stomp_inflight_ack(sub, msg_id);
+            binding_leave(sub->su_bind);
+        }
+    } else {
+        /* without a subscription header, any subscription that has it in flight */
+        for (sub = ss->ss_subs; sub != NULL; sub = sub->su_next) {
+            binding_enter(sub->su_bind);
+            r = stomp_inflight_ack(sub, msg_id);
+            binding_leave(sub->su_bind);
+
+            if (r == 0)
+                break;
+        }
     }
 
-    binding_unsubscribe(bi, MSGQUEUE_SINK(ss->ss_msgq));
-    ss->ss_bind = NULL;
+    if (r < 0) {
+        plog(LOG_DEBUG, "%s: message %llu is not in flight", __func__, (unsigned long long) msg_id);
+        return;   /* silent discard */
+    }
 
-    return 0;
+    /* the window has moved */
+    if (sub->su_prefetch > 0)
+        binding_resume(sub->su_bind);
 }
 
-int
-stomp_enqueue(sf_t *sf, char *dest, struct iovec *iov, int iovcnt)
+static stomp_sub_t *
+stomp_sub_create(stomp_data_t *ss, char *id, int ack, int prefetch)
 {
+    char buf[STOMP_SUBID_MAX + 32];
+    struct iovec iov;
+    stomp_sub_t *sub;
+
+    if ((sub = sf_pool_alloc(&StompSubPool)) == NULL) {
+        plog(LOG_ERR, "%s: sf_pool_alloc() failed", __func__);
+        return NULL;
+    }
+
+    MSGSINK_INIT(&sub->su_msgsink, stomp_sub_push_msg);
+    sub->su_msgsink.ms_load = (msgsink_load_t *) stomp_sub_load;
+    sub->su_ss = ss;
+    sub->su_ack = ack;
+    sub->su_prefetch = prefetch;
+
+    if (id != NULL && *id != 0) {
+        snprintf(sub->su_id, sizeof(sub->su_id), "%s", id);
+
+        /* stamped on every MESSAGE of this subscription, see msgqueue_peekv() */
+        iov.iov_base = buf;
+        iov.iov_len = snprintf(buf, sizeof(buf), "MESSAGE\nsubscription:%s\n", sub->su_id);
+
+        if ((sub->su_tag = message_create(&iov, 1)) == NULL) {
+            plog(LOG_ERR, "%s: message_create() failed", __func__);
+            sf_pool_free(&StompSubPool, sub);
+            return NULL;
+        }
+    }
+
+    sub->su_next = ss->ss_subs;
+    ss->ss_subs = sub;
+
+    return sub;
+}
+
+/* must be called with the exclusive binding lock held */
+static void
+stomp_sub_destroy(stomp_data_t *ss, stomp_sub_t *sub)
+{
+    int redeliver = 0;
     binding_t *bi;
+    stomp_sub_t **p;
+    stomp_inflight_t *si;
 
-    if ((bi = binding_hash_lookup(&BindingHash, dest)) == NULL) {
-        plog(LOG_DEBUG, "%s: discard message due to no binding found", __func__);
-        return 0;   /* silent discard */
+    for (p = &ss->ss_subs; *p != NULL; p = &(*p)->su_next) {
+        if (*p == sub) {
+            *p = sub->su_next;
+            break;
+        }
     }
 
-    if (binding_push_msg(bi, iov, iovcnt) < 0) {
-        plog(LOG_DEBUG, "%s: binding_push_msg() failed", __func__);
-        return 0;   /* silent discard */
+    if ((bi = sub->su_bind) != NULL) {
+        /* unacknowledged queue messages go to another member, if the binding outlives us */
+        redeliver = (sub->su_inflight_head != NULL && strncmp(bi->bi_name, "/queue/", 7) == 0 &&
+                     ((bi->bi_flags & BINDING_F_DURABLE) || bi->bi_members_count > 1));
+
+        binding_unsubscribe(bi, &sub->su_msgsink);
+    }
+
+    if (sub->su_ack == STOMP_ACKMODE_AUTO && sub->su_prefetch > 0)
+        msgqueue_disown(ss->ss_msgq, sub);
+
+    while ((si = sub->su_inflight_head) != NULL) {
+        if (redeliver)
+            stomp_redeliver(bi, si->si_msg);
+
+        stomp_inflight_release(sub, si);
+    }
+
+    /* queued messages keep their own reference to the tag */
+    if (sub->su_tag != NULL)
+        message_unref(sub->su_tag);
+
+    sf_pool_free(&StompSubPool, sub);
+}
+
+/* by id if given, otherwise the first subscription to bi */
+static stomp_sub_t *
+stomp_sub_find(stomp_data_t *ss, binding_t *bi, char *id)
+{
+    stomp_sub_t *sub;
+
+    for (sub = ss->ss_subs; sub != NULL; sub = sub->su_next) {
+        if (id != NULL && *id != 0) {
+            if (strcmp(sub->su_id, id) == 0)
+                return sub;
+        } else if (sub->su_bind == bi)
+            return sub;
+    }
+
+    return NULL;
+}
+
+static int
+stomp_sub_push_msg(stomp_sub_t *self, message_t *msg)
+{
+    int outstanding;
+    stomp_inflight_t *si;
+
+    /* out of credit; the queue binding keeps the message for another subscriber */
+    if (self->su_prefetch > 0) {
+        outstanding = (self->su_ack == STOMP_ACKMODE_AUTO) ? self->su_queued : self->su_inflight_count;
+        if (outstanding >= self->su_prefetch)
+            return -1;
+    }
+
+    if (self->su_ack == STOMP_ACKMODE_AUTO) {
+        if (self->su_prefetch == 0)
+            return msgqueue_push_tagged(self->su_ss->ss_msgq, msg, self->su_tag, NULL);
+
+        /* counted until written, see stomp_sub_popped() */
+        __sync_add_and_fetch(&self->su_queued, 1);
+
+        if (msgqueue_push_tagged(self->su_ss->ss_msgq, msg, self->su_tag, self) < 0) {
+            __sync_sub_and_fetch(&self->su_queued, 1);
+            return -1;
+        }
+
+        return 0;
     }
 
+    if ((si = sf_pool_alloc(&StompInflightPool)) == NULL) {
+        plog(LOG_ERR, "%s: sf_pool_alloc() failed", __func__);
+        return -1;
+    }
+
+    if (msgqueue_push_tagged(self->su_ss->ss_msgq, msg, self->su_tag, NULL) < 0) {
+        sf_pool_free(&StompInflightPool, si);
+        return -1;
+    }
+
+    si->si_id = stomp_message_id(msg);
+    si->si_msg = message_ref(msg);
+
+    if ((si->si_prev = self->su_inflight_tail) != NULL)
+        self->su_inflight_tail->si_next = si;
+    else
+        self->su_inflight_head = si;
+
+    self->su_inflight_tail = si;
+    self->su_inflight_count++;
+    self->su_inflight_bytes += msg->msg_len;
+
     return 0;
 }
 
-int
-stomp_send_resume(sf_t *sf)
+/* called with the session queue locked as an auto-ack message of a prefetch window is written */
+static void
+stomp_sub_popped(void *owner)
 {
-    int sent_len;
-    stomp_data_t *ss;
+    stomp_sub_t *sub = owner;
 
-    if ((ss = (stomp_data_t *) sf_get_udata(sf)) == NULL)
+    if (__sync_sub_and_fetch(&sub->su_queued, 1) < sub->su_prefetch)
+        sub->su_ss->ss_credit = 1;
+}
+
+/* outstanding bytes for least-outstanding dispatch: unacknowledged, or not yet written */
+static size_t
+stomp_sub_load(stomp_sub_t *self)
+{
+    if (self->su_ack != STOMP_ACKMODE_AUTO)
+        return self->su_inflight_bytes;
+
+    /* the whole connection's backlog; read without the lock, it is only a hint */
+    return self->su_ss->ss_msgq->mq_queued_size;
+}
+
+/* client mode acknowledges everything delivered up to msg_id, client-individual just msg_id */
+static int
+stomp_inflight_ack(stomp_sub_t *sub, uint64_t msg_id)
+{
+    stomp_inflight_t *si, *head;
+
+    /* acks mostly arrive in delivery order, so this ends near the head */
+    for (si = sub->su_inflight_head; si != NULL; si = si->si_next) {
+        if (si->si_id == msg_id)
+            break;
+    }
+
+    if (si == NULL)
         return -1;
 
-    if (ss->ss_msgq == NULL) {
-        plog(LOG_ERR, "%s: no msgq. why?", __func__);
+    if (sub->su_ack == STOMP_ACKMODE_CLIENT_INDIVIDUAL) {
+        stomp_inflight_release(sub, si);
+        return 0;
+    }
+
+    do {
+        head = sub->su_inflight_head;
+        stomp_inflight_release(sub, head);
+    } while (head != si);
+
+    return 0;
+}
+
+static void
+stomp_inflight_release(stomp_sub_t *sub, stomp_inflight_t *si)
+{
+    if (si->si_prev != NULL)
+        si->si_prev->si_next = si->si_next;
+    else
+        sub->su_inflight_head = si->si_next;
+
+    if (si->si_next != NULL)
+        si->si_next->si_prev = si->si_prev;
+    else
+        sub->su_inflight_tail = si->si_prev;
+
+    sub->su_inflight_count--;
+    sub->su_inflight_bytes -= si->si_msg->msg_len;
+
+    message_unref(si->si_msg);
+    sf_pool_free(&StompInflightPool, si);
+}
+
+static void
+stomp_redeliver(binding_t *bi, message_t *msg)
+{
+    int r;
+    uint64_t batch;
+    struct iovec iov;
+
+    /* a durable queue takes it back into its log; the old record is done with once released */
+    if (bi->bi_flags & BINDING_F_DURABLE) {
+        iov.iov_base = msg->msg_ptr;
+        iov.iov_len = msg->msg_len;
+        r = binding_append(bi, &iov, 1, &batch);
+    } else
+        r = binding_push_msg(bi, msg);
+
+    if (r < 0)
+        plog(LOG_DEBUG, "%s: can't redeliver message to \"%s\"", __func__, bi->bi_name);
+}
+
+/* the message-id stomp_make_message() put on the second line */
+static uint64_t
+stomp_message_id(message_t *msg)
+{
+    char *p;
+
+    if ((p = memchr(msg->msg_ptr, '\n', msg->msg_len)) == NULL)
+        return 0;
+
+    if (msg->msg_ptr + msg->msg_len - p < 13 || strncmp(p + 1, "message-id:", 11) != 0)
+        return 0;
+
+    return strtoull(p + 12, NULL, 10);
+}
+
+static stomp_tx_t *
+stomp_tx_find(stomp_data_t *ss, char *tx)
+{
+    stomp_tx_t *st;
+
+    for (st = ss->ss_txs; st != NULL; st = st->st_next) {
+        if (strcmp(st->st_id, tx) == 0)
+            return st;
+    }
+
+    return NULL;
+}
+
+static int
+stomp_tx_add(stomp_data_t *ss, char *tx, char *name, message_t *msg, uint64_t msg_id)
+{
+    stomp_tx_t *st;
+    stomp_txop_t *so;
+
+    if ((st = stomp_tx_find(ss, tx)) == NULL) {
+        plog(LOG_ERR, "%s: no such transaction \"%s\"", __func__, tx);
         return -1;
     }
 
-    plog(LOG_DEBUG, "%s: msgq = %p", __func__, ss->ss_msgq);
+    if ((so = sf_pool_alloc(&StompTxopPool)) == NULL) {
+        plog(LOG_ERR, "%s: sf_pool_alloc() failed", __func__);
+        return -1;
+    }
 
-    if (ss->ss_slen == 0) {
-        if (msgqueue_peek(ss->ss_msgq, &ss->ss_sbuf, &ss->ss_slen) < 0) {
-            plog(LOG_DEBUG, "%s: queue empty", __func__);
-            return 0;
+    so->so_msg = msg;
+    so->so_id = msg_id;
+    snprintf(so->so_name, sizeof(so->so_name), "%s", (name == NULL) ? "" : name);
+
+    if (st->st_tail == NULL)
+        st->st_head = so;
+    else
+        st->st_tail->so_next = so;
+
+    st->st_tail = so;
+
+    return 0;
+}
+
+static void
+stomp_tx_destroy(stomp_data_t *ss, stomp_tx_t *st)
+{
+    stomp_tx_t **p;
+    stomp_txop_t *so;
+
+    for (p = &ss->ss_txs; *p != NULL; p = &(*p)->st_next) {
+        if (*p == st) {
+            *p = st->st_next;
+            break;
         }
     }
 
-    if (ss->ss_slen > 0) {
-        plog(LOG_DEBUG, "%s: [output] len = %d, buf = >>>\n%s<<<", __func__, ss->ss_slen, ss->ss_sbuf);
+    while ((so = st->st_head) != NULL) {
+        st->st_head = so->so_next;
+        if (so->so_msg != NULL)
+            message_unref(so->so_msg);
+        sf_pool_free(&StompTxopPool, so);
+    }
+
+    sf_pool_free(&StompTxPool, st);
+}
+
+/* called with the shared binding lock held */
+static int
+stomp_enqueue0(sf_t *sf, char *dest, binding_t *bi, struct iovec *iov, int iovcnt, uint64_t *batch)
+{
+    int i, count;
+    binding_t **matches;
+    message_t *msg;
+
+    if (bi != NULL && (bi->bi_flags & BINDING_F_DURABLE))
+        return binding_append(bi, iov, iovcnt, batch);
+
+    /* topic subscriptions with wildcards */
+    count = (strncmp(dest, "/topic/", 7) == 0) ? binding_trie_match(&BindingTrie, dest, &matches) : 0;
+
+    if (bi == NULL && count == 0) {
+        if (!msglog_enabled() || strncmp(dest, "/queue/", 7) != 0) {
+            plog(LOG_DEBUG, "%s: discard message due to no binding found", __func__);
+            return 0;   /* silent discard */
+        }
+
+        /*
+         * a durable queue keeps messages until someone subscribes.  it is
+         * created under the exclusive lock, and as durable bindings are
+         * never destroyed, it is still there once the shared lock is back
+         */
+        binding_unlock();
+        binding_lock();
+
+        if ((bi = binding_hash_lookup(&BindingHash, dest)) == NULL)
+            bi = binding_queue_create(dest, NULL);
 
-        if ((sent_len = sf_send(sf, ss->ss_sbuf, ss->ss_slen)) < 0) {
-            plog(LOG_ERR, "%s: sf_send() failed", __func__);
+        binding_unlock();
+        binding_lock_shared();
+
+        if (bi == NULL) {
+            plog(LOG_ERR, "%s: binding_queue_create() failed", __func__);
             return -1;
         }
 
-        ss->ss_sbuf += sent_len;
-        ss->ss_slen -= sent_len;
+        return binding_append(bi, iov, iovcnt, batch);
+    }
+
+    /* copied once here; every subscriber queue holds a reference */
+    if ((msg = message_create(iov, iovcnt)) == NULL) {
+        plog(LOG_ERR, "%s: message_create() failed", __func__);
+        return -1;
+    }
+
+    if (bi != NULL && binding_push_msg(bi, msg) < 0)
+        plog(LOG_DEBUG, "%s: binding_push_msg() failed", __func__);   /* silent discard */
+
+    for (i = 0; i < count; i++) {
+        if (matches[i] != bi && binding_push_msg(matches[i], msg) < 0)
+            plog(LOG_DEBUG, "%s: binding_push_msg() failed", __func__);
+    }
+
+    message_unref(msg);
+
+    return 0;
+}
+
+/* must be called with the shared binding lock held */
+static stomp_dest_t *
+stomp_dest_lookup(stomp_data_t *ss, char *dest, int dest_len)
+{
+    int i;
+    stomp_dest_t *sd;
+
+    if (dest_len >= BINDING_NAME_MAX)
+        return NULL;
+
+    for (i = 0; i < STOMP_DEST_CACHE; i++) {
+        sd = &ss->ss_dest[i];
+        if (sd->sd_len == dest_len && dest_len > 0 && memcmp(sd->sd_name, dest, dest_len) == 0)
+            break;
+    }
 
-        if (ss->ss_slen == 0)
-            msgqueue_pop_msg(ss->ss_msgq);
+    if (i == STOMP_DEST_CACHE) {
+        sd = &ss->ss_dest[ss->ss_dest_next];
+        ss->ss_dest_next = (ss->ss_dest_next + 1) % STOMP_DEST_CACHE;
+
+        memcpy(sd->sd_name, dest, dest_len);
+        sd->sd_name[dest_len] = 0;
+        sd->sd_len = dest_len;
+    } else if (sd->sd_gen == BindingHash.bh_gen &&
+               (sd->sd_bind != NULL || sd->sd_add_gen == BindingHash.bh_add_gen))
+        return sd;
+
+    /* a binding destroyed since may be ours; one created since may fill a miss */
+    sd->sd_bind = binding_hash_lookup(&BindingHash, sd->sd_name);
+    sd->sd_gen = BindingHash.bh_gen;
+    sd->sd_add_gen = BindingHash.bh_add_gen;
+
+    return sd;
+}
+
+/* replies share the delivery queue so they never split a MESSAGE frame */
+static int
+stomp_reply(sf_t *sf, stomp_data_t *ss, message_t *msg)
+{
+    if (ss->ss_msgq == NULL && stomp_create_msgq(sf, ss) < 0) {
+        plog(LOG_ERR, "%s: stomp_create_msgq() failed", __func__);
+        return -1;
     }
 
+    return msgqueue_push_reply(ss->ss_msgq, msg);
+}
+
+static int
+stomp_create_msgq(sf_t *sf, stomp_data_t *ss)
+{
+    if ((ss->ss_msgq = msgqueue_create(StompQueueSize, stomp_push_notify, sf)) == NULL) {
+        plog(LOG_ERR, "%s: msgqueue_create() failed", __func__);
+        return -1;
+    }
+
+    msgqueue_set_pop_callback(ss->ss_msgq, stomp_sub_popped);
+
     return 0;
 }
 
+static void
+stomp_wait_unlink(stomp_data_t *ss)
+{
+    if (ss->ss_wait_prev != NULL)
+        ss->ss_wait_prev->ss_wait_next = ss->ss_wait_next;
+    else if (StompWaitList == ss)
+        StompWaitList = ss->ss_wait_next;
+
+    if (ss->ss_wait_next != NULL)
+        ss->ss_wait_next->ss_wait_prev = ss->ss_wait_prev;
+
+    ss->ss_wait_next = ss->ss_wait_prev = NULL;
+}
+
+/*
+ * returns 1 once the queue is empty, 0 if the socket is full.
+ * only this thread pops the queue, so what was peeked stays queued while
+ * it is sent without the lock; pushers on other workers are not held up.
+ */
+static int
+stomp_send_resume0(sf_t *sf, stomp_data_t *ss)
+{
+    int i, count, off, sent_len, total;
+    struct iovec iov[STOMP_SEND_IOV];
+
+    plog(LOG_DEBUG, "%s: msgq = %p", __func__, ss->ss_msgq);
+
+    /* notifications are coalesced, so send until the queue is empty or the socket is full */
+    for (;;) {
+        msgqueue_lock(ss->ss_msgq);
+        count = msgqueue_peekv(ss->ss_msgq, iov, NELEMS(iov), STOMP_SEND_BUDGET);
+        msgqueue_unlock(ss->ss_msgq);
+
+        if (count == 0) {
+            plog(LOG_DEBUG, "%s: queue empty", __func__);
+            return 1;
+        }
+
+        /* skip what was sent of the head message, which may span two iovecs */
+        for (i = 0, off = ss->ss_soff; off >= iov[i].iov_len; i++)
+            off -= iov[i].iov_len;
+
+        iov[i].iov_base = (char *) iov[i].iov_base + off;
+        iov[i].iov_len -= off;
+
+        plog(LOG_DEBUG, "%s: [output] %d iovecs", __func__, count - i);
+
+        if ((sent_len = sf_sendv(sf, iov + i, count - i)) < 0) {
+            plog(LOG_ERR, "%s: sf_sendv() failed", __func__);
+            return -1;
+        }
+
+        for (total = 0; i < count; i++)
+            total += iov[i].iov_len;
+
+        msgqueue_lock(ss->ss_msgq);
+        ss->ss_soff = msgqueue_consume(ss->ss_msgq, ss->ss_soff + sent_len);
+        msgqueue_unlock(ss->ss_msgq);
+
+        if (sent_len < total)
+            return 0;
+    }
+}
+
 static binding_t *
 stomp_new_binding(char *dest, msgsink_t *sink)
 {
@@ -271,5 +1241,12 @@ stomp_new_binding(char *dest, msgsink_t *sink)
 static void
 stomp_push_notify(void *param)
 {
-    stomp_send_resume((sf_t *) param);
+    sf_notify_output((sf_t *) param);
+}
+
+/* called with the drained queue locked, so input resumes later on the owner thread */
+static void
+stomp_unblock_notify(void *param)
+{
+    sf_resume_input((sf_t *) param);
 }
@@ -30,13 +30,55 @@
 #ifndef STOMP_SUBR_H
 #define STOMP_SUBR_H
 
+#define STOMP_HEADERS_MAX       32   /* a frame with more is refused */
+
+#define STOMP_ACKMODE_AUTO                 0
+#define STOMP_ACKMODE_CLIENT               1   /* cumulative */
+#define STOMP_ACKMODE_CLIENT_INDIVIDUAL    2
+
+#define STOMP_PARSE_COMMAND     0
+#define STOMP_PARSE_HEADER      1
+#define STOMP_PARSE_BODY        2
+#define STOMP_PARSE_DONE        3
+
+/* SUBSCRIBE headers besides the destination */
+typedef struct {
+    char     *sso_id;         /* subscription id, or empty */
+    int       sso_ack;        /* STOMP_ACKMODE_* */
+    int       sso_prefetch;   /* outstanding messages of a queue subscriber, 0: unlimited */
+    int       sso_weight;     /* share under weighted dispatch */
+    char     *sso_dispatch;   /* dispatch policy for the queue, or empty */
+} stomp_subopts_t;
+
+/* frame parser state; offsets are relative to the head of the receive buffer */
+typedef struct {
+    int       sp_state;
+    int       sp_off;       /* bytes already scanned */
+    int       sp_cmd;       /* command line */
+    int       sp_line;      /* line being scanned */
+    int       sp_body;
+    int       sp_clen;      /* content-length, -1 if absent */
+    int       sp_len;       /* frame length when done */
+    int       sp_nhdr;
+    int       sp_hdr[STOMP_HEADERS_MAX];
+} stomp_parser_t;
+
+void stomp_set_queue_size(size_t size);
 int stomp_create_session(sf_t *sf);
 void stomp_destroy_session(sf_t *sf);
 int stomp_get_state(sf_t *sf);
+stomp_parser_t *stomp_get_parser(sf_t *sf);
 void stomp_set_state(sf_t *sf, int state);
-int stomp_subscribe(sf_t *sf, char *dest);
-int stomp_unsubscribe(sf_t *sf, char *dest);
-int stomp_enqueue(sf_t *sf, char *dest, struct iovec *iov, int iovcnt);
+int stomp_subscribe(sf_t *sf, char *dest, stomp_subopts_t *opts);
+int stomp_unsubscribe(sf_t *sf, char *dest, char *id);
+int stomp_enqueue(sf_t *sf, char *dest, int dest_len, struct iovec *iov, int iovcnt, uint64_t *batch);
+int stomp_ack(sf_t *sf, char *sub_id, uint64_t msg_id, char *tx);
+int stomp_begin(sf_t *sf, char *tx);
+int stomp_tx_send(sf_t *sf, char *tx, char *dest, int dest_len, struct iovec *iov, int iovcnt);
+int stomp_commit(sf_t *sf, char *tx, uint64_t *batch);
+int stomp_abort(sf_t *sf, char *tx);
+int stomp_receipt(sf_t *sf, char *buf, int len, uint64_t batch);
+void stomp_release_receipts(void);
 int stomp_send_resume(sf_t *sf);
 
 #endif
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * a producer floods a topic whose only subscriber reads slowly, so the
+ * broker has to hold the producer back at the subscriber's queue limit
+ * (run it with a small -q). every message has to arrive, in order.
+ *
+ * usage: test_flow [count] [size]
+ */
+
+#define TEST_PORT       61613
+#define TEST_TIMEOUT    5000   /* msec without a message */
+#define TEST_DEST       "/topic/test_flow"
+
+static int test_connect(void);
+static int test_write(int fd, char *buf, int len);
+static void test_produce(int count, int size);
+static int test_consume(int fd, int count);
+
+int
+main(int argc, char *argv[])
+{
+    int fd, count, size, received, status;
+    pid_t pid;
+
+    count = (argc > 1) ? atoi(argv[1]) : 30000;
+    size = (argc > 2) ? atoi(argv[2]) : 500;
+
+    if ((fd = test_connect()) < 0)
+        return EXIT_FAILURE;
+
+    if (test_write(fd, "SUBSCRIBE\ndestination:" TEST_DEST "\n\n", sizeof("SUBSCRIBE\ndestination:" TEST_DEST "\n\n")) < 0) {
+        perror("write");
+        return EXIT_FAILURE;
+    }
+
+    /* the subscription is in place before anything is sent */
+    usleep(200 * 1000);
+
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+
+    if (pid == 0) {
+        test_produce(count, size);
+        _exit(EXIT_SUCCESS);
+    }
+
+    received = test_consume(fd, count);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    close(fd);
+
+    printf("%s: received %d of %d\n", argv[0], received, count);
+
+    return (received == count) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* connected and answered; the socket is left blocking */
+static int
+test_connect(void)
+{
+    int fd, rcvbuf = 4096;
+    char buf[512];
+    struct sockaddr_in sin;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(TEST_PORT);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    /* a small window keeps the subscriber slow on the broker's side too */
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    if (test_write(fd, "CONNECT\n\n", 10) < 0 || read(fd, buf, sizeof(buf)) < 9 || memcmp(buf, "CONNECTED", 9) != 0) {
+        fprintf(stderr, "not connected\n");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+test_write(int fd, char *buf, int len)
+{
+    int n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* as fast as the broker takes them */
+static void
+test_produce(int count, int size)
+{
+    int i, fd, len;
+    char *frame;
+
+    if ((fd = test_connect()) < 0 || (frame = malloc(size + 128)) == NULL)
+        _exit(EXIT_FAILURE);
+
+    for (i = 0; i < count; i++) {
+        len = snprintf(frame, 128, "SEND\ndestination:" TEST_DEST "\n\n%d:", i);
+        memset(frame + len, 'x', size);
+        len += size;
+        frame[len++] = 0;
+
+        if (test_write(fd, frame, len) < 0)
+            _exit(EXIT_FAILURE);
+    }
+
+    /* the broker may still hold some of it in the socket */
+    pause();
+}
+
+/* returns the number of messages received in order */
+static int
+test_consume(int fd, int count)
+{
+    int n, len = 0, received = 0;
+    char *buf, *p, *end, *body;
+    struct pollfd pfd;
+    size_t bufsize = 256 * 1024;
+
+    if ((buf = malloc(bufsize)) == NULL)
+        return 0;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (received < count) {
+        if (poll(&pfd, 1, TEST_TIMEOUT) <= 0 || (n = read(fd, buf + len, bufsize - len)) <= 0)
+            break;
+
+        len += n;
+        p = buf;
+
+        while ((end = memchr(p, 0, len - (p - buf))) != NULL) {
+            /* heartbeat newlines between frames */
+            while (*p == '\n')
+                p++;
+
+            if ((body = strstr(p, "\n\n")) != NULL && atoi(body + 2) == received)
+                received++;
+            else if (body != NULL && strncmp(p, "MESSAGE", 7) == 0) {
+                fprintf(stderr, "message %d where %d was expected\n", atoi(body + 2), received);
+                free(buf);
+                return received;
+            }
+
+            p = end + 1;
+        }
+
+        len -= p - buf;
+        memmove(buf, p, len);
+
+        /* slow: the queue fills up while this sleeps */
+        if (received % 100 < 10)
+            usleep(1000);
+    }
+
+    free(buf);
+
+    return received;
+}
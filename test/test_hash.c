@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2011 Satoshi Ebisawa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. The names of its contributors may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mqcore/binding.c"
+
+/*
+ * hash dispatch of message groups over members that sit at a fixed
+ * stride, as pool allocated sessions do. each member has to get its
+ * share of the groups within TEST_TOLERANCE. the policies are static,
+ * so the source is included here.
+ *
+ * usage: test_hash [groups]
+ */
+
+#define TEST_STRIDE      200
+#define TEST_TOLERANCE   0.05
+
+static uint32_t TestKey;
+
+static uint32_t test_group(message_t *msg);
+static uint32_t test_fnv(int n);
+
+int
+main(int argc, char *argv[])
+{
+    int i, n, count, strict, failed = 0;
+    int hits[BINDING_MEMBERS_MAX];
+    char *arena;
+    double share;
+    binding_queue_t bq;
+    binding_member_t members[BINDING_MEMBERS_MAX];
+
+    count = (argc > 1) ? atoi(argv[1]) : 100000;
+
+    if ((arena = calloc(BINDING_MEMBERS_MAX, TEST_STRIDE)) == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    binding_set_group_func(test_group);
+
+    memset(&bq, 0, sizeof(bq));
+    memset(members, 0, sizeof(members));
+    bq.biq_binding.bi_members = members;
+
+    for (i = 0; i < BINDING_MEMBERS_MAX; i++)
+        members[i].bm_sink = (msgsink_t *) (arena + i * TEST_STRIDE);
+
+    for (n = 2; n <= BINDING_MEMBERS_MAX; n++) {
+        bq.biq_binding.bi_members_count = n;
+        memset(hits, 0, sizeof(hits));
+
+        for (i = 0; i < count; i++) {
+            TestKey = test_fnv(i);
+            hits[binding_select_hash(&bq, NULL, &strict)]++;
+        }
+
+        for (i = 0; i < n; i++) {
+            share = (double) hits[i] * n / count;
+            if (share < 1 - TEST_TOLERANCE || share > 1 + TEST_TOLERANCE) {
+                printf("%s: %d members: member %d has %d of %d groups\n", argv[0], n, i, hits[i], count);
+                failed++;
+            }
+        }
+    }
+
+    printf("%s: %d groups over 2 to %d members, %d out of tolerance\n", argv[0], count, BINDING_MEMBERS_MAX, failed);
+
+    free(arena);
+
+    return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static uint32_t
+test_group(message_t *msg)
+{
+    return TestKey;
+}
+
+/* FNV-1a of the group name, as stomp_message_group() hashes it */
+static uint32_t
+test_fnv(int n)
+{
+    char name[32], *p;
+    uint32_t hash = 2166136261U;
+
+    snprintf(name, sizeof(name), "group-%d", n);
+
+    for (p = name; *p != 0; p++) {
+        hash ^= *((unsigned char *) p);
+        hash *= 16777619;
+    }
+
+    return (hash == 0) ? 1 : hash;
+}